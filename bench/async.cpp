@@ -0,0 +1,132 @@
+#include "bench.hpp"
+
+#include <fs.hpp>
+
+#include <atomic>
+#include <random>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace bench {
+    namespace {
+        constexpr std::size_t block_size = 4096;
+        constexpr std::size_t file_blocks = 2048; // 8 MiB file
+        constexpr std::size_t cache_budget = 2 * 1024 * 1024; // a quarter of the file
+        constexpr std::size_t reads_per_reader = 8;
+        constexpr std::size_t executor_threads = 4;
+        constexpr std::size_t reader_counts[] = {100, 1000, 4000};
+
+        std::byte pattern(std::size_t block) {
+            return std::byte(block % 251);
+        }
+
+        // every reader has its own handle and reads random blocks of the file, checking their bytes
+        lab_fs::task<> reader(lab_fs::file_system *fs, lab_fs::executor &ex, std::size_t i, unsigned seed, bool blocking,
+                              std::atomic<std::size_t> &bad) {
+            std::mt19937 random{seed};
+            std::vector<std::byte> buffer(block_size);
+            for (std::size_t k = 0; k < reads_per_reader; k++) {
+                auto block = random() % file_blocks;
+                fs->lseek(i, block * block_size);
+                std::pair<std::size_t, lab_fs::fs_result> res;
+                if (blocking) {
+                    // how every call which missed the cache ran before: in a thread of the executor, waiting for the device
+                    co_await ex.schedule();
+                    res = fs->read(i, buffer);
+                } else {
+                    res = co_await fs->async_read(i, buffer);
+                }
+                if (res.first != block_size || buffer.front() != pattern(block) || buffer.back() != pattern(block)) {
+                    bad.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // the image is dropped from the page cache before each case, so blocks missing from the block cache
+        // are read from the disk
+        bool async_case(const std::string &path, std::size_t readers_no, bool blocking) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd != -1) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                ::close(fd);
+            }
+            auto [fs, init_res] = lab_fs::file_system::init(1, 1, file_blocks + 64, block_size, path, lab_fs::io_engine::ASYNC,
+                                                            cache_budget, {lab_fs::dir_format::FLAT, lab_fs::file_format::EXTENT},
+                                                            {}, readers_no + 1);
+            const char *name = blocking ? "blocking" : "fetching";
+            if (init_res != lab_fs::RESTORED) {
+                std::printf("%-8s: failed to restore image\n", name);
+                return false;
+            }
+
+            std::vector<std::size_t> handles;
+            for (std::size_t k = 0; k < readers_no; k++) {
+                auto [i, res] = fs->open("data");
+                if (res != lab_fs::SUCCESS) {
+                    std::printf("%-8s: failed to open %zu handles\n", name, readers_no);
+                    delete fs;
+                    return false;
+                }
+                handles.push_back(i);
+            }
+
+            std::atomic<std::size_t> bad{0};
+            double total_s;
+            {
+                lab_fs::executor ex{executor_threads};
+                fs->attach(&ex);
+                auto start = clock::now();
+                for (std::size_t k = 0; k < readers_no; k++) {
+                    lab_fs::spawn(ex, reader(fs, ex, handles[k], (unsigned) k, blocking, bad));
+                }
+                ex.wait();
+                total_s = seconds_since(start);
+            }
+            fs->attach(nullptr);
+
+            auto reads = readers_no * reads_per_reader;
+            auto &stats = fs->cache_stats();
+            std::printf("%-8s %4zu readers: %8.0f reads/s, %5zu misses, %5zu blocks fetched%s\n",
+                        name, readers_no, (double) reads / total_s, stats.misses, stats.fetched,
+                        bad == 0 ? "" : (", " + std::to_string(bad.load()) + " reads returned wrong data").c_str());
+            for (auto i : handles) {
+                fs->close(i);
+            }
+            delete fs;
+            return bad == 0;
+        }
+    } //namespace
+
+    bool async() {
+        const auto path = image_path("async");
+        ::unlink(path.c_str());
+        auto [fs, init_res] = lab_fs::file_system::init(1, 1, file_blocks + 64, block_size, path, lab_fs::io_engine::FILE,
+                                                        lab_fs::file_system::constraints::cache_budget,
+                                                        {lab_fs::dir_format::FLAT, lab_fs::file_format::EXTENT});
+        if (init_res != lab_fs::CREATED) {
+            std::printf("failed to create image\n");
+            return false;
+        }
+        fs->create("data");
+        auto i = fs->open("data").first;
+        std::vector<std::byte> block(block_size);
+        for (std::size_t k = 0; k < file_blocks; k++) {
+            std::fill(block.begin(), block.end(), pattern(k));
+            fs->write(i, block);
+        }
+        fs->close(i);
+        fs->save();
+        delete fs;
+
+        bool ok = true;
+        for (auto readers_no : reader_counts) {
+            ok &= async_case(path, readers_no, true);
+            ok &= async_case(path, readers_no, false);
+        }
+        ::unlink(path.c_str());
+        return ok;
+    }
+
+} //namespace bench
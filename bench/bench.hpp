@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+// small timing helpers shared by the benchmarks; each benchmark prints one line per measured case
+// and returns false if results of some case were wrong or incomplete
+namespace bench {
+    using clock = std::chrono::steady_clock;
+
+    inline double seconds_since(clock::time_point start) {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    inline double mib_per_s(std::size_t bytes, double seconds) {
+        return (double) bytes / (1024.0 * 1024.0) / seconds;
+    }
+
+    // images are created in the working directory and removed once measured
+    inline std::string image_path(const std::string &name) {
+        return "bench_" + name + ".fs";
+    }
+
+    // conformance of the device engines to one pattern written and read by every path, then their
+    // throughput, raw and under the file system
+    bool engines();
+
+    // creates in a hashed directory growing to 100k files, for both file formats
+    bool directory();
+
+    // small calls served by code with block size and record sizes built in against code reading them from the image
+    bool layout();
+
+    // pins of 1 to 64 threads on a cache a quarter of the device, over a file and a slow device
+    bool cache();
+
+    // create, open, write, read back and close of 1 to 64 threads, each on its own file, through file_system
+    bool threads();
+
+    // block claims of 1 to 64 threads on the lock-free bitmap against a locked bit vector scan
+    bool bitmap();
+
+    // random 4 KiB requests in batches of 1 to 64 on io_uring and thread pool queues against plain syscalls
+    bool queue();
+
+    // thousands of coroutines reading random blocks with awaited calls, fetching against blocking executor threads
+    bool async();
+
+} //namespace bench
@@ -0,0 +1,152 @@
+#include "bench.hpp"
+
+#include <bitmap.hpp>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bench {
+    namespace {
+        constexpr std::size_t blocks_no = 1 << 20;
+        constexpr std::size_t free_gap = 16; // free runs between occupied ones three times as long
+        constexpr std::size_t ops_per_thread = 50000;
+        constexpr std::size_t held_per_thread = 64; // blocks a thread keeps before releasing its oldest
+        constexpr std::size_t run_length = 8; // every eighth claim asks for a run
+        constexpr std::size_t thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+
+        // allocator the bitmap replaced: one lock over a bit vector searched next-fit a bit at a time
+        class locked_scan {
+        public:
+            explicit locked_scan(std::size_t size) :
+                    _bits(size, false) {}
+
+            void set(std::size_t i) {
+                _bits[i] = true;
+            }
+
+            std::pair<std::size_t, std::size_t> claim_run(std::size_t n) {
+                std::lock_guard lock{_mutex};
+                std::pair<std::size_t, std::size_t> best{0, 0};
+                for (std::size_t k = 0; k < _bits.size(); k++) {
+                    auto i = (_hint + k) % _bits.size();
+                    if (_bits[i]) {
+                        continue;
+                    }
+                    std::size_t length = 0;
+                    while (length < n && i + length < _bits.size() && !_bits[i + length]) {
+                        length++;
+                    }
+                    if (length > best.second) {
+                        best = {i, length};
+                    }
+                    if (length == n) {
+                        break;
+                    }
+                    k += length;
+                }
+                for (std::size_t k = 0; k < best.second; k++) {
+                    _bits[best.first + k] = true;
+                }
+                _hint = best.first + best.second;
+                return best;
+            }
+
+            void release(std::size_t i) {
+                std::lock_guard lock{_mutex};
+                _bits[i] = false;
+            }
+
+        private:
+            std::vector<bool> _bits;
+            std::size_t _hint = 0;
+            std::mutex _mutex;
+        };
+
+        // block_bitmap used the way allocate_run does: a reservation, then a claim under it
+        struct atomic_words {
+            explicit atomic_words(std::size_t size) :
+                    bitmap{size} {}
+
+            void set(std::size_t i) {
+                bitmap.set(i, true);
+            }
+
+            std::pair<std::size_t, std::size_t> claim_run(std::size_t n) {
+                if ((n = bitmap.reserve(n)) == 0) {
+                    return {0, 0};
+                }
+                auto run = bitmap.claim_run(n);
+                bitmap.unreserve(n - run.second);
+                return run;
+            }
+
+            void release(std::size_t i) {
+                bitmap.release(i);
+            }
+
+            lab_fs::block_bitmap bitmap;
+        };
+
+        // threads claim blocks and runs and release the oldest ones they hold, so free space keeps moving
+        // around a bitmap three quarters full; claims which find nothing are counted as failed
+        template <class Allocator>
+        void bitmap_case(const char *name) {
+            double single_s = 0;
+            for (auto threads_no : thread_counts) {
+                Allocator allocator{blocks_no};
+                for (std::size_t i = 0; i < blocks_no; i++) {
+                    if (i / free_gap % 4 != 0) {
+                        allocator.set(i);
+                    }
+                }
+
+                std::atomic<std::size_t> failed{0};
+                auto start = clock::now();
+                {
+                    std::vector<std::jthread> threads;
+                    for (std::size_t t = 0; t < threads_no; t++) {
+                        threads.emplace_back([&] {
+                            std::deque<std::size_t> held;
+                            for (std::size_t k = 0; k < ops_per_thread; k++) {
+                                auto [first, length] = allocator.claim_run(k % run_length == 0 ? run_length : 1);
+                                if (length == 0) {
+                                    failed.fetch_add(1, std::memory_order_relaxed);
+                                }
+                                for (std::size_t i = first; i < first + length; i++) {
+                                    held.push_back(i);
+                                }
+                                while (held.size() > held_per_thread) {
+                                    allocator.release(held.front());
+                                    held.pop_front();
+                                }
+                            }
+                            for (auto i : held) {
+                                allocator.release(i);
+                            }
+                        });
+                    }
+                }
+                auto total_s = seconds_since(start);
+                if (threads_no == 1) {
+                    single_s = total_s;
+                }
+                std::printf("%-9s %2zu threads: %6.2f Mclaims/s, %5.2fx of one thread%s\n",
+                            name, threads_no, (double) (threads_no * ops_per_thread) / total_s / 1e6,
+                            single_s * (double) threads_no / total_s,
+                            failed == 0 ? "" : (", " + std::to_string(failed.load()) + " claims failed").c_str());
+            }
+        }
+    } //namespace
+
+    // claims which find nothing are part of what is measured, so results can't be wrong
+    bool bitmap() {
+        bitmap_case<atomic_words>("atomic");
+        bitmap_case<locked_scan>("locked");
+        return true;
+    }
+
+} //namespace bench
@@ -0,0 +1,132 @@
+#include "bench.hpp"
+
+#include <block_cache.hpp>
+#include <io_engines.hpp>
+
+#include <chrono>
+#include <functional>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace bench {
+    namespace {
+        constexpr std::size_t block_size = 4096;
+        constexpr std::size_t blocks_no = 4096;
+        constexpr std::size_t cache_blocks = 1024; // a quarter of the blocks fits, so most pins miss
+        constexpr std::size_t ops_per_thread = 20000;
+        constexpr std::size_t thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+        constexpr std::size_t slot_size = 8;
+
+        // memory device which waits on every transfer the way a disk does; a thread waiting on it
+        // leaves the CPU to others, so the cache scales only if it doesn't keep its lock meanwhile
+        class slow_io : public lab_fs::memory_io {
+        public:
+            slow_io(std::size_t blocks_no, std::size_t block_size, std::chrono::microseconds latency) :
+                    memory_io{blocks_no, block_size},
+                    _latency{latency} {}
+
+            using io::read_block;
+            using io::write_block;
+
+            bool read_block(std::size_t i, std::span<std::byte> dest) override {
+                std::this_thread::sleep_for(_latency);
+                return memory_io::read_block(i, dest);
+            }
+
+            bool write_block(std::size_t i, std::span<const std::byte> src) override {
+                std::this_thread::sleep_for(_latency);
+                return memory_io::write_block(i, src);
+            }
+
+            bool transfer(std::span<const lab_fs::block_transfer> batch) override {
+                std::this_thread::sleep_for(_latency);
+                bool res = true;
+                for (auto &run : batch) {
+                    for (std::size_t k = 0; k < block_of(run.data.size()); k++) {
+                        auto data = run.data.subspan(k * _block_size, _block_size);
+                        res &= run.write ? memory_io::write_block(run.block + k, data) : memory_io::read_block(run.block + k, data);
+                    }
+                }
+                return res;
+            }
+
+        private:
+            std::chrono::microseconds _latency;
+        };
+
+        // every thread pins random blocks and writes its own slot of one pin in four, the way files
+        // of different threads share metadata blocks; afterwards each slot must hold the last value
+        // its thread wrote, whatever was evicted and loaded again in between
+        bool cache_case(const char *name, const std::function<std::unique_ptr<lab_fs::io>()> &open_device, std::size_t ops) {
+            bool ok = true;
+            double single_s = 0;
+            for (auto threads_no : thread_counts) {
+                auto device = open_device();
+                if (!device) {
+                    std::printf("%-6s: failed to open device\n", name);
+                    return false;
+                }
+                lab_fs::block_cache cache{std::move(device), cache_blocks * block_size};
+
+                std::vector<std::vector<std::uint64_t>> written(threads_no, std::vector<std::uint64_t>(blocks_no, 0));
+                auto start = clock::now();
+                {
+                    std::vector<std::jthread> threads;
+                    for (std::size_t t = 0; t < threads_no; t++) {
+                        threads.emplace_back([&, t] {
+                            std::mt19937 random{(unsigned) t};
+                            for (std::size_t k = 1; k <= ops; k++) {
+                                auto i = random() % blocks_no;
+                                auto block = cache.acquire(i);
+                                if (k % 4 == 0) {
+                                    lab_fs::utils::store_le(block.data(), t * slot_size, slot_size, k);
+                                    block.mark_dirty();
+                                    written[t][i] = k;
+                                }
+                            }
+                        });
+                    }
+                }
+                auto total_s = seconds_since(start);
+                if (threads_no == 1) {
+                    single_s = total_s;
+                }
+
+                auto stats = cache.get_stats();
+                std::size_t lost = 0;
+                for (std::size_t i = 0; i < blocks_no; i++) {
+                    auto block = cache.acquire(i);
+                    for (std::size_t t = 0; t < threads_no; t++) {
+                        lost += lab_fs::utils::load_le(block.data(), t * slot_size, slot_size) != written[t][i];
+                    }
+                }
+
+                std::printf("%-6s %2zu threads: %9.0f pins/s, %5.2fx of one thread, %4.1f%% hits, %zu write-backs%s\n",
+                            name, threads_no, (double) (threads_no * ops) / total_s,
+                            single_s * (double) threads_no / total_s,
+                            100.0 * (double) stats.hits / (double) std::max<std::size_t>(stats.hits + stats.misses, 1),
+                            stats.write_backs, lost == 0 ? "" : " (slots lost)");
+                ok &= lost == 0;
+            }
+            return ok;
+        }
+    } //namespace
+
+    bool cache() {
+        const auto path = image_path("cache");
+        bool ok = cache_case("file", [&path] {
+            ::unlink(path.c_str());
+            bool created = false;
+            return lab_fs::open_io(lab_fs::io_engine::FILE, path, blocks_no, block_size, created);
+        }, ops_per_thread);
+        ::unlink(path.c_str());
+
+        // a 100 us device is slow enough that fewer operations show the same
+        ok &= cache_case("slow", [] {
+            return std::make_unique<slow_io>(blocks_no, block_size, std::chrono::microseconds{100});
+        }, ops_per_thread / 10);
+        return ok;
+    }
+
+} //namespace bench
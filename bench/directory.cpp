@@ -0,0 +1,82 @@
+#include "bench.hpp"
+
+#include <fs.hpp>
+
+#include <string>
+#include <vector>
+
+namespace bench {
+    namespace {
+        constexpr std::size_t files_no = 100000;
+        constexpr std::size_t report_every = 25000;
+
+        std::string file_name(std::size_t k) {
+            std::string name{"f"};
+            return name.append(std::to_string(k));
+        }
+
+        // 2^19 blocks of 512 bytes; one file in ten gets a block of data, so directory blocks
+        // are allocated between blocks of files
+        bool directory_case(lab_fs::file_format files) {
+            const auto path = image_path("directory");
+            ::unlink(path.c_str());
+            auto [fs, init_res] = lab_fs::file_system::init(512, 32, 32, 512, path, lab_fs::io_engine::MEMORY,
+                                                            lab_fs::file_system::constraints::cache_budget,
+                                                            {lab_fs::dir_format::HASHED, files});
+            const char *format = files == lab_fs::file_format::EXTENT ? "extent" : "direct";
+            if (init_res != lab_fs::CREATED) {
+                std::printf("%s: failed to create image\n", format);
+                return false;
+            }
+
+            std::vector<std::byte> data(512, std::byte{1});
+            auto start = clock::now();
+            auto last = start;
+            std::size_t created = 0;
+            auto res = lab_fs::SUCCESS;
+            while (created < files_no) {
+                auto name = file_name(created);
+                if (res = fs->create(name); res != lab_fs::SUCCESS) {
+                    break;
+                }
+                if (created % 10 == 0) {
+                    auto [i, open_res] = fs->open(name);
+                    fs->write(i, data);
+                    fs->close(i);
+                }
+                if (++created % report_every == 0) {
+                    std::printf("%s: %6zu files, last %zu created in %6.2f s\n",
+                                format, created, report_every, seconds_since(last));
+                    last = clock::now();
+                }
+            }
+            auto total_s = seconds_since(start);
+
+            std::size_t found = 0;
+            std::size_t lookups = 0;
+            start = clock::now();
+            for (std::size_t k = 0; k < created; k += 97, lookups++) {
+                auto [i, open_res] = fs->open(file_name(k));
+                if (open_res == lab_fs::SUCCESS) {
+                    found++;
+                    fs->close(i);
+                }
+            }
+            std::printf("%s: %zu files in %.2f s (%.0f creates/s)%s, lookups %.1f us each%s\n",
+                        format, created, total_s, (double) created / total_s,
+                        res == lab_fs::SUCCESS ? "" : ", stopped by an error",
+                        seconds_since(start) * 1e6 / (double) std::max<std::size_t>(found, 1),
+                        found == lookups ? "" : " (files not found)");
+            delete fs;
+            ::unlink(path.c_str());
+            return res == lab_fs::SUCCESS && found == lookups;
+        }
+    } //namespace
+
+    bool directory() {
+        bool ok = directory_case(lab_fs::file_format::EXTENT);
+        ok &= directory_case(lab_fs::file_format::DIRECT);
+        return ok;
+    }
+
+} //namespace bench
@@ -0,0 +1,290 @@
+#include "bench.hpp"
+
+#include <fs.hpp>
+#include <io_engines.hpp>
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace bench {
+    namespace {
+        constexpr std::size_t block_size = 4096;
+        constexpr std::size_t blocks_no = 4096; // 16 MiB image
+        constexpr std::size_t run_blocks = 64;
+        constexpr std::size_t random_reads = 4096;
+        constexpr std::size_t file_bytes = 8 * 1024 * 1024;
+        constexpr std::size_t chunk = 64 * 1024;
+        constexpr std::size_t paths_no = 4; // single blocks, runs, batches of runs and pins
+        constexpr std::size_t part_blocks = 64; // blocks written by one path in a round
+        constexpr std::size_t part_run_blocks = 8;
+
+        struct engine_case {
+            const char *name;
+            lab_fs::io_engine engine;
+        };
+
+        const engine_case engine_cases[] = {
+            {"memory", lab_fs::io_engine::MEMORY},
+            {"file",   lab_fs::io_engine::FILE},
+            {"mmap",   lab_fs::io_engine::MMAP},
+            {"async",  lab_fs::io_engine::ASYNC},
+        };
+
+        const char *const path_names[paths_no] = {"single blocks", "runs", "a batch", "pins"};
+
+        std::byte pattern(std::size_t block, std::size_t k, std::size_t round) {
+            return std::byte((block * 7 + k + round * 101) % 251);
+        }
+
+        void fill(std::span<std::byte> data, std::size_t block, std::size_t round) {
+            for (std::size_t k = 0; k < data.size(); k++) {
+                data[k] = pattern(block + k / block_size, k % block_size, round);
+            }
+        }
+
+        bool holds(std::span<const std::byte> data, std::size_t block, std::size_t round) {
+            for (std::size_t k = 0; k < data.size(); k++) {
+                if (data[k] != pattern(block + k / block_size, k % block_size, round)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // blocks [first, first + part_blocks) written by one path: one at a time, as runs, as one batch of
+        // runs in reverse order, or through pins
+        bool write_part(lab_fs::io &device, std::size_t path, std::size_t first, std::size_t round) {
+            std::vector<std::byte> data(part_blocks * block_size);
+            fill(data, first, round);
+            bool ok = true;
+            switch (path) {
+                case 0:
+                    for (std::size_t i = 0; i < part_blocks; i++) {
+                        ok &= device.write_block(first + i, std::span<const std::byte>{data}.subspan(i * block_size, block_size));
+                    }
+                    break;
+                case 1:
+                    for (std::size_t i = 0; i < part_blocks; i += part_run_blocks) {
+                        ok &= device.write_blocks(first + i, std::span<const std::byte>{data}.subspan(i * block_size, part_run_blocks * block_size));
+                    }
+                    break;
+                case 2: {
+                    std::vector<lab_fs::block_transfer> batch;
+                    for (std::size_t i = part_blocks; i > 0; i -= part_run_blocks) {
+                        auto run = i - part_run_blocks;
+                        batch.push_back({first + run, std::span{data}.subspan(run * block_size, part_run_blocks * block_size), true});
+                    }
+                    ok &= device.transfer(batch);
+                    break;
+                }
+                default:
+                    for (std::size_t i = 0; i < part_blocks; i++) {
+                        auto block = device.acquire(first + i);
+                        std::copy_n(data.begin() + (std::ptrdiff_t) (i * block_size), block_size, block.data().begin());
+                        block.mark_dirty();
+                    }
+            }
+            return ok;
+        }
+
+        // every block read back by each path must hold the pattern of `round`; returns the first path
+        // and block which don't
+        std::string verify(lab_fs::io &device, std::size_t blocks, std::size_t round) {
+            std::vector<std::byte> data(blocks * block_size);
+            auto failure = [&](std::size_t path) -> std::string {
+                for (std::size_t i = 0; i < blocks; i++) {
+                    if (!holds(std::span{data}.subspan(i * block_size, block_size), i, round)) {
+                        return std::string{"block "} + std::to_string(i) + " read by " + path_names[path] + " differs";
+                    }
+                }
+                return std::string{"reading by "} + path_names[path] + " failed";
+            };
+
+            bool ok = true;
+            for (std::size_t i = 0; i < blocks; i++) {
+                ok &= device.read_block(i, std::span{data}.subspan(i * block_size, block_size));
+            }
+            if (!ok || !holds(data, 0, round)) {
+                return failure(0);
+            }
+            std::fill(data.begin(), data.end(), std::byte{0});
+            for (std::size_t i = 0; i < blocks; i += part_run_blocks) {
+                ok &= device.read_blocks(i, std::span{data}.subspan(i * block_size, part_run_blocks * block_size));
+            }
+            if (!ok || !holds(data, 0, round)) {
+                return failure(1);
+            }
+            std::fill(data.begin(), data.end(), std::byte{0});
+            std::vector<lab_fs::block_transfer> batch;
+            for (std::size_t i = blocks; i > 0; i -= part_run_blocks) {
+                auto run = i - part_run_blocks;
+                batch.push_back({run, std::span{data}.subspan(run * block_size, part_run_blocks * block_size), false});
+            }
+            if (!device.transfer(batch) || !holds(data, 0, round)) {
+                return failure(2);
+            }
+            for (std::size_t i = 0; i < blocks; i++) {
+                auto block = device.acquire(i);
+                if (block.failed() || !holds(block.data(), i, round)) {
+                    return std::string{"block "} + std::to_string(i) + " read by pins differs";
+                }
+            }
+            return "";
+        }
+
+        // each path writes a part of the device, then the pattern is overwritten with the paths moved
+        // to other parts, so no path reads back only what it wrote itself; after both rounds every path
+        // reads the whole device, which is then synced, reopened and read again
+        bool conformance_case(const engine_case &c) {
+            const auto path = image_path(c.name);
+            ::unlink(path.c_str());
+            constexpr std::size_t blocks = paths_no * part_blocks;
+            bool created = false;
+            auto device = lab_fs::open_io(c.engine, path, blocks, block_size, created);
+            std::string failure = device ? "" : "failed to open image";
+            for (std::size_t round = 1; round <= 2 && failure.empty(); round++) {
+                for (std::size_t part = 0; part < paths_no && failure.empty(); part++) {
+                    auto write_path = (part + round - 1) % paths_no;
+                    if (!write_part(*device, write_path, part * part_blocks, round)) {
+                        failure = std::string{"writing by "} + path_names[write_path] + " failed";
+                    }
+                }
+                if (failure.empty()) {
+                    failure = verify(*device, blocks, round);
+                }
+            }
+
+            lab_fs::flush_stats flushed;
+            if (failure.empty() && (!device->sync(flushed) || flushed.failed)) {
+                failure = "sync failed";
+            }
+            if (failure.empty()) {
+                device.reset();
+                device = lab_fs::open_io(c.engine, path, blocks, block_size, created);
+                if (!device || created) {
+                    failure = "image not found on reopen";
+                } else if (failure = verify(*device, blocks, 2); !failure.empty()) {
+                    failure += " after reopen";
+                }
+            }
+
+            std::printf("%-7s conformance: %s\n", c.name, failure.empty() ? "passed" : ("FAILED, " + failure).c_str());
+            device.reset();
+            ::unlink(path.c_str());
+            return failure.empty();
+        }
+
+        // runs of blocks written and read back straight on the device, then single blocks read at random
+        bool device_case(const engine_case &c) {
+            const auto path = image_path(c.name);
+            ::unlink(path.c_str());
+            bool created = false;
+            auto device = lab_fs::open_io(c.engine, path, blocks_no, block_size, created);
+            if (!device) {
+                std::printf("%-7s device: failed to open image\n", c.name);
+                return false;
+            }
+
+            std::vector<std::byte> run(run_blocks * block_size, std::byte{0x5a});
+            bool ok = true;
+            auto start = clock::now();
+            for (std::size_t i = 0; i < blocks_no; i += run_blocks) {
+                ok &= device->write_blocks(i, run);
+            }
+            lab_fs::flush_stats flushed;
+            device->sync(flushed);
+            auto write_s = seconds_since(start);
+
+            start = clock::now();
+            for (std::size_t i = 0; i < blocks_no; i += run_blocks) {
+                ok &= device->read_blocks(i, run);
+            }
+            auto read_s = seconds_since(start);
+
+            std::mt19937 random{42};
+            std::vector<std::byte> block(block_size);
+            start = clock::now();
+            for (std::size_t k = 0; k < random_reads; k++) {
+                ok &= device->read_block(random() % blocks_no, block);
+            }
+            auto random_s = seconds_since(start);
+
+            std::printf("%-7s device: seq write %8.1f MiB/s, seq read %8.1f MiB/s, random read %8.1f MiB/s%s\n",
+                        c.name, mib_per_s(blocks_no * block_size, write_s), mib_per_s(blocks_no * block_size, read_s),
+                        mib_per_s(random_reads * block_size, random_s), ok ? "" : " (transfers failed)");
+            device.reset();
+            ::unlink(path.c_str());
+            return ok;
+        }
+
+        // one file written and read back in chunks through the cache, then saved
+        bool fs_case(const engine_case &c, lab_fs::open_mode mode) {
+            const auto path = image_path(c.name);
+            ::unlink(path.c_str());
+            auto [fs, init_res] = lab_fs::file_system::init(blocks_no / 64, 4, 16, block_size, path, c.engine,
+                                                            lab_fs::file_system::constraints::cache_budget,
+                                                            {lab_fs::dir_format::FLAT, lab_fs::file_format::EXTENT});
+            if (init_res != lab_fs::CREATED) {
+                std::printf("%-7s fs: failed to create image\n", c.name);
+                return false;
+            }
+            fs->create("data");
+            auto i = fs->open("data", mode).first;
+
+            std::vector<std::byte> buffer(chunk, std::byte{0x5a});
+            std::size_t written = 0;
+            auto start = clock::now();
+            while (written < file_bytes) {
+                auto [count, res] = fs->write(i, buffer);
+                written += count;
+                if (res != lab_fs::SUCCESS) {
+                    break;
+                }
+            }
+            fs->lseek(i, 0);
+            auto write_s = seconds_since(start);
+
+            std::size_t read = 0;
+            start = clock::now();
+            while (read < written) {
+                auto [count, res] = fs->read(i, buffer);
+                read += count;
+                if (res != lab_fs::SUCCESS || count == 0) {
+                    break;
+                }
+            }
+            auto read_s = seconds_since(start);
+
+            fs->close(i);
+            start = clock::now();
+            auto saved = fs->save();
+            auto save_s = seconds_since(start);
+
+            bool ok = written == file_bytes && read == written && !saved.failed;
+            std::printf("%-7s fs %-8s: write %8.1f MiB/s, read %8.1f MiB/s, save %6.1f ms (%zu blocks)%s\n",
+                        c.name, mode == lab_fs::open_mode::DIRECT ? "direct" : "buffered",
+                        mib_per_s(written, write_s), mib_per_s(read, read_s), save_s * 1000, saved.blocks,
+                        ok ? "" : " (incomplete)");
+            delete fs;
+            ::unlink(path.c_str());
+            return ok;
+        }
+    } //namespace
+
+    bool engines() {
+        bool ok = true;
+        for (auto &c : engine_cases) {
+            ok &= conformance_case(c);
+        }
+        for (auto &c : engine_cases) {
+            ok &= device_case(c);
+        }
+        for (auto &c : engine_cases) {
+            ok &= fs_case(c, lab_fs::open_mode::BUFFERED);
+            ok &= fs_case(c, lab_fs::open_mode::DIRECT);
+        }
+        return ok;
+    }
+
+} //namespace bench
@@ -0,0 +1,79 @@
+#include "bench.hpp"
+
+#include <fs.hpp>
+
+#include <random>
+#include <vector>
+
+namespace bench {
+    namespace {
+        constexpr std::size_t blocks_no = 2048;
+        constexpr std::size_t file_blocks = 1024;
+        constexpr std::size_t small_io = 100;
+        constexpr std::size_t sequential_passes = 8;
+        constexpr std::size_t random_ops = 1000000;
+
+        // small sequential and positional calls spend their time in offset math and short copies
+        // rather than on the device, which is what layout constants speed up
+        bool layout_case(std::size_t block_size, lab_fs::code_path code) {
+            const auto path = image_path("layout");
+            ::unlink(path.c_str());
+            auto [fs, init_res] = lab_fs::file_system::init(1, 1, blocks_no, block_size, path, lab_fs::io_engine::MEMORY,
+                                                            2 * blocks_no * block_size,
+                                                            {lab_fs::dir_format::FLAT, lab_fs::file_format::EXTENT},
+                                                            {}, lab_fs::file_system::constraints::oft_max_size, code);
+            const char *name = code == lab_fs::code_path::SPECIALIZED ? "fixed" : "runtime";
+            if (init_res != lab_fs::CREATED) {
+                std::printf("%5zu B %-7s: failed to create image\n", block_size, name);
+                return false;
+            }
+            fs->create("data");
+            auto i = fs->open("data").first;
+            const auto file_bytes = file_blocks * block_size;
+            std::vector<std::byte> chunk(small_io, std::byte{0x5a});
+            for (std::size_t done = 0; done < file_bytes; done += small_io) {
+                fs->write(i, std::span<const std::byte>{chunk}.first(std::min(small_io, file_bytes - done)));
+            }
+
+            bool ok = true;
+            std::size_t moved = 0;
+            auto start = clock::now();
+            for (std::size_t pass = 0; pass < sequential_passes; pass++) {
+                fs->lseek(i, 0);
+                for (std::size_t done = 0; done < file_bytes; done += small_io) {
+                    auto [count, res] = fs->read(i, chunk);
+                    moved += count;
+                    ok &= res == lab_fs::SUCCESS;
+                }
+            }
+            auto sequential_s = seconds_since(start);
+
+            std::mt19937 random{42};
+            start = clock::now();
+            for (std::size_t k = 0; k < random_ops; k++) {
+                auto offset = random() % (file_bytes - small_io);
+                auto [count, res] = k % 2 == 0 ? fs->pread(i, offset, chunk) : fs->pwrite(i, offset, chunk);
+                ok &= res == lab_fs::SUCCESS && count == small_io;
+            }
+            auto random_s = seconds_since(start);
+
+            std::printf("%5zu B %-7s: sequential %zu B reads %8.1f MiB/s, random pread/pwrite %6.2f Mops/s%s\n",
+                        block_size, name, small_io, mib_per_s(moved, sequential_s),
+                        (double) random_ops / random_s / 1e6, ok ? "" : " (calls failed)");
+            fs->close(i);
+            delete fs;
+            ::unlink(path.c_str());
+            return ok;
+        }
+    } //namespace
+
+    bool layout() {
+        bool ok = true;
+        for (std::size_t block_size : {512, 4096}) {
+            ok &= layout_case(block_size, lab_fs::code_path::GENERIC);
+            ok &= layout_case(block_size, lab_fs::code_path::SPECIALIZED);
+        }
+        return ok;
+    }
+
+} //namespace bench
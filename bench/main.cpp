@@ -0,0 +1,55 @@
+#include "bench.hpp"
+
+#include <cstring>
+#include <iostream>
+
+namespace {
+    struct benchmark {
+        const char *name;
+        const char *description;
+        bool (*run)();
+    };
+
+    const benchmark benchmarks[] = {
+        {"engines", "conformance, sequential and random throughput of memory, file, mmap and async engines", bench::engines},
+        {"directory", "create cost of a hashed directory growing to 100k files", bench::directory},
+        {"layout", "small calls with compile-time layout against the runtime-configured one", bench::layout},
+        {"cache", "block cache scaling with threads whose pins miss while others hit", bench::cache},
+        {"threads", "file system scaling with threads each working on its own file", bench::threads},
+        {"bitmap", "lock-free block claims against a locked std::vector<bool> scan", bench::bitmap},
+        {"queue", "io_uring and thread pool queues against syscalls at growing batch sizes", bench::queue},
+        {"async", "thousands of awaited readers on a cold cache, blocks fetched in the background or read by executor threads", bench::async},
+    };
+
+    void usage() {
+        std::cout << "usage: fs_bench all|<benchmark>...\n";
+        for (auto &b : benchmarks) {
+            std::cout << "  " << b.name << " - " << b.description << "\n";
+        }
+    }
+} //namespace
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    bool ok = true;
+    for (int k = 1; k < argc; k++) {
+        bool found = false;
+        for (auto &b : benchmarks) {
+            if (std::strcmp(argv[k], "all") == 0 || std::strcmp(argv[k], b.name) == 0) {
+                std::cout << "== " << b.name << "\n";
+                ok &= b.run();
+                found = true;
+            }
+        }
+        if (!found) {
+            std::cout << "unknown benchmark: " << argv[k] << "\n";
+            usage();
+            return 1;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+#include "bench.hpp"
+
+#include <io_engines.hpp>
+
+#include <functional>
+#include <random>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace bench {
+    namespace {
+        constexpr std::size_t request_size = 4096;
+        constexpr std::size_t file_bytes = 64 * 1024 * 1024;
+        constexpr std::size_t requests_no = 16384;
+        constexpr std::size_t batch_sizes[] = {1, 8, 32, 64};
+
+        struct queue_case {
+            const char *name;
+            bool queued; // requests go through a queue made by `make`, not straight to syscalls
+            std::function<std::unique_ptr<lab_fs::io_queue>(int)> make;
+        };
+
+        // random 4 KiB requests over a 64 MiB file issued `batch` at a time and waited for together.
+        // Cold reads start with the file dropped from the page cache, so each one waits for the disk
+        double run_requests(int fd, lab_fs::io_queue *queue, std::size_t batch, bool write, std::vector<std::byte> &buffers, bool &ok) {
+            std::mt19937 random{42};
+            auto start = clock::now();
+            for (std::size_t done = 0; done < requests_no; done += batch) {
+                for (std::size_t k = 0; k < batch; k++) {
+                    lab_fs::io_op request{write, random() % (file_bytes / request_size) * request_size,
+                                          std::span{buffers}.subspan(k * request_size, request_size), nullptr};
+                    if (queue) {
+                        queue->push(std::move(request));
+                    } else {
+                        ok &= lab_fs::utils::transfer_all(fd, request);
+                    }
+                }
+                if (queue) {
+                    queue->submit();
+                    ok &= queue->wait();
+                }
+            }
+            return seconds_since(start);
+        }
+
+        bool queue_case_run(const queue_case &c, int fd) {
+            bool res = true;
+            std::vector<std::byte> buffers(batch_sizes[std::size(batch_sizes) - 1] * request_size, std::byte{0x5a});
+            for (auto batch : batch_sizes) {
+                auto queue = c.make(fd);
+                if (c.queued && !queue) {
+                    std::printf("%-11s: not available\n", c.name);
+                    return true;
+                }
+                bool ok = true;
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                auto cold_s = run_requests(fd, queue.get(), batch, false, buffers, ok);
+                auto warm_s = run_requests(fd, queue.get(), batch, false, buffers, ok);
+                auto write_s = run_requests(fd, queue.get(), batch, true, buffers, ok);
+                std::printf("%-11s batch %2zu: cold read %8.0f IOPS, warm read %8.0f IOPS, write %8.0f IOPS%s\n",
+                            c.name, batch, (double) requests_no / cold_s,
+                            (double) requests_no / warm_s, (double) requests_no / write_s, ok ? "" : " (requests failed)");
+                res &= ok;
+            }
+            return res;
+        }
+    } //namespace
+
+    bool queue() {
+        const auto path = image_path("queue");
+        ::unlink(path.c_str());
+        bool created = false;
+        int fd = lab_fs::utils::open_image(path, file_bytes, created);
+        if (fd == -1) {
+            std::printf("failed to create file\n");
+            return false;
+        }
+        // the file is filled, so reads are not served from holes
+        std::vector<std::byte> chunk(1024 * 1024, std::byte{1});
+        for (std::size_t offset = 0; offset < file_bytes; offset += chunk.size()) {
+            lab_fs::utils::transfer_all(fd, {true, offset, chunk, nullptr});
+        }
+        fsync(fd);
+
+        const queue_case cases[] = {
+            {"syscalls", false, [](int) { return std::unique_ptr<lab_fs::io_queue>{}; }},
+            {"io_uring", true, [](int fd) { return std::unique_ptr<lab_fs::io_queue>{lab_fs::uring_queue::create(fd)}; }},
+            {"thread pool", true, [](int fd) { return std::unique_ptr<lab_fs::io_queue>{std::make_unique<lab_fs::pool_queue>(fd)}; }},
+        };
+        bool ok = true;
+        for (auto &c : cases) {
+            ok &= queue_case_run(c, fd);
+        }
+        ::close(fd);
+        ::unlink(path.c_str());
+        return ok;
+    }
+
+} //namespace bench
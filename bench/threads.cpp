@@ -0,0 +1,98 @@
+#include "bench.hpp"
+
+#include <fs.hpp>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bench {
+    namespace {
+        constexpr std::size_t block_size = 4096;
+        constexpr std::size_t blocks_no = 8192; // 32 MiB image, room for files of every thread
+        constexpr std::size_t cycles_per_thread = 500;
+        constexpr std::size_t file_chunks = 4; // each file gets 16 KiB in 4 KiB writes
+        constexpr std::size_t thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+
+        std::byte pattern(std::size_t thread, std::size_t cycle, std::size_t k) {
+            return std::byte((thread * 31 + cycle * 7 + k) % 251);
+        }
+
+        // every thread keeps creating its own file, writing it, reading it back and checking it, then
+        // closing and destroying it; threads share the directory and the cache but no file, so only
+        // directory changes have to wait for each other
+        bool threads_case(const char *name, lab_fs::io_engine engine) {
+            const auto path = image_path("threads");
+            bool ok = true;
+            double single_s = 0;
+            for (auto threads_no : thread_counts) {
+                ::unlink(path.c_str());
+                auto [fs, init_res] = lab_fs::file_system::init(1, 1, blocks_no, block_size, path, engine,
+                                                                lab_fs::file_system::constraints::cache_budget,
+                                                                {lab_fs::dir_format::HASHED, lab_fs::file_format::EXTENT},
+                                                                {}, threads_no + 1);
+                if (init_res != lab_fs::CREATED) {
+                    std::printf("%-6s: failed to create image\n", name);
+                    return false;
+                }
+
+                std::atomic<std::size_t> failed{0};
+                auto start = clock::now();
+                {
+                    std::vector<std::jthread> threads;
+                    for (std::size_t t = 0; t < threads_no; t++) {
+                        threads.emplace_back([&, t] {
+                            const auto filename = "t" + std::to_string(t);
+                            std::vector<std::byte> data(block_size);
+                            for (std::size_t cycle = 0; cycle < cycles_per_thread; cycle++) {
+                                if (fs->create(filename) != lab_fs::SUCCESS) {
+                                    failed.fetch_add(1, std::memory_order_relaxed);
+                                    continue;
+                                }
+                                auto [i, res] = fs->open(filename);
+                                bool cycle_ok = res == lab_fs::SUCCESS;
+                                for (std::size_t k = 0; k < file_chunks && cycle_ok; k++) {
+                                    std::fill(data.begin(), data.end(), pattern(t, cycle, k));
+                                    cycle_ok = fs->write(i, data).first == block_size;
+                                }
+                                cycle_ok = cycle_ok && fs->lseek(i, 0) == lab_fs::SUCCESS;
+                                for (std::size_t k = 0; k < file_chunks && cycle_ok; k++) {
+                                    cycle_ok = fs->read(i, data).first == block_size &&
+                                               data.front() == pattern(t, cycle, k) && data.back() == pattern(t, cycle, k);
+                                }
+                                if (res == lab_fs::SUCCESS) {
+                                    cycle_ok &= fs->close(i) == lab_fs::SUCCESS;
+                                }
+                                cycle_ok &= fs->destroy(filename) == lab_fs::SUCCESS;
+                                if (!cycle_ok) {
+                                    failed.fetch_add(1, std::memory_order_relaxed);
+                                }
+                            }
+                        });
+                    }
+                }
+                auto total_s = seconds_since(start);
+                if (threads_no == 1) {
+                    single_s = total_s;
+                }
+                delete fs;
+
+                std::printf("%-6s %2zu threads: %8.0f files/s, %5.2fx of one thread%s\n",
+                            name, threads_no, (double) (threads_no * cycles_per_thread) / total_s,
+                            single_s * (double) threads_no / total_s,
+                            failed == 0 ? "" : (", " + std::to_string(failed.load()) + " cycles failed").c_str());
+                ok &= failed == 0;
+            }
+            ::unlink(path.c_str());
+            return ok;
+        }
+    } //namespace
+
+    bool threads() {
+        bool ok = threads_case("memory", lab_fs::io_engine::MEMORY);
+        ok &= threads_case("file", lab_fs::io_engine::FILE);
+        return ok;
+    }
+
+} //namespace bench
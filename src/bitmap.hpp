@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace lab_fs {
+    // free-space bitmap searched a 64-bit word at a time; set bit marks occupied block.
+    // Words are atomic and blocks are claimed and released with CAS, so threads allocate without a lock.
+    // Free blocks are reserved before they are claimed: a reservation guarantees that much free space,
+    // so a claim made under it finds a block, unless other threads keep taking the blocks it finds;
+    // a failed search backs off before the next one, and the claim gives up after max_passes of them.
+    // Searches are next-fit: they start where the previous one of the thread's hint slot ended and wrap around;
+    // slots start spread over the bitmap
+    class block_bitmap {
+    public:
+        static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+        static constexpr std::size_t word_bits = 64;
+        static constexpr std::size_t hint_slots = 64;
+        // searches of the whole bitmap a claim makes before it fails
+        static constexpr std::size_t max_passes = 32;
+        // failed searches after which backoff yields the CPU instead of spinning
+        static constexpr std::size_t spin_passes = 10;
+
+        explicit block_bitmap(std::size_t size) :
+                _words((size + word_bits - 1) / word_bits),
+                _size{size},
+                _available{size} {
+            // bits past the end look occupied, so searches never return them
+            if (size % word_bits != 0) {
+                _words.back().store(~std::uint64_t{0} << (size % word_bits), std::memory_order_relaxed);
+            }
+            for (std::size_t k = 0; k < hint_slots; k++) {
+                _hints[k].store(k * _words.size() / hint_slots * word_bits, std::memory_order_relaxed);
+            }
+        }
+
+        [[nodiscard]] bool test(std::size_t i) const {
+            return (_words[i / word_bits].load(std::memory_order_relaxed) >> (i % word_bits)) & 1;
+        }
+
+        // marks block as occupied or free whatever its state was, as the bitmap is loaded
+        void set(std::size_t i, bool occupied) {
+            auto mask = std::uint64_t{1} << (i % word_bits);
+            auto &word = _words[i / word_bits];
+            auto old = occupied ? word.fetch_or(mask, std::memory_order_acq_rel) : word.fetch_and(~mask, std::memory_order_acq_rel);
+            if (((old & mask) != 0) != occupied) {
+                occupied ? _available.fetch_sub(1, std::memory_order_relaxed) : _available.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        [[nodiscard]] std::size_t size() const {
+            return _size;
+        }
+
+        // free blocks nobody reserved
+        [[nodiscard]] std::size_t count_free() const {
+            return _available.load(std::memory_order_relaxed);
+        }
+
+        // reserves up to n free blocks for later claims; returns number of blocks reserved
+        std::size_t reserve(std::size_t n) {
+            auto available = _available.load(std::memory_order_relaxed);
+            std::size_t taken;
+            do {
+                taken = std::min(n, available);
+                if (taken == 0) {
+                    return 0;
+                }
+            } while (!_available.compare_exchange_weak(available, available - taken, std::memory_order_relaxed));
+            return taken;
+        }
+
+        void unreserve(std::size_t n) {
+            _available.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        // claims a reserved free block; returns npos if every search lost its block to other threads
+        std::size_t claim_free() {
+            auto &hint = _hints[hint_slot()];
+            for (std::size_t pass = 0; pass < max_passes; pass++) {
+                auto from = hint.load(std::memory_order_relaxed);
+                auto i = find_free(from, _size);
+                if (i == npos) {
+                    i = find_free(0, from);
+                }
+                if (i != npos && claim_from(i, 1) == 1) {
+                    hint.store(i + 1 == _size ? 0 : i + 1, std::memory_order_relaxed);
+                    return i;
+                }
+                backoff(pass);
+            }
+            return npos;
+        }
+
+        // claims up to `max` reserved free blocks from `start` on, stopping at the first occupied one;
+        // returns number of blocks claimed
+        std::size_t claim_from(std::size_t start, std::size_t max) {
+            std::size_t length = 0;
+            while (length < max && start + length < _size) {
+                auto i = start + length;
+                auto shift = i % word_bits;
+                auto &word = _words[i / word_bits];
+                auto value = word.load(std::memory_order_relaxed);
+                std::uint64_t mask;
+                do {
+                    auto rest = value >> shift;
+                    auto free_bits = rest == 0 ? word_bits - shift : (std::size_t) std::countr_zero(rest);
+                    free_bits = std::min(free_bits, max - length);
+                    if (free_bits == 0) {
+                        return length;
+                    }
+                    mask = (free_bits == word_bits ? ~std::uint64_t{0} : (std::uint64_t{1} << free_bits) - 1) << shift;
+                } while (!word.compare_exchange_weak(value, value | mask, std::memory_order_acq_rel));
+                auto claimed = (std::size_t) std::popcount(mask);
+                length += claimed;
+                if (shift + claimed < word_bits) {
+                    break;
+                }
+            }
+            return length;
+        }
+
+        // claims the first run of n reserved free blocks, or the longest shorter run found;
+        // returns {start, length}, length is 0 if every search lost its blocks to other threads
+        std::pair<std::size_t, std::size_t> claim_run(std::size_t n) {
+            auto &hint = _hints[hint_slot()];
+            for (std::size_t pass = 0; pass < max_passes; pass++) {
+                // blocks taken by other threads since the search shorten the run
+                auto best = find_run(n, hint.load(std::memory_order_relaxed));
+                if (auto length = best.second == 0 ? 0 : claim_from(best.first, best.second); length > 0) {
+                    auto end = best.first + length;
+                    hint.store(end == _size ? 0 : end, std::memory_order_relaxed);
+                    return {best.first, length};
+                }
+                backoff(pass);
+            }
+            return {npos, 0};
+        }
+
+        // returns claimed block to its reservation
+        void unclaim(std::size_t i) {
+            _words[i / word_bits].fetch_and(~(std::uint64_t{1} << (i % word_bits)), std::memory_order_acq_rel);
+        }
+
+        // frees claimed block for everybody
+        void release(std::size_t i) {
+            unclaim(i);
+            unreserve(1);
+        }
+
+    private:
+        // number of free blocks starting at `start`, counted up to `max`
+        [[nodiscard]] std::size_t free_run_length(std::size_t start, std::size_t max) const {
+            std::size_t length = 0;
+            while (length < max && start + length < _size) {
+                auto i = start + length;
+                auto word = _words[i / word_bits].load(std::memory_order_relaxed) >> (i % word_bits);
+                auto free_bits = word == 0 ? word_bits - i % word_bits : (std::size_t) std::countr_zero(word);
+                if (free_bits == 0) {
+                    break;
+                }
+                length += free_bits;
+            }
+            return std::min(length, max);
+        }
+
+        // {start, length} of the first run of n free blocks from `hint` on, or of the longest shorter run
+        // if there is no such; length is 0 if every block is occupied
+        [[nodiscard]] std::pair<std::size_t, std::size_t> find_run(std::size_t n, std::size_t hint) const {
+            std::pair<std::size_t, std::size_t> best{npos, 0};
+            for (auto [from, to] : {std::pair{hint, _size}, std::pair{std::size_t{0}, hint}}) {
+                for (auto i = find_free(from, to); i != npos; i = find_free(i, to)) {
+                    auto length = free_run_length(i, std::min(n, to - i));
+                    if (length > best.second) {
+                        best = {i, length};
+                    }
+                    if (length == n) {
+                        break;
+                    }
+                    // block found free may be claimed by another thread before its run is measured
+                    i += std::max(length, std::size_t{1});
+                }
+                if (best.second == n) {
+                    break;
+                }
+            }
+            return best;
+        }
+
+        // first free block in [from, to)
+        [[nodiscard]] std::size_t find_free(std::size_t from, std::size_t to) const {
+            for (std::size_t w = from / word_bits; w * word_bits < to; w++) {
+                auto free = ~_words[w].load(std::memory_order_relaxed);
+                if (w == from / word_bits) {
+                    free &= ~std::uint64_t{0} << (from % word_bits);
+                }
+                if (free != 0) {
+                    auto i = w * word_bits + std::countr_zero(free);
+                    return i < to ? i : npos;
+                }
+            }
+            return npos;
+        }
+
+        // threads racing for the same blocks spin for twice as long after each failed search, so they
+        // stop failing in lockstep; past spin_passes the thread yields, letting the ones holding blocks run
+        static void backoff(std::size_t pass) {
+            if (pass >= spin_passes) {
+                std::this_thread::yield();
+                return;
+            }
+            for (std::size_t k = 0; k < (std::size_t{1} << pass); k++) {
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#elif defined(__aarch64__)
+                asm volatile("yield");
+#endif
+            }
+        }
+
+        static std::size_t hint_slot() {
+            return std::hash<std::thread::id>{}(std::this_thread::get_id()) % hint_slots;
+        }
+
+        std::vector<std::atomic<std::uint64_t>> _words;
+        std::size_t _size;
+        std::atomic<std::size_t> _available; // free blocks minus reserved ones
+        std::array<std::atomic<std::size_t>, hint_slots> _hints{};
+    };
+
+} //namespace lab_fs
@@ -0,0 +1,562 @@
+#pragma once
+
+#include <io.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace lab_fs {
+    // write-back block cache in front of a device; blocks are read from the device once
+    // and stay in memory until CLOCK evicts them, dirty ones are written back on eviction or sync.
+    // Calls may come from many threads. Loads, readahead and write-backs of evicted blocks run without
+    // the cache lock: their frame is marked busy meanwhile, and only threads which need that frame wait.
+    // Data of a pinned block is accessed without the lock, so threads must not change the same bytes of a block at once
+    class block_cache : public io {
+    public:
+        struct stats {
+            std::size_t hits = 0;
+            std::size_t misses = 0;
+            std::size_t evictions = 0;
+            std::size_t write_backs = 0;
+            std::size_t direct_reads = 0;  // blocks moved past the cache
+            std::size_t direct_writes = 0;
+            std::size_t readahead = 0;  // blocks read ahead of use
+            std::size_t readahead_hits = 0;
+            std::size_t readahead_wasted = 0; // read ahead blocks evicted before use
+            std::size_t io_errors = 0; // device transfers which failed
+            std::size_t fetched = 0; // blocks loaded in the background for callers which didn't wait
+        };
+
+        // at least this many frames are kept regardless of budget
+        static constexpr std::size_t min_frames_no = 4;
+
+        block_cache(std::unique_ptr<io> device, std::size_t budget) :
+                io{device->get_blocks_no(), device->get_block_size()},
+                _device{std::move(device)},
+                _capacity{std::max(budget / _block_size, min_frames_no)} {}
+
+        ~block_cache() override {
+            if (_fetcher.joinable()) {
+                {
+                    std::lock_guard lock{_fetch_mutex};
+                    _fetch_stop = true;
+                }
+                _fetch_cv.notify_all();
+                _fetcher.join();
+            }
+            flush();
+        }
+
+        std::span<std::byte> pin(std::size_t i) override {
+            assert(i < _blocks_no);
+            std::unique_lock lock{_mutex};
+            std::size_t frame_i;
+            while (true) {
+                if (auto it = _index.find(i); it != _index.end()) {
+                    auto &frame = _frames[it->second];
+                    if (frame.busy()) {
+                        // the frame may hold another block once its transfer is done, so it is looked up again
+                        wait_idle(lock, frame);
+                        continue;
+                    }
+                    frame.pins++;
+                    frame.referenced = true;
+                    _stats.hits++;
+                    if (frame.read_ahead) {
+                        frame.read_ahead = false;
+                        _stats.readahead_hits++;
+                    }
+                    return frame.data;
+                }
+
+                // another thread may have loaded the block while a victim was written back
+                frame_i = take_frame(lock);
+                if (!_index.contains(i)) {
+                    break;
+                }
+            }
+
+            _stats.misses++;
+            auto &frame = _frames[frame_i];
+            claim(frame, i, false);
+            frame.loading = true;
+            _index[i] = frame_i;
+
+            lock.unlock();
+            bool ok = _device->read_block(i, frame.data);
+            if (!ok) {
+                std::fill(frame.data.begin(), frame.data.end(), std::byte{0});
+            }
+            lock.lock();
+
+            frame.loading = false;
+            frame.failed = !ok;
+            if (!ok) {
+                _stats.io_errors++;
+            }
+            frame.idle.notify_all();
+            return frame.data;
+        }
+
+        // block which failed to load is cached as zeros until its last pin is released
+        [[nodiscard]] bool load_failed(std::size_t i) override {
+            std::lock_guard lock{_mutex};
+            auto it = _index.find(i);
+            return it != _index.end() && _frames[it->second].failed;
+        }
+
+        // loads run of blocks into the cache ahead of use, reading them as one batch; they get the same
+        // second chance as used blocks, or CLOCK would evict them before the stream reaches them
+        void prefetch(std::size_t i, std::size_t n) {
+            assert(i + n <= _blocks_no);
+            std::vector<std::size_t> blocks(n);
+            std::iota(blocks.begin(), blocks.end(), i);
+            std::unique_lock lock{_mutex};
+            _stats.readahead += load(lock, blocks, true);
+        }
+
+        // loads blocks in a background thread and calls `done` there once they are cached, so the caller
+        // doesn't wait for the device; blocks of fetches asked for meanwhile are read as one batch.
+        // `done` is called even if some blocks could not be read, their use reads them again
+        void fetch(std::vector<std::size_t> blocks, std::function<void()> done) {
+            {
+                std::lock_guard lock{_fetch_mutex};
+                if (!_fetcher.joinable()) {
+                    _fetcher = std::thread{[this] { fetch_loop(); }};
+                }
+                _fetches.push_back({std::move(blocks), std::move(done)});
+            }
+            _fetch_cv.notify_one();
+        }
+
+        bool will_need(std::size_t i, std::size_t n) override {
+            std::lock_guard lock{_mutex};
+            return _device->will_need(i, n);
+        }
+
+        [[nodiscard]] bool contains(std::size_t i) {
+            std::lock_guard lock{_mutex};
+            return _index.contains(i);
+        }
+
+        [[nodiscard]] bool is_in_memory() const override {
+            return _device->is_in_memory();
+        }
+
+        [[nodiscard]] std::size_t capacity() const {
+            return _capacity;
+        }
+
+        void unpin(std::size_t i, bool dirty) override {
+            std::lock_guard lock{_mutex};
+            auto it = _index.find(i);
+            assert(it != _index.end() && "Block is not cached");
+            auto &frame = _frames[it->second];
+            assert(frame.pins > 0 && "Block is not pinned");
+            frame.pins--;
+            if (dirty) {
+                frame.dirty = true;
+                frame.failed = false;
+            }
+            if (frame.pins == 0 && frame.failed) {
+                drop(frame);
+            }
+        }
+
+        // reads run of blocks straight from the device into dest; cached blocks may be newer
+        // than the device, so they are copied from their frames instead
+        bool read_direct(std::size_t i, std::span<std::byte> dest) {
+            auto n = block_of(dest.size());
+            assert(i + n <= _blocks_no);
+            std::unique_lock lock{_mutex};
+            wait_run_idle(lock, i, n);
+            bool res = true;
+            for (std::size_t k = 0; k < n;) {
+                if (auto it = _index.find(i + k); it != _index.end()) {
+                    auto &frame = _frames[it->second];
+                    std::memcpy(dest.data() + (k * _block_size), frame.data.data(), _block_size);
+                    _stats.hits++;
+                    if (frame.read_ahead) {
+                        frame.read_ahead = false;
+                        _stats.readahead_hits++;
+                    }
+                    k++;
+                    continue;
+                }
+                auto from = k;
+                while (k < n && !_index.contains(i + k)) {
+                    k++;
+                }
+                if (!_device->read_blocks(i + from, dest.subspan(from * _block_size, (k - from) * _block_size))) {
+                    _stats.io_errors++;
+                    res = false;
+                }
+                _stats.direct_reads += k - from;
+            }
+            return res;
+        }
+
+        // writes run of blocks straight to the device; cached copies are dropped,
+        // or refreshed if somebody keeps them pinned. A block held by the journal is metadata freed
+        // by a transaction not yet committed, so it is only written to its frame; the frame reaches
+        // the disk after the commit, and the device keeps the old block until then
+        bool write_direct(std::size_t i, std::span<const std::byte> src) {
+            auto n = block_of(src.size());
+            assert(i + n <= _blocks_no);
+            std::unique_lock lock{_mutex};
+            wait_run_idle(lock, i, n);
+            bool res = true;
+            std::size_t from = 0;
+            auto write_run = [&](std::size_t to) {
+                if (to > from && !_device->write_blocks(i + from, src.subspan(from * _block_size, (to - from) * _block_size))) {
+                    _stats.io_errors++;
+                    res = false;
+                }
+                _stats.direct_writes += to - from;
+            };
+            for (std::size_t k = 0; k < n; k++) {
+                auto it = _index.find(i + k);
+                if (it == _index.end()) {
+                    continue;
+                }
+                auto &frame = _frames[it->second];
+                if (frame.held) {
+                    std::memcpy(frame.data.data(), src.data() + (k * _block_size), _block_size);
+                    frame.dirty = true;
+                    write_run(k);
+                    from = k + 1;
+                } else if (frame.pins > 0) {
+                    std::memcpy(frame.data.data(), src.data() + (k * _block_size), _block_size);
+                    frame.dirty = false;
+                } else {
+                    drop(frame);
+                }
+            }
+            write_run(n);
+            return res;
+        }
+
+        // held block is neither evicted nor written back until released;
+        // it must be pinned by the caller while held
+        void hold(std::size_t i, bool held) {
+            std::lock_guard lock{_mutex};
+            auto it = _index.find(i);
+            assert(it != _index.end() && "Block is not cached");
+            _frames[it->second].held = held;
+        }
+
+        // writes every dirty block which is not held back to the device, cached copies stay valid;
+        // blocks which failed to be written stay dirty
+        bool flush() {
+            std::unique_lock lock{_mutex};
+            wait_write_backs(lock);
+            return write_back_all();
+        }
+
+        bool sync(flush_stats &stats) override {
+            std::unique_lock lock{_mutex};
+            wait_write_backs(lock);
+            bool res = write_back_all();
+            stats.failed |= !res;
+            return _device->sync(stats) && res;
+        }
+
+        // writes listed blocks back if they are dirty and not held, then makes the device durable;
+        // other dirty blocks stay in the cache
+        bool sync_blocks(std::span<const std::size_t> blocks, flush_stats &stats) {
+            std::unique_lock lock{_mutex};
+            wait_write_backs(lock);
+            std::vector<block_transfer> batch;
+            std::vector<frame *> written;
+            for (auto i : blocks) {
+                auto it = _index.find(i);
+                if (it == _index.end()) {
+                    continue;
+                }
+                auto &frame = _frames[it->second];
+                if (frame.dirty && !frame.held) {
+                    batch.push_back({frame.block, frame.data, true});
+                    written.push_back(&frame);
+                }
+            }
+            bool res = write_back(batch, written);
+            stats.failed |= !res;
+            return _device->sync(stats) && res;
+        }
+
+        [[nodiscard]] bool is_backed_by(const std::string &path) const override {
+            return _device->is_backed_by(path);
+        }
+
+        [[nodiscard]] const stats &get_stats() const {
+            return _stats;
+        }
+
+    private:
+        struct frame {
+            explicit frame(std::size_t block_size) :
+                    data(block_size) {}
+
+            // block is read into the frame or written back from it without the cache lock
+            [[nodiscard]] bool busy() const {
+                return loading || writing;
+            }
+
+            std::vector<std::byte> data;
+            std::size_t block = 0;
+            std::size_t pins = 0;
+            bool referenced = false;
+            bool dirty = false;
+            bool held = false;
+            bool read_ahead = false; // read ahead and not used yet
+            bool valid = false;
+            bool failed = false; // block couldn't be read, data is zeros
+            bool loading = false; // read is in flight, data is not valid yet
+            bool writing = false; // evicted frame is written back, data must not change
+            std::condition_variable idle; // notified when a transfer of the frame is done
+        };
+
+        struct fetch_request {
+            std::vector<std::size_t> blocks;
+            std::function<void()> done;
+        };
+
+        // reads blocks which are not cached as one batch, without the lock; frames stay pinned until the batch
+        // is read, so taking the next one doesn't evict them. A failed batch leaves nothing cached.
+        // Returns number of blocks loaded
+        std::size_t load(std::unique_lock<std::mutex> &lock, std::span<const std::size_t> blocks, bool read_ahead) {
+            std::vector<std::size_t> taken;
+            std::vector<block_transfer> batch;
+            for (auto k : blocks) {
+                if (_index.contains(k)) {
+                    continue;
+                }
+                auto frame_i = take_frame(lock);
+                if (_index.contains(k)) {
+                    continue;
+                }
+                auto &frame = _frames[frame_i];
+                claim(frame, k, read_ahead);
+                frame.loading = true;
+                _index[k] = frame_i;
+                taken.push_back(frame_i);
+                batch.push_back({k, frame.data, false});
+            }
+            if (!taken.empty()) {
+                lock.unlock();
+                bool ok = _device->transfer(batch);
+                lock.lock();
+
+                for (auto frame_i : taken) {
+                    auto &frame = _frames[frame_i];
+                    frame.pins--;
+                    frame.loading = false;
+                    if (!ok) {
+                        frame.read_ahead = false;
+                        drop(frame);
+                    }
+                    frame.idle.notify_all();
+                }
+                if (!ok) {
+                    _stats.io_errors++;
+                    taken.clear();
+                }
+            }
+            return taken.size();
+        }
+
+        // serves fetches in turn, taking every one queued by the time the previous batch is read
+        void fetch_loop() {
+            std::unique_lock lock{_fetch_mutex};
+            while (true) {
+                _fetch_cv.wait(lock, [this] { return _fetch_stop || !_fetches.empty(); });
+                if (_fetches.empty()) {
+                    return;
+                }
+                auto fetches = std::exchange(_fetches, {});
+                lock.unlock();
+
+                std::vector<std::size_t> blocks;
+                for (auto &request : fetches) {
+                    blocks.insert(blocks.end(), request.blocks.begin(), request.blocks.end());
+                }
+                std::sort(blocks.begin(), blocks.end());
+                blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+                {
+                    std::unique_lock cache_lock{_mutex};
+                    _stats.fetched += load(cache_lock, blocks, false);
+                }
+                for (auto &request : fetches) {
+                    request.done();
+                }
+                lock.lock();
+            }
+        }
+
+        // frame taken for block i is pinned by the caller
+        static void claim(frame &frame, std::size_t i, bool read_ahead) {
+            frame.block = i;
+            frame.pins = 1;
+            frame.referenced = true;
+            frame.dirty = false;
+            frame.held = false;
+            frame.read_ahead = read_ahead;
+            frame.valid = true;
+            frame.failed = false;
+        }
+
+        static void wait_idle(std::unique_lock<std::mutex> &lock, frame &frame) {
+            frame.idle.wait(lock, [&frame] { return !frame.busy(); });
+        }
+
+        // waits until no block of the run is in flight, so the device may be used for it under the lock
+        void wait_run_idle(std::unique_lock<std::mutex> &lock, std::size_t i, std::size_t n) {
+            for (std::size_t k = 0; k < n;) {
+                auto it = _index.find(i + k);
+                if (it != _index.end() && _frames[it->second].busy()) {
+                    wait_idle(lock, _frames[it->second]);
+                    continue;
+                }
+                k++;
+            }
+        }
+
+        // waits until write-backs of evicted frames are done, so that a following sync covers them;
+        // no other one starts until the lock is released
+        void wait_write_backs(std::unique_lock<std::mutex> &lock) {
+            for (std::size_t k = 0; k < _frames.size();) {
+                if (_frames[k].writing) {
+                    wait_idle(lock, _frames[k]);
+                    k = 0;
+                    continue;
+                }
+                k++;
+            }
+        }
+
+        void drop(frame &frame) {
+            if (frame.read_ahead) {
+                _stats.readahead_wasted++;
+            }
+            _index.erase(frame.block);
+            frame.valid = false;
+        }
+
+        bool write_back_all() {
+            std::vector<block_transfer> batch;
+            std::vector<frame *> written;
+            for (auto &frame : _frames) {
+                if (frame.valid && frame.dirty && !frame.held) {
+                    batch.push_back({frame.block, frame.data, true});
+                    written.push_back(&frame);
+                }
+            }
+            return write_back(batch, written);
+        }
+
+        // dirty frames are written as one batch; if it fails, they are written one by one
+        // to find those which stay dirty
+        bool write_back(std::span<const block_transfer> batch, const std::vector<frame *> &written) {
+            if (_device->transfer(batch)) {
+                for (auto frame : written) {
+                    frame->dirty = false;
+                }
+                _stats.write_backs += batch.size();
+                return true;
+            }
+
+            _stats.io_errors++;
+            bool res = true;
+            for (auto frame : written) {
+                res &= write_back(*frame);
+            }
+            return res;
+        }
+
+        bool write_back(frame &frame) {
+            if (!_device->write_block(frame.block, frame.data)) {
+                _stats.io_errors++;
+                return false;
+            }
+            frame.dirty = false;
+            _stats.write_backs++;
+            return true;
+        }
+
+        // returns index of a frame which can be refilled; the lock is released while a dirty victim
+        // is written back, so the caller checks again that its block is still missing
+        std::size_t take_frame(std::unique_lock<std::mutex> &lock) {
+            if (_frames.size() < _capacity) {
+                _frames.emplace_back(_block_size);
+                return _frames.size() - 1;
+            }
+
+            // CLOCK: referenced frames get a second chance, pinned frames are never evicted;
+            // two sweeps are enough to clear every reference bit
+            for (std::size_t step = 0; step < 2 * _frames.size(); step++) {
+                auto i = _hand;
+                _hand = (_hand + 1) % _frames.size();
+
+                auto &frame = _frames[i];
+                if (!frame.valid) {
+                    return i;
+                }
+                if (frame.pins > 0 || frame.busy()) {
+                    continue;
+                }
+                if (frame.referenced) {
+                    frame.referenced = false;
+                    continue;
+                }
+
+                if (frame.dirty) {
+                    // nobody can pin the frame until it's written, so its data stays as it was
+                    frame.writing = true;
+                    lock.unlock();
+                    bool ok = _device->write_block(frame.block, frame.data);
+                    lock.lock();
+                    frame.writing = false;
+                    frame.idle.notify_all();
+
+                    // frame which can't be written back keeps the only copy of its block
+                    if (!ok) {
+                        _stats.io_errors++;
+                        continue;
+                    }
+                    frame.dirty = false;
+                    _stats.write_backs++;
+                }
+                drop(frame);
+                _stats.evictions++;
+                return i;
+            }
+
+            // every frame is pinned, budget is exceeded rather than failing the caller
+            _frames.emplace_back(_block_size);
+            return _frames.size() - 1;
+        }
+
+        std::unique_ptr<io> _device;
+        std::size_t _capacity;
+        std::deque<frame> _frames; // frames don't move as more are added, so their data is used without the lock
+        std::unordered_map<std::size_t, std::size_t> _index; // (block) -> (index of frame)
+        std::size_t _hand = 0;
+        stats _stats;
+        std::mutex _mutex;
+
+        std::thread _fetcher; // started by the first fetch
+        std::deque<fetch_request> _fetches;
+        bool _fetch_stop = false;
+        std::mutex _fetch_mutex;
+        std::condition_variable _fetch_cv;
+    };
+
+} //namespace lab_fs
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace lab_fs {
+    // fixed pool of threads running posted jobs in order of posting; coroutines suspended
+    // on calls of file_system are resumed in its threads
+    class executor {
+    public:
+        explicit executor(std::size_t threads_no = std::max(std::thread::hardware_concurrency(), 1u)) {
+            for (std::size_t i = 0; i < threads_no; i++) {
+                _threads.emplace_back([this] { work(); });
+            }
+        }
+
+        executor(const executor &) = delete;
+
+        executor &operator=(const executor &) = delete;
+
+        // jobs posted before are run first
+        ~executor() {
+            {
+                std::lock_guard lock{_mutex};
+                _stop = true;
+            }
+            _work_cv.notify_all();
+            for (auto &thread : _threads) {
+                thread.join();
+            }
+        }
+
+        void post(std::function<void()> job) {
+            {
+                std::lock_guard lock{_mutex};
+                _jobs.push_back(std::move(job));
+            }
+            _work_cv.notify_one();
+        }
+
+        // posts job once `start` calls its argument, which it may do from any thread, e.g. when a transfer
+        // it started is done; until then wait counts the job as posted, though no thread runs for it
+        void post_after(const std::function<void(std::function<void()>)> &start, std::function<void()> job) {
+            {
+                std::lock_guard lock{_mutex};
+                _deferred++;
+            }
+            // notified under the lock: once it is released, wait may return and the executor be destroyed
+            start([this, job = std::move(job)]() mutable {
+                std::lock_guard lock{_mutex};
+                _jobs.push_back(std::move(job));
+                _deferred--;
+                _work_cv.notify_one();
+            });
+        }
+
+        // moves the awaiting coroutine to a thread of the executor
+        auto schedule() {
+            struct awaiter {
+                executor *ex;
+
+                bool await_ready() const noexcept {
+                    return false;
+                }
+
+                void await_suspend(std::coroutine_handle<> h) const {
+                    ex->post([h] { h.resume(); });
+                }
+
+                void await_resume() const noexcept {}
+            };
+            return awaiter{this};
+        }
+
+        // waits until every posted job is done, jobs posted by them included
+        void wait() {
+            std::unique_lock lock{_mutex};
+            _idle_cv.wait(lock, [this] { return _jobs.empty() && _running == 0 && _deferred == 0; });
+        }
+
+    private:
+        void work() {
+            std::unique_lock lock{_mutex};
+            while (true) {
+                _work_cv.wait(lock, [this] { return _stop || !_jobs.empty(); });
+                if (_jobs.empty()) {
+                    return;
+                }
+                auto job = std::move(_jobs.front());
+                _jobs.pop_front();
+                _running++;
+                lock.unlock();
+                job();
+                lock.lock();
+                if (--_running == 0 && _jobs.empty()) {
+                    _idle_cv.notify_all();
+                }
+            }
+        }
+
+        std::vector<std::thread> _threads;
+        std::deque<std::function<void()>> _jobs;
+        std::size_t _running = 0;
+        std::size_t _deferred = 0; // jobs of post_after not posted yet
+        bool _stop = false;
+        std::mutex _mutex;
+        std::condition_variable _work_cv;
+        std::condition_variable _idle_cv;
+    };
+
+    // result of an awaitable call: a call which won't wait for the device is done before it is awaited,
+    // any other one is run in a thread of the executor, which resumes the awaiting coroutine after it.
+    // A call with a fetch starts it first and is run once the fetch reports that what it needs is in memory;
+    // no thread of the executor is held meanwhile
+    template<class T>
+    class async_call {
+    public:
+        using fetch_type = std::function<void(std::function<void()>)>;
+
+        explicit async_call(T result) :
+                _result{std::move(result)} {}
+
+        async_call(executor &ex, std::function<T()> call) :
+                _executor{&ex},
+                _call{std::move(call)} {}
+
+        async_call(executor &ex, fetch_type fetch, std::function<T()> call) :
+                _executor{&ex},
+                _fetch{std::move(fetch)},
+                _call{std::move(call)} {}
+
+        [[nodiscard]] bool await_ready() const noexcept {
+            return _result.has_value();
+        }
+
+        // the coroutine may be resumed, and this destroyed, before post returns
+        void await_suspend(std::coroutine_handle<> h) {
+            auto job = [this, h] {
+                _result = _call();
+                h.resume();
+            };
+            if (_fetch) {
+                auto fetch = std::move(_fetch);
+                _executor->post_after(fetch, job);
+                return;
+            }
+            _executor->post(job);
+        }
+
+        T await_resume() {
+            return std::move(*_result);
+        }
+
+    private:
+        executor *_executor = nullptr;
+        fetch_type _fetch;
+        std::function<T()> _call;
+        std::optional<T> _result;
+    };
+
+    // lazily started coroutine; awaiting it starts it and resumes the awaiting coroutine once it returns
+    template<class T = void>
+    class task;
+
+    namespace utils {
+        template<class T>
+        struct task_promise_base {
+            struct final_awaiter {
+                bool await_ready() const noexcept {
+                    return false;
+                }
+
+                template<class Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) const noexcept {
+                    if (auto continuation = h.promise().continuation) {
+                        return continuation;
+                    }
+                    return std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept {}
+            };
+
+            std::suspend_always initial_suspend() const noexcept {
+                return {};
+            }
+
+            final_awaiter final_suspend() const noexcept {
+                return {};
+            }
+
+            // the library doesn't use exceptions
+            void unhandled_exception() const noexcept {
+                std::terminate();
+            }
+
+            std::coroutine_handle<> continuation;
+        };
+
+        template<class T>
+        struct task_promise : task_promise_base<T> {
+            task<T> get_return_object();
+
+            void return_value(T value) {
+                result = std::move(value);
+            }
+
+            std::optional<T> result;
+        };
+
+        template<>
+        struct task_promise<void> : task_promise_base<void> {
+            task<void> get_return_object();
+
+            void return_void() const noexcept {}
+        };
+    } //namespace utils
+
+    template<class T>
+    class task {
+    public:
+        using promise_type = utils::task_promise<T>;
+
+        explicit task(std::coroutine_handle<promise_type> h) :
+                _handle{h} {}
+
+        task(const task &) = delete;
+
+        task(task &&other) noexcept:
+                _handle{std::exchange(other._handle, nullptr)} {}
+
+        task &operator=(const task &) = delete;
+
+        ~task() {
+            if (_handle) {
+                _handle.destroy();
+            }
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+            _handle.promise().continuation = awaiting;
+            return _handle;
+        }
+
+        T await_resume() {
+            if constexpr (!std::is_void_v<T>) {
+                return std::move(*_handle.promise().result);
+            }
+        }
+
+    private:
+        std::coroutine_handle<promise_type> _handle;
+    };
+
+    namespace utils {
+        template<class T>
+        task<T> task_promise<T>::get_return_object() {
+            return task<T>{std::coroutine_handle<task_promise<T>>::from_promise(*this)};
+        }
+
+        inline task<void> task_promise<void>::get_return_object() {
+            return task<void>{std::coroutine_handle<task_promise<void>>::from_promise(*this)};
+        }
+
+        // coroutine started at once which destroys itself when it returns
+        struct detached {
+            struct promise_type {
+                detached get_return_object() const noexcept {
+                    return {};
+                }
+
+                std::suspend_never initial_suspend() const noexcept {
+                    return {};
+                }
+
+                std::suspend_never final_suspend() const noexcept {
+                    return {};
+                }
+
+                void return_void() const noexcept {}
+
+                void unhandled_exception() const noexcept {
+                    std::terminate();
+                }
+            };
+        };
+    } //namespace utils
+
+    // starts a task in a thread of the executor without waiting for it; executor::wait returns once it is
+    // done, unless it awaits something which doesn't run on the executor
+    inline void spawn(executor &ex, task<void> t) {
+        [](executor &ex, task<void> t) -> utils::detached {
+            co_await ex.schedule();
+            co_await t;
+        }(ex, std::move(t));
+    }
+
+} //namespace lab_fs
@@ -1,252 +1,424 @@
 #include "fs.hpp"
 #include "fs_utils.cpp"
+#include "fs_directory.cpp"
+#include "fs_async.cpp"
+#include "io_engines.hpp"
+#include "volume.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <fstream>
+#include <numeric>
 #include <optional>
 
 namespace lab_fs {
 
-    file_system::file_descriptor::file_descriptor(std::size_t length, const std::array<std::size_t, constraints::max_blocks_per_file> &occupied_blocks) :
+    template <class Layout>
+    basic_file_system<Layout>::file_descriptor::file_descriptor(std::size_t length, std::vector<extent> extents, std::size_t indirect) :
             length{length},
-            occupied_blocks{occupied_blocks} {}
+            extents{std::move(extents)},
+            indirect{indirect} {}
+
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::file_descriptor::blocks_no() const {
+        std::size_t res = 0;
+        for (auto &run : extents) {
+            res += run.length;
+        }
+        return res;
+    }
 
-    bool file_system::file_descriptor::is_initialized() const {
-        if (length > 0)
-            return true;
-        for (auto i : occupied_blocks) {
-            if (i != 255) {
-                return true;
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::file_descriptor::block(std::size_t i) const {
+        for (auto &run : extents) {
+            if (i < run.length) {
+                return run.start + i;
             }
+            i -= run.length;
         }
-        return false;
+        return 0;
     }
 
-    file_system::oft_entry::oft_entry(std::string filename, std::size_t descriptor_index) :
+    template <class Layout>
+    void basic_file_system<Layout>::file_descriptor::append(std::size_t block, std::size_t max_extent_length) {
+        if (!extents.empty() && extents.back().start + extents.back().length == block &&
+            extents.back().length < max_extent_length) {
+            extents.back().length++;
+        } else {
+            extents.push_back({block, 1});
+        }
+    }
+
+    template <class Layout>
+    basic_file_system<Layout>::oft_entry::oft_entry(std::string filename, std::size_t descriptor_index, file_descriptor *descriptor, open_mode mode) :
             _filename{std::move(filename)},
             _descriptor_index{descriptor_index},
+            _descriptor{descriptor},
             current_pos{0},
             current_block{0},
             modified{false},
-            initialized{false} {}
+            initialized{false},
+            direct{mode == open_mode::DIRECT} {}
 
-    std::size_t file_system::oft_entry::get_descriptor_index() const {
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::oft_entry::get_descriptor_index() const {
         return _descriptor_index;
     }
 
-    std::string file_system::oft_entry::get_filename() const {
+    template <class Layout>
+    typename basic_file_system<Layout>::file_descriptor *basic_file_system<Layout>::oft_entry::get_descriptor() const {
+        return _descriptor;
+    }
+
+    template <class Layout>
+    std::string basic_file_system<Layout>::oft_entry::get_filename() const {
         return _filename;
     }
 
-    file_system::file_system(std::string filename, io &&disk_io) : 
+    template <class Layout>
+    basic_file_system<Layout>::basic_file_system(std::string filename, std::unique_ptr<io> disk_io, std::size_t cache_budget, std::size_t oft_capacity) :
             _filename{std::move(filename)},
-            _io{disk_io},
-            _bitmap(disk_io.get_blocks_no()) {
-        std::vector<std::byte> buffer(disk_io.get_block_size());
+            _io{std::make_unique<block_cache>(std::move(disk_io), cache_budget)},
+            _bitmap(_io->get_blocks_no()),
+            _oft{oft_capacity} {
+        std::optional<std::pair<std::size_t, std::size_t>> journal_area;
+        if (auto sb = utils::superblock::read(_io->acquire(0).data())) {
+            _file_format = sb->files;
+            _bitmap_start = sb->bitmap_start;
+            _descriptors_start = sb->descriptors_start;
+            _descriptors_no = sb->descriptors_no;
+            if (sb->journal_blocks_no > 0) {
+                journal_area = {sb->journal_start, sb->journal_blocks_no};
+            }
+        } else {
+            // everything v1 keeps is found in blocks 0 and 1
+            _version = format_version::V1;
+            _file_format = utils::format_record::read(_io->acquire(0).data());
+            journal_area = journal::read_anchor(_io->acquire(0).data());
+        }
+        _layout = Layout{_io->get_block_size(), utils::descriptor_size(_version, _file_format),
+                         utils::dir_entry::size(_version), utils::pointer_size(_version)};
+        if (_version == format_version::V1) {
+            _descriptors_no = std::min(_layout.block_size() / descriptor_size(), constraints::max_descriptors_no);
+        }
 
-        disk_io.read_block(0, buffer.begin());
+        // committed transaction is replayed even on read-only mount, otherwise metadata would be torn
+        if (journal_area) {
+            auto [start, blocks_no] = *journal_area;
+            if (journal::replay(*_io, start, blocks_no)) {
+                flush_stats flushed;
+                _io->sync(flushed);
+            }
+            _journal = std::make_unique<journal>(*_io, start, blocks_no, constraints::journal_commit_interval);
+        }
+
+        const auto bits_per_block = 8 * _layout.block_size();
+        block_handle bitmap_block;
         for (std::size_t i = 0; i < _bitmap.size(); i++) {
-            _bitmap[i] = (bool)((buffer[i / 8] >> (7 - (i % 8))) & std::byte{1});
+            if (i % bits_per_block == 0) {
+                bitmap_block = _io->acquire(_bitmap_start + i / bits_per_block);
+            }
+            auto byte = i % bits_per_block / 8;
+            _bitmap.set(i, (bool) ((bitmap_block[byte] >> (7 - (i % 8))) & std::byte{1}));
         }
+        bitmap_block.release();
 
-        _oft.push_back(new oft_entry{"", 0});
-        disk_io.read_block(1, buffer.begin());
-        std::uint8_t pos = 0;
+        auto dir_descriptor = get_descriptor(0);
+        assert(dir_descriptor && "Directory descriptor is missing");
+        // directory takes the first slot of the table, so it gets handle 0
+        _dir_entry = _oft.find(_oft.emplace("", 0, dir_descriptor, open_mode::BUFFERED));
+        _open_files.emplace(0, 0);
+        dir_descriptor->opens = 1;
 
-        auto length = std::to_integer<std::size_t>(buffer[pos]);
-        for (pos++; pos < file_system::constraints::bytes_for_file_length; pos++) {
-            length <<= 8;
-            length += std::to_integer<std::size_t>(buffer[pos]);
-        }
+        load_directory();
+    }
 
-        std::array<std::size_t, constraints::max_blocks_per_file> occupied_blocks{};
-        for (unsigned i = 0; i < constraints::max_blocks_per_file; i++, pos++) {
-            occupied_blocks[i] = std::to_integer<std::size_t>(buffer[pos]);
+    template <class Layout>
+    basic_file_system<Layout>::~basic_file_system() {
+        if (_journal) {
+            flush_stats flushed;
+            _journal->commit(flushed);
+        }
+        for (auto [index, descriptor] : _descriptors_cache) {
+            delete descriptor;
         }
-
-        _descriptors_cache[0] = new file_descriptor(length, occupied_blocks);
     }
 
     std::pair<file_system *, init_result> file_system::init(std::size_t cylinders_no,
                                                             std::size_t surfaces_no,
                                                             std::size_t sections_no,
                                                             std::size_t section_length,
-                                                            const std::string &filename) {
+                                                            const std::string &filename,
+                                                            io_engine engine,
+                                                            std::size_t cache_budget,
+                                                            layout format,
+                                                            volume_geometry volume,
+                                                            std::size_t oft_capacity,
+                                                            code_path code) {
         assert(cylinders_no > 0 && "number of cylinders should be positive integer");
         assert(surfaces_no > 0 && "number of surfaces should be positive integer");
         assert(sections_no > 0 && "number of sections should be positive integer");
-        assert((section_length & 1) != 1 && "section (block) length should be power of 2");
-
-        std::uint8_t blocks_no = cylinders_no * surfaces_no * sections_no;
-        assert(blocks_no > constraints::descriptive_blocks_no && "blocks number is too small");
-
-        std::vector disk{blocks_no, std::vector{section_length, std::byte{0}}};
-        init_result result;
-
-        std::ifstream file(filename, std::ios::in | std::ios::binary);
-        if (file.is_open()) {
-            result = RESTORED;
-            for (std::size_t i = 0; i < blocks_no; i++) {
-                char *char_data = new char[section_length];
-                file.read(char_data, section_length);
-                for (std::size_t j = 0; j < section_length; j++) {
-                    disk[i][j] = std::byte{(std::uint8_t) char_data[j]};
+        assert(section_length % 2 == 0 && "section (block) length should be even");
+
+        std::size_t blocks_no = cylinders_no * surfaces_no * sections_no;
+        if (blocks_no <= constraints::descriptive_blocks_no ||
+            (volume.members_no > 1 && section_length < utils::volume_header::size)) {
+            return {nullptr, INVALID_GEOMETRY};
+        }
+
+        bool created = false;
+        bool mismatch = false;
+        auto disk_io = open_volume(engine, filename, blocks_no, section_length, volume, created, mismatch);
+        if (!disk_io) {
+            return {nullptr, mismatch ? INVALID_GEOMETRY : FAILED};
+        }
+
+        if (created) {
+            auto sb = utils::superblock::plan(blocks_no, section_length, format.files);
+            if (!sb) {
+                disk_io.reset();
+                utils::remove_images(filename, volume);
+                return {nullptr, INVALID_GEOMETRY};
+            }
+
+            std::vector<std::byte> block(section_length, std::byte{0});
+            sb->write(block);
+            bool written = disk_io->write_block(0, block.begin());
+
+            // blocks of metadata and of the journal are marked taken
+            const auto bits_per_block = 8 * section_length;
+            for (auto i = sb->bitmap_start; i < sb->descriptors_start; i++) {
+                std::fill(block.begin(), block.end(), std::byte{0});
+                for (std::size_t j = (i - sb->bitmap_start) * bits_per_block;
+                     j < std::min(blocks_no, (i - sb->bitmap_start + 1) * bits_per_block); j++) {
+                    if (j < sb->data_start() || (sb->journal_blocks_no > 0 && j >= sb->journal_start)) {
+                        block[j % bits_per_block / 8] |= std::byte{1} << (7 - (j % 8));
+                    }
                 }
+                written &= disk_io->write_block(i, block.begin());
             }
-            //todo: consider meeting end of file?
-        } else {
-            result = CREATED;
-            disk[0][0] = std::byte{192};  // 192 = 11000000
 
-            using constrs = file_system::constraints;
-            for (auto i = constrs::bytes_for_file_length;
-                i < constrs::bytes_for_file_length + constrs::max_blocks_per_file; i++) {
-                disk[1][i] = std::byte{255};
+            // descriptor of the directory is taken from the start
+            std::fill(block.begin(), block.end(), std::byte{0});
+            block[0] = std::byte{1};
+            written &= disk_io->write_block(sb->descriptors_start, block.begin());
+            if (!written) {
+                disk_io.reset();
+                utils::remove_images(filename, volume);
+                return {nullptr, FAILED};
             }
+        } else if (auto sb = utils::superblock::read(disk_io->acquire(0).data());
+                   sb && (sb->blocks_no != blocks_no || sb->block_size != section_length)) {
+            return {nullptr, INVALID_GEOMETRY};
+        }
+
+        // v2 images of common block sizes are served by code with their layout built in
+        file_system *fs;
+        bool v2 = utils::superblock::read(disk_io->acquire(0).data()).has_value();
+        switch (code == code_path::SPECIALIZED && v2 ? section_length : 0) {
+            case 512:
+                fs = new basic_file_system<fixed_layout<512>>{filename, std::move(disk_io), cache_budget, oft_capacity};
+                break;
+            case 1024:
+                fs = new basic_file_system<fixed_layout<1024>>{filename, std::move(disk_io), cache_budget, oft_capacity};
+                break;
+            case 4096:
+                fs = new basic_file_system<fixed_layout<4096>>{filename, std::move(disk_io), cache_budget, oft_capacity};
+                break;
+            default:
+                fs = new basic_file_system<runtime_layout>{filename, std::move(disk_io), cache_budget, oft_capacity};
         }
 
-        return {new file_system{filename, io{blocks_no, section_length, std::move(disk)}}, result};
+        // blocks too small for buckets keep flat directory
+        if (created && format.directory == dir_format::HASHED) {
+            fs->migrate_directory();
+        }
+        return {fs, created ? CREATED : RESTORED};
     }
 
-    void file_system::save(const std::string &filename) {
-        std::ofstream file{filename, std::ios::out | std::ios::binary};
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::max_files_quantity() const {
+        return std::min(max_blocks_of(_dir_entry->get_descriptor()) * _layout.block_size() / dir_entry_size(), descriptors_no());
+    }
 
-        std::vector<std::byte> bitmap_block;
-        std::uint8_t x = 0;
-        for (std::size_t i = 0, j = 7; i < _bitmap.size(); i++, j--) {
-            x |= (bool) _bitmap[i];
-            if (j != 0) {
-                x <<= 1;
-            } else {
-                bitmap_block.push_back(std::byte{x});
-                x = 0;
-                j = 7;
+    template <class Layout>
+    dir_format basic_file_system<Layout>::get_dir_format() const {
+        return _dir_format;
+    }
+
+    template <class Layout>
+    file_format basic_file_system<Layout>::get_file_format() const {
+        return _file_format;
+    }
+
+    template <class Layout>
+    format_version basic_file_system<Layout>::get_version() const {
+        return _version;
+    }
+
+    template <class Layout>
+    bool basic_file_system<Layout>::is_read_only() const {
+        return _version == format_version::V1;
+    }
+
+    template <class Layout>
+    auto basic_file_system<Layout>::cache_stats() const -> const block_cache::stats & {
+        return _io->get_stats();
+    }
+
+    // blocks written by other threads while the image is saved may be saved partly
+    template <class Layout>
+    flush_stats basic_file_system<Layout>::save(const std::string &filename) {
+        {
+            journal::operation op{_journal.get()};
+            std::unique_lock dir{_dir_lock};
+            std::shared_lock table{_oft_lock};
+            for (auto [descriptor_index, i] : _open_files) {
+                auto entry = _oft.find(i);
+                std::lock_guard handle{entry->lock};
+                std::unique_lock inode{entry->get_descriptor()->lock};
+                flush_write_behind(entry);
+                if (entry->modified) {
+                    save_block(entry);
+                }
             }
         }
-        bitmap_block.resize(_io.get_block_size(), std::byte{0});
 
-        for (std::uint8_t i = 0; i < _oft.size(); i++) {
-            close(i);
+        flush_stats stats;
+        if (_journal && !_journal->commit(stats)) {
+            stats.failed = true;
+        }
+
+        // only blocks changed since the last save are written, in place
+        if (_io->is_backed_by(filename)) {
+            stats.failed |= !_io->sync(stats);
+            return stats;
         }
 
-        file.write(reinterpret_cast<char *>(bitmap_block.data()), _io.get_block_size());
-        std::vector<std::byte> block(_io.get_block_size());
-        for (std::size_t i = 1; i < _io.get_blocks_no(); i++) {
-            _io.read_block(i, block.begin());
-            file.write(reinterpret_cast<char *>(block.data()), _io.get_block_size());
+        std::ofstream file{filename, std::ios::out | std::ios::binary};
+        for (std::size_t i = 0; i < _io->get_blocks_no(); i++) {
+            auto block = _io->acquire(i);
+            stats.failed |= block.failed();
+            file.write(reinterpret_cast<char *>(block.data().data()), (std::streamsize) _layout.block_size());
+            stats.blocks++;
+            stats.bytes += _layout.block_size();
         }
+        stats.failed |= !file;
+        return stats;
     }
 
-    void file_system::save() {
-        save(_filename);
+    template <class Layout>
+    flush_stats basic_file_system<Layout>::save() {
+        return save(_filename);
     }
 
-    fs_result file_system::create(const std::string &filename) {
+    template <class Layout>
+    fs_result basic_file_system<Layout>::create(const std::string &filename) {
+        journal::operation op{_journal.get()};
+
+        if (is_read_only()) {
+            return READ_ONLY;
+        }
         if (filename.size() > constraints::max_filename_length) {
             return INVALID_NAME;
         }
 
-        auto result = take_dir_entry(filename);
-        if (result.second != SUCCESS) {
-            return result.second;
+        std::unique_lock dir{_dir_lock};
+        if (get_descriptor_index_from_dir_entry(filename) != -1) {
+            return EXISTS;
         }
 
-        auto index = result.first;
         auto descriptor_index = take_descriptor();
         if (descriptor_index == -1)
             return NO_SPACE;
 
-        if(save_dir_entry(index, filename, descriptor_index)) {
-            return SUCCESS;
-        } else {
-            return FAIL;
+        if (auto res = insert_dir_entry(filename, descriptor_index); res != SUCCESS) {
+            release_descriptor(descriptor_index);
+            return res;
         }
+        return SUCCESS;
     }
 
-    std::pair<std::size_t, fs_result> file_system::open(const std::string &filename) {
+    template <class Layout>
+    std::pair<std::size_t, fs_result> basic_file_system<Layout>::open(const std::string &filename, open_mode mode) {
         if (filename.size() > constraints::max_filename_length) {
             return {0, INVALID_NAME};
         }
 
-        std::size_t free_entry = 0;
-        for (unsigned i = 0; i < _oft.size(); i++) {
-            if (_oft[i] != nullptr) {
-                if (_oft[i]->get_filename() == filename) {
-                    return {0, ALREADY_OPENED};
-                }
-            } else {
-                if (free_entry == 0) {
-                    free_entry = i;
-                }
-            }
-        }
+        std::shared_lock dir{_dir_lock};
+        int index = get_descriptor_index_from_dir_entry(filename);
 
-        if (free_entry == 0 && _oft.size() == constraints::oft_max_size) {
+        std::unique_lock table{_oft_lock};
+        if (_oft.full()) {
             return {0, OFT_FULL};
         }
+        if (index == -1)
+            return {0, NOT_FOUND};
+        auto descriptor = get_descriptor(index);
 
-        int index;
+        // every open gets its own handle and position, handles of one file share its descriptor
+        auto handle = _oft.emplace(filename, (std::size_t) index, descriptor, mode);
+        _open_files.emplace(index, handle);
+        descriptor->opens++;
+        return {handle, SUCCESS};
+    }
 
-        // check if file info is already cached
-        if (_descriptor_indexes_cache.contains(filename)) {
-            index = _descriptor_indexes_cache[filename];
-        } else {
-            index = get_descriptor_index_from_dir_entry(filename);
-            if (index == -1)
-                return {0, NOT_FOUND};
-        }
-        get_descriptor(index);
+    template <class Layout>
+    fs_result basic_file_system<Layout>::destroy(const std::string& filename) {
+        journal::operation op{_journal.get()};
 
-        if (free_entry == 0) {
-            _oft.emplace_back(new oft_entry{filename, (std::size_t) index});
-            free_entry = _oft.size() - 1;
-        } else {
-            _oft[free_entry] = new oft_entry{filename, (std::size_t)index};
+        if (is_read_only()) {
+            return READ_ONLY;
         }
-        return {free_entry, SUCCESS};
-    }
+        std::unique_lock dir{_dir_lock};
+        int descriptor_index = get_descriptor_index_from_dir_entry(filename);
+        if (descriptor_index == -1)
+            return NOT_FOUND;
 
-    fs_result file_system::destroy(const std::string& filename) {
-        int descriptor_index = -1;
+        // remove oft entries of the file, once threads which took them before are done with them
+        std::unique_lock table{_oft_lock};
+        std::vector<std::pair<std::size_t, oft_entry *>> entries;
+        auto [first, last] = _open_files.equal_range(descriptor_index);
+        for (auto it = first; it != last; ++it) {
+            entries.emplace_back(it->second, _oft.detach(it->second));
+        }
+        _open_files.erase(first, last);
+        table.unlock();
 
-        // remove oft entry
-        for (int i = 0; i < _oft.size(); ++i) {
-            if (_oft[i] && _oft[i]->get_filename() == filename) {
-                descriptor_index = (int) _oft[i]->get_descriptor_index();
-                delete _oft[i];
-                _oft[i] = nullptr;
+        if (!entries.empty()) {
+            // threads which took the handles before are waited for
+            for (auto [i, entry] : entries) {
+                std::lock_guard handle{entry->lock};
             }
-        }
+            auto descriptor = entries.front().second->get_descriptor();
+            drop_write_behind(descriptor);
+            descriptor->opens = 0;
 
-        // file wasn't opened
-        if (descriptor_index == -1) {
-            // check if file info is already cached
-            if (auto it = _descriptor_indexes_cache.find(filename); it != _descriptor_indexes_cache.end()) {
-                descriptor_index = (int) it->second;
-            } else {
-                descriptor_index = get_descriptor_index_from_dir_entry(filename);
-                if (descriptor_index == -1)
-                    return NOT_FOUND;
+            table.lock();
+            for (auto [i, entry] : entries) {
+                _oft.release(i);
             }
+            table.unlock();
         }
 
         if (file_descriptor* descriptor = get_descriptor(descriptor_index)) {
 
             // clear caches
-            _descriptors_cache.erase(descriptor_index);
-            _descriptor_indexes_cache.erase(filename);
+            {
+                std::lock_guard descriptors{_table_lock};
+                _descriptors_cache.erase(descriptor_index);
+            }
 
 
-            // update available blocks in bitmap
-            for (std::size_t i = 0; i < descriptor->length / _io.get_block_size(); ++i) {
-                _bitmap[descriptor->occupied_blocks[i]] = false;
-            }
+            // update available blocks in bitmap, partly filled last block included
+            free_blocks(descriptor);
 
             // clear descriptor in io
-            file_descriptor empty_descriptor{0, {0, 0, 0}};
-            save_descriptor(descriptor_index, &empty_descriptor);
+            release_descriptor(descriptor_index);
+            delete descriptor;
 
-            if (auto code = overwrite_dir_entry(filename); code != SUCCESS) {
+            if (auto code = remove_dir_entry(filename); code != SUCCESS) {
                 return code;
             }
 
@@ -256,42 +428,116 @@ namespace lab_fs {
         return NOT_FOUND;
     }
 
-    std::pair<size_t, fs_result> file_system::write(std::size_t i, std::vector<std::byte>::iterator mem_area, std::size_t count) {
-        if (i >= _oft.size()) {
+    template <class Layout>
+    std::pair<size_t, fs_result> basic_file_system<Layout>::write(std::size_t i, std::vector<std::byte>::iterator mem_area, std::size_t count) {
+        return write(i, std::span<const std::byte>{std::to_address(mem_area), count});
+    }
+
+    template <class Layout>
+    std::pair<size_t, fs_result> basic_file_system<Layout>::write(std::size_t i, std::span<const std::byte> src) {
+        journal::operation op{_journal.get()};
+
+        auto [ofte, handle] = lock_entry(i);
+        if (!ofte)
             return {0, NOT_FOUND};
-        }
-        if (count == 0) {
+        if (src.empty()) {
             return {0, SUCCESS};
         }
-        auto ofte = _oft[i];
-        if (!ofte)
-            return {0, NOT_FOUND};
-        auto descriptor = _descriptors_cache[ofte->get_descriptor_index()];
-        std::size_t pos = ofte->current_pos % _io.get_block_size();
-        std::size_t new_pos = pos;
+        if (is_read_only()) {
+            return {0, READ_ONLY};
+        }
+        std::unique_lock inode{ofte->get_descriptor()->lock};
+        return write_entry(ofte, src);
+    }
+
+    // writes at the current position of an entry checked by the caller. Data appended past the allocated
+    // blocks of the file waits in the write-behind buffer; direct entry writes partial head and tail blocks
+    // through the cache and whole blocks in between past it
+    template <class Layout>
+    std::pair<size_t, fs_result> basic_file_system<Layout>::write_entry(oft_entry *ofte, std::span<const std::byte> src) {
+        // directory entries are journaled by their disk blocks, so directory never waits for allocation
+        if (!ofte->direct && ofte->get_descriptor_index() == 0) {
+            return write_buffered(ofte, src);
+        }
+        if (!ofte->direct) {
+            auto descriptor = ofte->get_descriptor();
+            auto allocated = descriptor->blocks_no() * _layout.block_size();
+            // data another handle left in the buffer may be lost by a failed flush, leaving position past the end
+            ofte->current_pos = std::min(ofte->current_pos,
+                                         descriptor->write_behind.empty() ? descriptor->length : allocated + descriptor->write_behind.size());
+            // buffer is flushed first if the write doesn't continue it
+            if (!descriptor->write_behind.empty() && ofte->current_pos != allocated + descriptor->write_behind.size()) {
+                auto pos = ofte->current_pos;
+                if (auto res = flush_write_behind(ofte); res != SUCCESS) {
+                    return {0, res};
+                }
+                ofte->current_pos = pos;
+                allocated = descriptor->blocks_no() * _layout.block_size();
+            }
+            if (!descriptor->write_behind.empty() || ofte->current_pos >= allocated) {
+                return write_behind(ofte, src);
+            }
+            auto [written, res] = write_buffered(ofte, src.first(std::min(src.size(), allocated - ofte->current_pos)));
+            if (res != SUCCESS || written == src.size()) {
+                return {written, res};
+            }
+            auto [buffered, behind_res] = write_behind(ofte, src.subspan(written));
+            return {written + buffered, behind_res};
+        }
+
+        std::size_t done = 0;
+        if (auto head = std::min(src.size(), _layout.offset_in_block(_layout.block_size() - _layout.offset_in_block(ofte->current_pos)));
+                head > 0) {
+            auto [written, res] = write_buffered(ofte, src.first(head));
+            if (res != SUCCESS) {
+                return {written, res};
+            }
+            done = written;
+        }
+        reserve_blocks(ofte, std::min(ofte->current_pos + src.size() - done, _layout.block_size() * max_file_blocks()));
+        while (src.size() - done >= _layout.block_size()) {
+            auto [written, res] = write_direct(ofte, src.subspan(done, src.size() - done - _layout.offset_in_block(src.size() - done)));
+            if (res != SUCCESS) {
+                return {done, res};
+            }
+            if (written == 0) {
+                break;
+            }
+            done += written;
+        }
+        if (done == src.size()) {
+            return {done, SUCCESS};
+        }
+        // tail, or the rest of a write which can't be served directly with its error
+        auto [written, res] = write_buffered(ofte, src.subspan(done));
+        return {done + written, res};
+    }
+
+    template <class Layout>
+    std::pair<size_t, fs_result> basic_file_system<Layout>::write_buffered(oft_entry *ofte, std::span<const std::byte> src) {
+        const auto count = src.size();
+        auto descriptor = ofte->get_descriptor();
+        std::size_t pos = _layout.offset_in_block(ofte->current_pos);
         std::size_t offset = 0;
-        bool changed = false;
-        std::size_t current_block = ofte->current_pos / _io.get_block_size();
+        std::size_t current_block = _layout.block_of(ofte->current_pos);
 
-        if (ofte->current_pos == _io.get_block_size() * constraints::max_blocks_per_file) {
+        if (ofte->current_pos == _layout.block_size() * max_file_blocks()) {
             return {0, TOO_BIG};
         }
 
+        reserve_blocks(ofte, ofte->current_pos + count);
+
         if (auto init_oft_res = initialize_oft_entry(ofte, current_block); init_oft_res != SUCCESS) {
             return {0, init_oft_res};
         }
 
         while (true) {
             // fits within current block
-            if (count - offset <= _io.get_block_size() - pos) {
-                std::copy(mem_area + offset, mem_area + count, ofte->buffer.begin() + pos);
+            if (count - offset <= _layout.block_size() - pos) {
+                std::memcpy(ofte->block.data().data() + pos, src.data() + offset, count - offset);
                 ofte->modified = true;
                 ofte->current_pos += count - offset;
 
-                /* if (ofte->current_pos / _io.get_block_size() > current_block) {
-                    save_block(ofte, current_block);
-                } */
-
                 if (descriptor->length < ofte->current_pos) {
                     descriptor->length = ofte->current_pos;
                     save_descriptor(ofte->get_descriptor_index(), descriptor);
@@ -301,15 +547,14 @@ namespace lab_fs {
             }
             // src would be split between couple blocks
             else {
-                auto part = _io.get_block_size() - pos;
-                std::copy(mem_area + offset, mem_area + offset + part, ofte->buffer.begin() + pos);
+                auto part = _layout.block_size() - pos;
+                std::memcpy(ofte->block.data().data() + pos, src.data() + offset, part);
+                ofte->modified = true;
                 offset += part;
                 ofte->current_pos += part;
 
-                /*save_block(ofte, current_block);*/
-
                 // check if there is space to continue
-                if (current_block < constraints::max_blocks_per_file - 1) {
+                if (current_block < max_file_blocks() - 1) {
                     current_block++;
                     auto res = initialize_oft_entry(ofte, current_block);
                     if (res != SUCCESS) {
@@ -323,8 +568,8 @@ namespace lab_fs {
                 }
                 // file has reached the max size
                 else {
-                    if (descriptor->length < constraints::max_blocks_per_file * _io.get_block_size()) {
-                        descriptor->length = constraints::max_blocks_per_file * _io.get_block_size();
+                    if (descriptor->length < max_file_blocks() * _layout.block_size()) {
+                        descriptor->length = max_file_blocks() * _layout.block_size();
                         save_descriptor(ofte->get_descriptor_index(), descriptor);
                     }
                     return {offset, TOO_BIG};
@@ -333,52 +578,161 @@ namespace lab_fs {
         }
     }
 
-    fs_result file_system::lseek(std::size_t i, std::size_t pos) {
-        if (i >= _oft.size()) {
-            return NOT_FOUND;
-        }
+    template <class Layout>
+    fs_result basic_file_system<Layout>::lseek(std::size_t i, std::size_t pos) {
+        journal::operation op{_journal.get()};
 
-        auto ofte = _oft[i];
+        auto [ofte, handle] = lock_entry(i);
         if (!ofte)
             return NOT_FOUND;
+        return seek_entry(ofte, pos);
+    }
 
-        auto descriptor = get_descriptor(ofte->get_descriptor_index());
-        if (pos > descriptor->length) {
+    // handle is checked and locked by the caller; write-behind data is flushed, so the file has its full length
+    template <class Layout>
+    fs_result basic_file_system<Layout>::seek_entry(oft_entry *ofte, std::size_t pos) {
+        if (auto res = flush_entry(ofte); res != SUCCESS) {
+            return res;
+        }
+        std::shared_lock inode{ofte->get_descriptor()->lock};
+        if (pos > ofte->get_descriptor()->length) {
             return INVALID_POS;
         }
 
-        /* std::size_t current_block = ofte->current_pos / _io.get_block_size();
-        std::size_t new_block = pos / _io.get_block_size();
+        /* std::size_t current_block = ofte->current_pos / _layout.block_size();
+        std::size_t new_block = pos / _layout.block_size();
         if (current_block != new_block && ofte->modified) {
-            save_block(ofte, current_block);
+            save_block(ofte);
         } */
         ofte->current_pos = pos;
         return SUCCESS;
     }
 
-    std::pair<std::size_t, fs_result> file_system::read(std::size_t i, std::vector<std::byte>::iterator mem_area, std::size_t count) {
-        if (i >= _oft.size()) {
+    template <class Layout>
+    std::pair<std::size_t, fs_result> basic_file_system<Layout>::read(std::size_t i, std::vector<std::byte>::iterator mem_area, std::size_t count) {
+        return read(i, std::span<std::byte>{std::to_address(mem_area), count});
+    }
+
+    template <class Layout>
+    std::pair<std::size_t, fs_result> basic_file_system<Layout>::read(std::size_t i, std::span<std::byte> dest) {
+        journal::operation op{_journal.get()};
+
+        auto [entry, handle] = lock_entry(i);
+        if (!entry) {
+            return {0, NOT_FOUND};
+        }
+        if (auto res = flush_entry(entry); res != SUCCESS) {
+            return {0, res};
+        }
+        std::shared_lock inode{entry->get_descriptor()->lock};
+        return read_entry(entry, dest);
+    }
+
+    // served at `offset` through the cache, without seeking the handle or loading a block into it
+    template <class Layout>
+    std::pair<std::size_t, fs_result> basic_file_system<Layout>::pread(std::size_t i, std::size_t offset, std::span<std::byte> dest) {
+        journal::operation op{_journal.get()};
+
+        auto [entry, handle] = lock_entry(i);
+        if (!entry) {
             return {0, NOT_FOUND};
         }
+        if (auto res = flush_entry(entry); res != SUCCESS) {
+            return {0, res};
+        }
+        std::shared_lock inode{entry->get_descriptor()->lock};
+        return read_at(entry, offset, dest);
+    }
 
-        auto oft_entry = _oft[i];
-        auto descriptor = get_descriptor(oft_entry->get_descriptor_index());
+    template <class Layout>
+    std::pair<std::size_t, fs_result> basic_file_system<Layout>::pwrite(std::size_t i, std::size_t offset, std::span<const std::byte> src) {
+        journal::operation op{_journal.get()};
 
-        if (!_oft[i] || !descriptor) {
+        auto [entry, handle] = lock_entry(i);
+        if (!entry) {
             return {0, NOT_FOUND};
         }
+        if (is_read_only()) {
+            return {0, READ_ONLY};
+        }
+        std::unique_lock inode{entry->get_descriptor()->lock};
+        if (auto res = flush_write_behind(entry); res != SUCCESS) {
+            return {0, res};
+        }
+        return write_at(entry, offset, src);
+    }
+
+    // write-behind buffer of the file is flushed before a handle reads it; the lock of the file
+    // is exclusive for the flush only. Data other handles append afterwards isn't seen by the read
+    template <class Layout>
+    auto basic_file_system<Layout>::flush_entry(oft_entry *entry) -> fs_result {
+        auto descriptor = entry->get_descriptor();
+        {
+            std::shared_lock inode{descriptor->lock};
+            if (descriptor->write_behind.empty()) {
+                return SUCCESS;
+            }
+        }
+        std::unique_lock inode{descriptor->lock};
+        return flush_write_behind(entry);
+    }
+
+    // reads from the current position of an entry checked by the caller, whose write-behind data is flushed;
+    // direct entry reads partial head and tail blocks through the cache and whole blocks in between past it
+    template <class Layout>
+    std::pair<std::size_t, fs_result> basic_file_system<Layout>::read_entry(oft_entry *oft_entry, std::span<std::byte> dest) {
+        // data another handle left in write-behind buffer may be lost by a failed flush, leaving position past the end
+        oft_entry->current_pos = std::min(oft_entry->current_pos, oft_entry->get_descriptor()->length);
+        if (!oft_entry->direct) {
+            return read_buffered(oft_entry, dest);
+        }
+
+        auto descriptor = oft_entry->get_descriptor();
+        dest = dest.first(std::min(descriptor->length - oft_entry->current_pos, dest.size()));
+
+        std::size_t done = 0;
+        if (auto head = std::min(dest.size(), _layout.offset_in_block(_layout.block_size() - _layout.offset_in_block(oft_entry->current_pos)));
+                head > 0) {
+            auto [bytes_read, res] = read_buffered(oft_entry, dest.first(head));
+            if (res != SUCCESS) {
+                return {bytes_read, res};
+            }
+            done = bytes_read;
+        }
+        while (dest.size() - done >= _layout.block_size()) {
+            auto [bytes_read, res] = read_direct(oft_entry, dest.subspan(done, dest.size() - done - _layout.offset_in_block(dest.size() - done)));
+            if (res != SUCCESS) {
+                return {done, res};
+            }
+            if (bytes_read == 0) {
+                break;
+            }
+            done += bytes_read;
+        }
+        if (done == dest.size()) {
+            return {done, SUCCESS};
+        }
+        auto [bytes_read, res] = read_buffered(oft_entry, dest.subspan(done));
+        return {done + bytes_read, res};
+    }
+
+    template <class Layout>
+    std::pair<std::size_t, fs_result> basic_file_system<Layout>::read_buffered(oft_entry *oft_entry, std::span<std::byte> dest) {
+        auto count = dest.size();
+        auto descriptor = oft_entry->get_descriptor();
 
         std::size_t  bytes_read = 0;
         count = std::min(descriptor->length - oft_entry->current_pos, count);
         while (count > 0) {
             // end of file
-            if (oft_entry->current_pos == constraints::max_blocks_per_file * _io.get_block_size()) {
+            if (oft_entry->current_pos == max_file_blocks() * _layout.block_size()) {
                 break;
             }
 
             // init block in oft entry
-            if (!oft_entry->initialized || oft_entry->current_block != oft_entry->current_pos / _io.get_block_size()) {
-                const std::size_t block = oft_entry->current_pos / _io.get_block_size();
+            if (!oft_entry->initialized || oft_entry->current_block != _layout.block_of(oft_entry->current_pos)) {
+                const std::size_t block = _layout.block_of(oft_entry->current_pos);
+                read_ahead(oft_entry, block);
                 const auto res = initialize_oft_entry(oft_entry, block);
 
                 if (res != SUCCESS) {
@@ -386,25 +740,22 @@ namespace lab_fs {
                 }
             }
 
-            const std::size_t position_in_block = oft_entry->current_pos % _io.get_block_size();
-            const std::size_t n_bytes_to_copy = std::min(count, _io.get_block_size() - position_in_block);
+            const std::size_t position_in_block = _layout.offset_in_block(oft_entry->current_pos);
+            const std::size_t n_bytes_to_copy = std::min(count, _layout.block_size() - position_in_block);
 
-            std::copy(oft_entry->buffer.begin() + position_in_block,
-                      oft_entry->buffer.begin() + position_in_block + n_bytes_to_copy,
-                      mem_area);
+            std::memcpy(dest.data() + bytes_read, oft_entry->block.data().data() + position_in_block, n_bytes_to_copy);
 
             oft_entry->current_pos += n_bytes_to_copy;
 
-            /* if(oft_entry->current_pos % _io.get_block_size() == 0) {
+            /* if(oft_entry->current_pos % _layout.block_size() == 0) {
                 if (oft_entry->modified) {
-                    save_block(oft_entry, oft_entry->current_pos / _io.get_block_size() - 1);
+                    save_block(oft_entry);
                 } else {
                     oft_entry->initialized = false;
                 }
             } */
             
 
-            std::advance(mem_area, n_bytes_to_copy);
             count -= n_bytes_to_copy;
             bytes_read += n_bytes_to_copy;
         }
@@ -412,36 +763,513 @@ namespace lab_fs {
         return {bytes_read, SUCCESS};
     }
 
-    fs_result file_system::close(std::size_t i) {
-        if (i >= _oft.size() || !_oft[i]) {
-            return NOT_FOUND;
+    // reading of a new block by a sequential stream doubles its readahead window and tops it up;
+    // nearer half of the window is loaded into the cache, farther half is only hinted to the device,
+    // which may read it in the background. Any other access resets the window
+    template <class Layout>
+    void basic_file_system<Layout>::read_ahead(oft_entry *entry, std::size_t block) {
+        auto &state = entry->readahead;
+        if (block != state.next) {
+            state = {block + 1, 0, block + 1};
+            return;
         }
-        auto oft_entry = _oft[i];
-        const auto descriptor = get_descriptor(oft_entry->get_descriptor_index());
 
-        if (oft_entry->modified) {
-            // save
-            const std::size_t current_block = oft_entry->current_pos / _io.get_block_size();
-            _io.write_block(descriptor->occupied_blocks[current_block], oft_entry->buffer.begin());
+        // window is kept well below cache capacity, so read ahead blocks live until the stream reaches them
+        auto max_window = std::clamp(_io->capacity() / 4, constraints::min_readahead_blocks, constraints::max_readahead_blocks);
+        state.window = std::clamp(state.window * 2, constraints::min_readahead_blocks, max_window);
+        state.next = block + 1;
+        state.end = std::max(state.end, block + 1);
+
+        auto descriptor = entry->get_descriptor();
+        auto last = std::min(block + 1 + state.window, _layout.block_of(descriptor->length + _layout.block_size() - 1));
+        auto hinted = block + 1 + state.window / 2;
+        while (state.end < last) {
+            // disk run of consecutive file blocks, not crossing into the hinted half
+            auto bound = state.end < hinted ? std::min(hinted, last) : last;
+            auto start = descriptor->block(state.end);
+            std::size_t length = 1;
+            while (state.end + length < bound && descriptor->block(state.end + length) == start + length) {
+                length++;
+            }
+            if (state.end < hinted || !_io->will_need(start, length)) {
+                _io->prefetch(start, length);
+            }
+            state.end += length;
         }
+    }
 
-        delete _oft[i];
-        _oft[i] = nullptr;
+    // disk run {start, length} holding up to `blocks_no` file blocks from file block `first` of an entry,
+    // length is 0 if the block there isn't allocated. Block pinned by the entry is released first,
+    // so the cache sees changes made through it
+    template <class Layout>
+    auto basic_file_system<Layout>::direct_run(oft_entry *entry, std::size_t first, std::size_t blocks_no) -> std::pair<std::size_t, std::size_t> {
+        auto descriptor = entry->get_descriptor();
+        blocks_no = std::min(blocks_no, max_file_blocks() - std::min(first, max_file_blocks()));
+
+        auto start = blocks_no > 0 ? descriptor->block(first) : 0;
+        if (start == 0) {
+            return {0, 0};
+        }
+        std::size_t length = 1;
+        while (length < blocks_no && descriptor->block(first + length) == start + length) {
+            length++;
+        }
 
-        return SUCCESS;
+        if (entry->initialized && entry->current_block >= first && entry->current_block < first + length) {
+            if (entry->modified) {
+                save_block(entry);
+            } else {
+                entry->block.release();
+                entry->initialized = false;
+            }
+        }
+        return {start, length};
     }
 
-    auto file_system::directory() -> std::vector<std::pair<std::string, std::size_t>> {
-        std::vector<std::pair<std::string, std::size_t>> res;
-        for (std::size_t i = 0; ; i++) {
-            auto entry  = utils::dir_entry::read_dir_entry(this, i);
-            if (!entry.has_value()) {
+    // whole blocks at the current position of a direct entry; returns number of bytes moved,
+    // position stays as it was if the device fails
+    template <class Layout>
+    auto basic_file_system<Layout>::read_direct(oft_entry *entry, std::span<std::byte> dest) -> std::pair<std::size_t, fs_result> {
+        auto [start, length] = direct_run(entry, _layout.block_of(entry->current_pos), _layout.block_of(dest.size()));
+        auto bytes = length * _layout.block_size();
+        if (bytes > 0) {
+            if (!_io->read_direct(start, dest.first(bytes))) {
+                return {0, FAIL};
+            }
+            entry->current_pos += bytes;
+        }
+        return {bytes, SUCCESS};
+    }
+
+    template <class Layout>
+    auto basic_file_system<Layout>::write_direct(oft_entry *entry, std::span<const std::byte> src) -> std::pair<std::size_t, fs_result> {
+        auto [start, length] = direct_run(entry, _layout.block_of(entry->current_pos), _layout.block_of(src.size()));
+        auto bytes = length * _layout.block_size();
+        if (bytes > 0) {
+            if (!_io->write_direct(start, src.first(bytes))) {
+                return {0, FAIL};
+            }
+            entry->current_pos += bytes;
+
+            auto descriptor = entry->get_descriptor();
+            if (descriptor->length < entry->current_pos) {
+                descriptor->length = entry->current_pos;
+                save_descriptor(entry->get_descriptor_index(), descriptor);
+            }
+        }
+        return {bytes, SUCCESS};
+    }
+
+    // reads at `offset` of an entry checked by the caller, whose write-behind data is flushed; neither position
+    // nor readahead state of the entry is used, blocks are taken from the cache one by one. Direct entry
+    // moves whole blocks past the cache
+    template <class Layout>
+    auto basic_file_system<Layout>::read_at(oft_entry *entry, std::size_t offset, std::span<std::byte> dest) -> std::pair<std::size_t, fs_result> {
+        auto descriptor = entry->get_descriptor();
+        if (offset > descriptor->length) {
+            return {0, INVALID_POS};
+        }
+        dest = dest.first(std::min(descriptor->length - offset, dest.size()));
+
+        const auto block_size = _layout.block_size();
+        std::size_t done = 0;
+        while (done < dest.size()) {
+            auto pos = offset + done;
+            auto in_block = _layout.offset_in_block(pos);
+            if (entry->direct && in_block == 0 && dest.size() - done >= block_size) {
+                auto [start, length] = direct_run(entry, _layout.block_of(pos), _layout.block_of(dest.size() - done));
+                if (length > 0) {
+                    if (!_io->read_direct(start, dest.subspan(done, length * block_size))) {
+                        return {done, FAIL};
+                    }
+                    done += length * block_size;
+                    continue;
+                }
+            }
+            auto n = std::min(dest.size() - done, block_size - in_block);
+            auto block = _io->acquire(descriptor->block(_layout.block_of(pos)));
+            if (block.failed()) {
+                return {done, FAIL};
+            }
+            std::memcpy(dest.data() + done, block.data().data() + in_block, n);
+            done += n;
+        }
+        return {done, SUCCESS};
+    }
+
+    // writes at `offset` of an entry checked by the caller, whose write-behind data is flushed; blocks
+    // the write lacks are taken as one run first. Position and pinned block of the entry stay as they were,
+    // the pinned block shares its cache frame with the write
+    template <class Layout>
+    auto basic_file_system<Layout>::write_at(oft_entry *entry, std::size_t offset, std::span<const std::byte> src) -> std::pair<std::size_t, fs_result> {
+        auto descriptor = entry->get_descriptor();
+        if (offset > descriptor->length) {
+            return {0, INVALID_POS};
+        }
+
+        const auto block_size = _layout.block_size();
+        const auto count = std::min(src.size(), block_size * max_file_blocks() - offset);
+        auto res = count < src.size() ? TOO_BIG : SUCCESS;
+        const auto length = descriptor->length;
+        const auto blocks_no = descriptor->blocks_no();
+        reserve_blocks(entry, offset + count);
+
+        std::size_t done = 0;
+        while (done < count) {
+            auto pos = offset + done;
+            auto in_block = _layout.offset_in_block(pos);
+            if (entry->direct && in_block == 0 && count - done >= block_size) {
+                auto [start, run] = direct_run(entry, _layout.block_of(pos), _layout.block_of(count - done));
+                if (run > 0) {
+                    if (!_io->write_direct(start, src.subspan(done, run * block_size))) {
+                        res = FAIL;
+                        break;
+                    }
+                    done += run * block_size;
+                    descriptor->length = std::max(descriptor->length, offset + done);
+                    continue;
+                }
+            }
+
+            auto k = _layout.block_of(pos);
+            auto disk_block = descriptor->block(k);
+            if (disk_block == 0) {
+                // files grow block by block, so only the block after the last one may be missing
+                if (auto code = allocate_run(descriptor, 1).second; code != SUCCESS) {
+                    res = code;
+                    break;
+                }
+                disk_block = descriptor->block(k);
+            }
+            auto n = std::min(count - done, block_size - in_block);
+            auto block = _io->acquire(disk_block);
+            // block allocated ahead holds no file data yet, it may hold data of a destroyed file
+            if (k >= _layout.block_of(descriptor->length + block_size - 1)) {
+                std::fill(block.data().begin(), block.data().end(), std::byte{0});
+            } else if (block.failed() && n < block_size) {
+                // rest of the block is unknown, writing it back would lose it
+                res = FAIL;
+                break;
+            }
+            std::memcpy(block.data().data() + in_block, src.data() + done, n);
+            // directory is journaled by its disk blocks, which are held before they are released dirty
+            if (entry->get_descriptor_index() == 0) {
+                log_metadata(disk_block, in_block, n);
+            }
+            block.mark_dirty();
+            done += n;
+            descriptor->length = std::max(descriptor->length, offset + done);
+        }
+
+        if (descriptor->length != length || descriptor->blocks_no() != blocks_no) {
+            save_descriptor(entry->get_descriptor_index(), descriptor);
+        }
+        return {done, res};
+    }
+
+    // blocks a write up to `end` lacks are taken as one run where free space allows;
+    // errors are left to the write, which writes as much as fits
+    template <class Layout>
+    void basic_file_system<Layout>::reserve_blocks(oft_entry *entry, std::size_t end) {
+        auto descriptor = entry->get_descriptor();
+        if (end == 0 || _layout.block_of(end - 1) < descriptor->blocks_no()) {
+            return;
+        }
+
+        auto missing = _layout.block_of(end - 1) + 1 - descriptor->blocks_no();
+        bool allocated = false;
+        while (missing > 0) {
+            auto [blocks_no, res] = allocate_run(descriptor, missing);
+            if (res != SUCCESS) {
                 break;
-            } else if (!entry.value().filename.empty()) {
-                res.emplace_back(entry.value().filename, get_descriptor(std::to_integer<std::size_t>(entry.value().descriptor_index), true)->length);
+            }
+            missing -= blocks_no;
+            allocated = true;
+        }
+        if (allocated) {
+            save_descriptor(entry->get_descriptor_index(), descriptor);
+        }
+    }
+
+    // appends to the write-behind buffer of an entry; blocks for the data are promised at once,
+    // so lack of space is reported by the write rather than by the flush
+    template <class Layout>
+    auto basic_file_system<Layout>::write_behind(oft_entry *entry, std::span<const std::byte> src) -> std::pair<std::size_t, fs_result> {
+        auto descriptor = entry->get_descriptor();
+        const auto block_size = _layout.block_size();
+        auto &buffer = descriptor->write_behind;
+        auto start = descriptor->blocks_no() * block_size;
+
+        auto count = std::min(src.size(), max_file_blocks() * block_size - start - buffer.size());
+        auto res = count < src.size() ? TOO_BIG : SUCCESS;
+        auto promised = _layout.block_of(buffer.size() + block_size - 1);
+        if (auto needed = _layout.block_of(buffer.size() + count + block_size - 1) - promised; needed > 0) {
+            if (auto reserved = _bitmap.reserve(needed); reserved < needed) {
+                count = std::min(count, (promised + reserved) * block_size - buffer.size());
+                res = NO_BLOCK;
+            }
+        }
+        buffer.insert(buffer.end(), src.begin(), src.begin() + (std::ptrdiff_t) count);
+        entry->current_pos += count;
+
+        if (buffer.size() >= constraints::write_behind_blocks * block_size) {
+            auto pos = entry->current_pos;
+            if (auto flush_res = flush_write_behind(entry); flush_res != SUCCESS) {
+                return {count - std::min(count, pos - entry->current_pos), flush_res};
             }
         }
+        return {count, res};
+    }
+
+    // allocates blocks for the write-behind buffer of an entry as one run where free space allows
+    // and writes them past the cache; data blocks couldn't be found for is lost
+    template <class Layout>
+    auto basic_file_system<Layout>::flush_write_behind(oft_entry *entry) -> fs_result {
+        auto descriptor = entry->get_descriptor();
+        auto &buffer = descriptor->write_behind;
+        if (buffer.empty()) {
+            return SUCCESS;
+        }
+        journal::operation op{_journal.get()};
+
+        const auto block_size = _layout.block_size();
+        const auto first = descriptor->blocks_no();
+        const auto blocks_no = _layout.block_of(buffer.size() + block_size - 1);
+
+        // promised blocks are reserved already; those left unused are given back
+        auto res = SUCCESS;
+        while (descriptor->blocks_no() < first + blocks_no) {
+            if (auto code = allocate_run(descriptor, first + blocks_no - descriptor->blocks_no(), true).second; code != SUCCESS) {
+                res = code;
+                break;
+            }
+        }
+        _bitmap.unreserve(first + blocks_no - descriptor->blocks_no());
+
+        // last block is padded with zeros; file ends before the first run the device failed to write
+        auto allocated = descriptor->blocks_no() - first;
+        auto written = std::min(buffer.size(), allocated * block_size);
+        buffer.resize(allocated * block_size, std::byte{0});
+        for (std::size_t k = 0; k < allocated;) {
+            auto start = descriptor->block(first + k);
+            std::size_t length = 1;
+            while (k + length < allocated && descriptor->block(first + k + length) == start + length) {
+                length++;
+            }
+            if (!_io->write_direct(start, std::span{buffer}.subspan(k * block_size, length * block_size))) {
+                written = std::min(written, k * block_size);
+                res = FAIL;
+                break;
+            }
+            k += length;
+        }
+        buffer.clear();
+
+        descriptor->length = first * block_size + written;
+        save_descriptor(entry->get_descriptor_index(), descriptor);
+        if (res != SUCCESS) {
+            entry->current_pos = descriptor->length;
+        }
+        return res;
+    }
+
+    template <class Layout>
+    void basic_file_system<Layout>::drop_write_behind(file_descriptor *descriptor) {
+        _bitmap.unreserve(_layout.block_of(descriptor->write_behind.size() + _layout.block_size() - 1));
+        descriptor->write_behind.clear();
+    }
+
+    // length of a file including data waiting in write-behind buffer
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::file_length(std::size_t descriptor_index) {
+        auto descriptor = get_descriptor(descriptor_index);
+        std::shared_lock inode{descriptor->lock};
+        if (!descriptor->write_behind.empty()) {
+            return descriptor->blocks_no() * _layout.block_size() + descriptor->write_behind.size();
+        }
+        return descriptor->length;
+    }
+
+    // buffers are filled one after another from the current position; stops at the end of file
+    template <class Layout>
+    std::pair<std::size_t, fs_result> basic_file_system<Layout>::readv(std::size_t i, const std::vector<io_vector> &buffers) {
+        journal::operation op{_journal.get()};
+
+        auto [entry, handle] = lock_entry(i);
+        if (!entry) {
+            return {0, NOT_FOUND};
+        }
+        if (auto res = flush_entry(entry); res != SUCCESS) {
+            return {0, res};
+        }
+        std::shared_lock inode{entry->get_descriptor()->lock};
+
+        std::size_t total = 0;
+        for (auto &buffer : buffers) {
+            auto [bytes_read, res] = read_entry(entry, {std::to_address(buffer.data), buffer.count});
+            total += bytes_read;
+            if (res != SUCCESS || bytes_read < buffer.count) {
+                return {total, res};
+            }
+        }
+        return {total, SUCCESS};
+    }
+
+    // buffers are written one after another from the current position, blocks for all of them are taken
+    // as one run before the copy
+    template <class Layout>
+    std::pair<std::size_t, fs_result> basic_file_system<Layout>::writev(std::size_t i, const std::vector<io_vector> &buffers) {
+        journal::operation op{_journal.get()};
+
+        auto [entry, handle] = lock_entry(i);
+        if (!entry) {
+            return {0, NOT_FOUND};
+        }
+        if (is_read_only()) {
+            return {0, READ_ONLY};
+        }
+        std::unique_lock inode{entry->get_descriptor()->lock};
+
+        std::size_t total = 0;
+        for (auto &buffer : buffers) {
+            total += buffer.count;
+        }
+        // buffered entry writes the blocks through its pinned block rather than gathering the data
+        // in its write-behind buffer, so each block is filled once; the buffer is flushed first, so
+        // the run follows its blocks
+        const auto max_length = _layout.block_size() * max_file_blocks();
+        if (total > 0 && entry->current_pos < max_length) {
+            if (!entry->direct && !entry->get_descriptor()->write_behind.empty()) {
+                auto pos = entry->current_pos;
+                if (auto res = flush_write_behind(entry); res != SUCCESS) {
+                    return {0, res};
+                }
+                entry->current_pos = pos;
+            }
+            reserve_blocks(entry, std::min(entry->current_pos + total, max_length));
+        }
+
+        total = 0;
+        for (auto &buffer : buffers) {
+            if (buffer.count == 0) {
+                continue;
+            }
+            auto [written, res] = write_entry(entry, {std::to_address(buffer.data), buffer.count});
+            total += written;
+            if (res != SUCCESS) {
+                return {total, res};
+            }
+        }
+        return {total, SUCCESS};
+    }
+
+    template <class Layout>
+    auto basic_file_system<Layout>::read_batch(const std::vector<io_request> &requests) -> std::vector<std::pair<std::size_t, fs_result>> {
+        journal::operation op{_journal.get()};
+
+        return run_batch(requests, false);
+    }
+
+    template <class Layout>
+    auto basic_file_system<Layout>::write_batch(const std::vector<io_request> &requests) -> std::vector<std::pair<std::size_t, fs_result>> {
+        journal::operation op{_journal.get()};
+
+        if (is_read_only()) {
+            return {requests.size(), {0, READ_ONLY}};
+        }
+        return run_batch(requests, true);
+    }
+
+    // requests are served in order of file and offset, so every block is filled once for all requests
+    // touching it; overlapping writes land in that order too. Results keep the order of requests.
+    // Requests are positional, position of a handle is never moved. Handle is locked for one request
+    // at a time, so requests of other threads may come in between
+    template <class Layout>
+    auto basic_file_system<Layout>::run_batch(const std::vector<io_request> &requests, bool write) -> std::vector<std::pair<std::size_t, fs_result>> {
+        std::vector<std::pair<std::size_t, fs_result>> results(requests.size(), {0, NOT_FOUND});
+        std::vector<std::size_t> order(requests.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&requests](auto a, auto b) {
+            return std::pair{requests[a].handle, requests[a].offset} < std::pair{requests[b].handle, requests[b].offset};
+        });
+
+        for (auto k : order) {
+            auto &request = requests[k];
+            auto [entry, handle] = lock_entry(request.handle);
+            if (!entry) {
+                continue;
+            }
+
+            std::span<std::byte> buffer{std::to_address(request.data), request.count};
+            if (write) {
+                std::unique_lock inode{entry->get_descriptor()->lock};
+                auto res = flush_write_behind(entry);
+                results[k] = res == SUCCESS ? write_at(entry, request.offset, buffer) : std::pair{std::size_t{0}, res};
+            } else if (auto res = flush_entry(entry); res != SUCCESS) {
+                results[k] = {0, res};
+            } else {
+                std::shared_lock inode{entry->get_descriptor()->lock};
+                results[k] = read_at(entry, request.offset, buffer);
+            }
+        }
+        return results;
+    }
+
+    // handle leaves the table first, then threads which took it before are waited for; the last handle
+    // of a file writes back its write-behind buffer. Directory is locked, so the file isn't destroyed meanwhile
+    template <class Layout>
+    fs_result basic_file_system<Layout>::close(std::size_t i) {
+        journal::operation op{_journal.get()};
+
+        std::shared_lock dir{_dir_lock};
+        oft_entry *oft_entry;
+        bool last;
+        {
+            std::unique_lock table{_oft_lock};
+            if (i == 0 || !(oft_entry = _oft.detach(i))) {
+                return NOT_FOUND;
+            }
+            auto [first, end] = _open_files.equal_range(oft_entry->get_descriptor_index());
+            _open_files.erase(std::find_if(first, end, [i](auto &open) { return open.second == i; }));
+            last = --oft_entry->get_descriptor()->opens == 0;
+        }
+
+        std::unique_lock handle{oft_entry->lock};
+        fs_result res = SUCCESS;
+        if (last) {
+            std::unique_lock inode{oft_entry->get_descriptor()->lock};
+            res = flush_write_behind(oft_entry);
+        }
+        if (oft_entry->modified) {
+            save_block(oft_entry);
+        }
+        handle.unlock();
+
+        std::unique_lock table{_oft_lock};
+        _oft.release(i);
         return res;
     }
 
+    template <class Layout>
+    auto basic_file_system<Layout>::directory() -> std::vector<std::pair<std::string, std::size_t>> {
+        std::shared_lock dir{_dir_lock};
+        std::vector<std::pair<std::string, std::size_t>> res;
+        for (const auto &[filename, descriptor_index] : list_dir_entries()) {
+            res.emplace_back(filename, file_length(descriptor_index));
+        }
+        return res;
+    }
+
+    // handle 0 belongs to the directory and isn't given out; the handle stays locked
+    // for its caller after the table is released
+    template <class Layout>
+    auto basic_file_system<Layout>::lock_entry(std::size_t i) -> std::pair<oft_entry *, std::unique_lock<std::mutex>> {
+        std::shared_lock table{_oft_lock};
+        auto entry = i == 0 ? nullptr : _oft.find(i);
+        if (!entry) {
+            return {nullptr, std::unique_lock<std::mutex>{}};
+        }
+        return {entry, std::unique_lock{entry->lock}};
+    }
+
 }  //namespace lab_fs
@@ -1,23 +1,77 @@
 #pragma once
 
 #include <io.hpp>
+#include <bitmap.hpp>
+#include <block_cache.hpp>
+#include <executor.hpp>
+#include <handle_table.hpp>
+#include <journal.hpp>
 
 #include <vector>
-#include <array>
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <utility>
 #include <cstddef>
+#include <memory>
+#include <bit>
+#include <cassert>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 
 namespace lab_fs {
 
+    // INVALID_GEOMETRY: disk of such blocks can't be created, or doesn't match the image found
     enum init_result {
-        CREATED, RESTORED, FAILED
+        CREATED, RESTORED, FAILED, INVALID_GEOMETRY
+    };
+    // on-disk format: v1 keeps metadata in blocks 0 and 1 and addresses blocks with one byte,
+    // v2 describes its layout in a superblock and uses 32-bit block pointers
+    enum class format_version {
+        V1 = 1, V2 = 2
+    };
+    // on-disk layout of the directory file
+    enum class dir_format {
+        FLAT = 1, HASHED = 2
+    };
+    // on-disk layout of file descriptors: up to three direct block numbers or runs of blocks
+    enum class file_format {
+        DIRECT = 1, EXTENT = 2
+    };
+    // on-disk layout chosen when an image is created
+    struct layout {
+        dir_format directory = dir_format::FLAT;
+        file_format files = file_format::DIRECT;
+    };
+    // code serving an image: GENERIC takes block size and sizes of on-disk records from the image,
+    // SPECIALIZED has them as constants for v2 images of common block sizes and is GENERIC for others
+    enum class code_path {
+        SPECIALIZED, GENERIC
+    };
+    // direct files move whole aligned blocks between the device and the caller past the block cache,
+    // like O_DIRECT; partial blocks still go through the cache
+    enum class open_mode {
+        BUFFERED, DIRECT
+    };
+    // memory area of vectored and batched calls
+    struct io_vector {
+        std::vector<std::byte>::iterator data;
+        std::size_t count;
+    };
+    // positional request of a batch, served without moving position of the handle
+    struct io_request {
+        std::size_t handle;
+        std::size_t offset;
+        std::vector<std::byte>::iterator data;
+        std::size_t count;
     };
     enum fs_result {
-        SUCCESS, EXISTS, NO_SPACE, NOT_FOUND, TOO_BIG, INVALID_NAME, INVALID_POS, ALREADY_OPENED, FAIL, NO_BLOCK, OFT_FULL
+        SUCCESS, EXISTS, NO_SPACE, NOT_FOUND, TOO_BIG, INVALID_NAME, INVALID_POS, ALREADY_OPENED, FAIL, NO_BLOCK, OFT_FULL, READ_ONLY
     };
 
+    // calls may come from many threads; those on different files proceed in parallel,
+    // those on one handle are served one at a time
     class file_system {
     public:
         struct constraints {
@@ -25,85 +79,395 @@ namespace lab_fs {
             static constexpr std::size_t bytes_for_file_length = 2;
             static constexpr std::size_t max_blocks_per_file = 3;
             static constexpr std::size_t max_filename_length = 15;
-            static constexpr std::size_t oft_max_size = 16;
-            static constexpr std::size_t bytes_for_descriptor = bytes_for_file_length + max_blocks_per_file;          
-            
+            static constexpr std::size_t oft_max_size = 16; // default capacity of the open file table, directory included
+            static constexpr std::size_t cache_budget = 64 * 1024;
+            static constexpr std::size_t journal_min_area_blocks_no = 2;
+            static constexpr std::size_t journal_max_area_blocks_no = 255; // superblock keeps it in one byte
+            static constexpr std::size_t journal_spare_blocks_no = 4; // descriptor, indirect and directory blocks of an operation
+            static constexpr std::size_t journal_max_disk_share = 16; // journal takes at most 1/16 of the disk
+            static constexpr std::size_t journal_min_blocks_no = 16;
+            static constexpr std::size_t journal_min_block_size = 128;
+            static constexpr std::chrono::milliseconds journal_commit_interval{1000};
+            static constexpr std::size_t max_dir_depth = 20;
+            static constexpr std::size_t bytes_for_descriptor = bytes_for_file_length + max_blocks_per_file;
+            static constexpr std::size_t bytes_for_extent_descriptor = 12;
+            static constexpr std::size_t inline_extents_no = 3;
+            static constexpr std::size_t max_extent_length = 255;
+            static constexpr std::size_t extent_min_block_size = 64;
+            static constexpr std::size_t max_descriptors_no = 256; // v1 directory entries keep one-byte descriptor index
+            static constexpr std::size_t v2_descriptor_size = 32;
+            static constexpr std::size_t v2_dir_entry_size = 20;
+            static constexpr std::size_t v2_pointer_size = 4;
+            static constexpr std::size_t v2_min_block_size = 32;
+            static constexpr std::size_t max_block_size = 32 * 1024; // journal records keep 2-byte offsets and lengths
+            static constexpr std::size_t min_readahead_blocks = 2;
+            static constexpr std::size_t max_readahead_blocks = 32;
+            static constexpr std::size_t write_behind_blocks = 8;
+
             constraints() = delete;
         };
-        const std::size_t max_files_quantity = constraints::max_blocks_per_file * _io.get_block_size() / (constraints::max_filename_length + 1);
 
+        virtual ~file_system() = default;
+
+        static std::pair<file_system *, init_result> init(std::size_t cylinders_no,
+                                                          std::size_t surfaces_no,
+                                                          std::size_t sections_no,
+                                                          std::size_t section_length,
+                                                          const std::string &filename,
+                                                          io_engine engine = io_engine::MMAP,
+                                                          std::size_t cache_budget = constraints::cache_budget,
+                                                          layout format = {},
+                                                          volume_geometry volume = {},
+                                                          std::size_t oft_capacity = constraints::oft_max_size,
+                                                          code_path code = code_path::SPECIALIZED);
+
+        [[nodiscard]] virtual std::size_t max_files_quantity() const = 0;
+        [[nodiscard]] virtual dir_format get_dir_format() const = 0;
+        [[nodiscard]] virtual file_format get_file_format() const = 0;
+        [[nodiscard]] virtual format_version get_version() const = 0;
+        [[nodiscard]] virtual bool is_read_only() const = 0;
+
+        // converts flat directory to hashed format in place
+        virtual auto migrate_directory() -> fs_result = 0;
+        [[nodiscard]] virtual auto cache_stats() const -> const block_cache::stats & = 0;
+
+        virtual flush_stats save(const std::string &filename) = 0;
+        virtual flush_stats save() = 0;
+
+        virtual auto lseek(std::size_t i, std::size_t pos) -> fs_result = 0;
+        virtual auto create(const std::string& filename) -> fs_result = 0;
+        virtual auto open(const std::string& filename, open_mode mode = open_mode::BUFFERED) -> std::pair<std::size_t, fs_result> = 0;
+        virtual auto destroy(const std::string& filename) -> fs_result = 0;
+        virtual auto write(std::size_t i, std::vector<std::byte>::iterator mem_area, std::size_t count) -> std::pair<size_t, fs_result> = 0;
+        virtual auto write(std::size_t i, std::span<const std::byte> src) -> std::pair<size_t, fs_result> = 0;
+        virtual auto read(std::size_t i, std::vector<std::byte>::iterator mem_area, std::size_t count) -> std::pair<std::size_t, fs_result> = 0;
+        virtual auto read(std::size_t i, std::span<std::byte> dest) -> std::pair<std::size_t, fs_result> = 0;
+        // positional calls leave position of the handle as it was
+        virtual auto pread(std::size_t i, std::size_t offset, std::span<std::byte> dest) -> std::pair<std::size_t, fs_result> = 0;
+        virtual auto pwrite(std::size_t i, std::size_t offset, std::span<const std::byte> src) -> std::pair<std::size_t, fs_result> = 0;
+        virtual auto readv(std::size_t i, const std::vector<io_vector> &buffers) -> std::pair<std::size_t, fs_result> = 0;
+        virtual auto writev(std::size_t i, const std::vector<io_vector> &buffers) -> std::pair<std::size_t, fs_result> = 0;
+        virtual auto read_batch(const std::vector<io_request> &requests) -> std::vector<std::pair<std::size_t, fs_result>> = 0;
+        virtual auto write_batch(const std::vector<io_request> &requests) -> std::vector<std::pair<std::size_t, fs_result>> = 0;
+        virtual auto close(std::size_t i) -> fs_result = 0;
+        virtual auto directory() -> std::vector<std::pair<std::string, std::size_t>> = 0;
+
+        // awaitable calls complete inline when they find their blocks in memory or no executor is attached;
+        // otherwise the awaiting coroutine is suspended and resumed in a thread of the executor. Reads and writes
+        // of buffered handles load missing blocks in the background first, so they hold no thread while they wait
+        virtual void attach(executor *ex) = 0;
+        virtual auto async_open(const std::string &filename, open_mode mode = open_mode::BUFFERED) -> async_call<std::pair<std::size_t, fs_result>> = 0;
+        virtual auto async_read(std::size_t i, std::span<std::byte> dest) -> async_call<std::pair<std::size_t, fs_result>> = 0;
+        virtual auto async_write(std::size_t i, std::span<const std::byte> src) -> async_call<std::pair<std::size_t, fs_result>> = 0;
+        virtual auto async_close(std::size_t i) -> async_call<fs_result> = 0;
+    };
+
+    // block size and sizes of descriptors, directory entries and block pointers as they are read from the image;
+    // offsets in files are divisions unless blocks are a power of 2
+    class runtime_layout {
+    public:
+        runtime_layout() = default;
+
+        runtime_layout(std::size_t block_size, std::size_t descriptor_size, std::size_t dir_entry_size, std::size_t pointer_size) :
+                _block_size{block_size},
+                _block_shift{(std::size_t) std::countr_zero(block_size)},
+                _block_mask{std::has_single_bit(block_size) ? block_size - 1 : 0},
+                _descriptor_size{descriptor_size},
+                _dir_entry_size{dir_entry_size},
+                _pointer_size{pointer_size} {}
+
+        [[nodiscard]] std::size_t block_size() const {
+            return _block_size;
+        }
+
+        [[nodiscard]] std::size_t block_of(std::size_t pos) const {
+            return _block_mask ? pos >> _block_shift : pos / _block_size;
+        }
+
+        [[nodiscard]] std::size_t offset_in_block(std::size_t pos) const {
+            return _block_mask ? pos & _block_mask : pos % _block_size;
+        }
+
+        [[nodiscard]] std::size_t descriptor_size() const {
+            return _descriptor_size;
+        }
+
+        [[nodiscard]] std::size_t dir_entry_size() const {
+            return _dir_entry_size;
+        }
+
+        [[nodiscard]] std::size_t pointer_size() const {
+            return _pointer_size;
+        }
+
+    private:
+        std::size_t _block_size = 0;
+        std::size_t _block_shift = 0;
+        std::size_t _block_mask = 0; // 0 if block size is not a power of 2
+        std::size_t _descriptor_size = 0;
+        std::size_t _dir_entry_size = 0;
+        std::size_t _pointer_size = 0;
+    };
+
+    // shapes of v2 images with blocks of BlockSize bytes; being constants, offsets in files compile
+    // to shifts and masks and copies of whole blocks to fixed-length moves
+    template <std::size_t BlockSize>
+    class fixed_layout {
+        static_assert(std::has_single_bit(BlockSize) && BlockSize >= file_system::constraints::v2_min_block_size &&
+                      BlockSize <= file_system::constraints::max_block_size);
+    public:
+        fixed_layout() = default;
+
+        fixed_layout([[maybe_unused]] std::size_t block_size, [[maybe_unused]] std::size_t descriptor_size,
+                     [[maybe_unused]] std::size_t dir_entry_size, [[maybe_unused]] std::size_t pointer_size) {
+            assert(block_size == BlockSize && descriptor_size == this->descriptor_size() &&
+                   dir_entry_size == this->dir_entry_size() && pointer_size == this->pointer_size() &&
+                   "image doesn't have the layout the code is built for");
+        }
+
+        static constexpr std::size_t block_size() {
+            return BlockSize;
+        }
+
+        static constexpr std::size_t block_of(std::size_t pos) {
+            return pos / BlockSize;
+        }
+
+        static constexpr std::size_t offset_in_block(std::size_t pos) {
+            return pos % BlockSize;
+        }
+
+        static constexpr std::size_t descriptor_size() {
+            return file_system::constraints::v2_descriptor_size;
+        }
+
+        static constexpr std::size_t dir_entry_size() {
+            return file_system::constraints::v2_dir_entry_size;
+        }
+
+        static constexpr std::size_t pointer_size() {
+            return file_system::constraints::v2_pointer_size;
+        }
+    };
+
+    // file system over one image; Layout gives block size and sizes of descriptors, directory entries
+    // and block pointers of the image, either read from it (runtime_layout) or fixed at compile time
+    template <class Layout>
+    class basic_file_system final : public file_system {
     private:
+        // run of consecutive disk blocks
+        struct extent {
+            std::size_t start;
+            std::size_t length;
+        };
+
+        // in-memory inode: file blocks are kept as extents whatever format they are stored in;
+        // every handle of the file shares it
         class file_descriptor {
         public:
-            file_descriptor(std::size_t length,
-                            const std::array<std::size_t, constraints::max_blocks_per_file> &occupied_blocks);
-            bool is_initialized() const;
+            explicit file_descriptor(std::size_t length, std::vector<extent> extents = {}, std::size_t indirect = 0);
+
+            [[nodiscard]] std::size_t blocks_no() const;
+            // disk block holding i-th block of the file, 0 if it is not allocated
+            [[nodiscard]] std::size_t block(std::size_t i) const;
+            void append(std::size_t block, std::size_t max_extent_length);
 
             std::size_t length;
-            std::array<std::size_t, constraints::max_blocks_per_file> occupied_blocks;
+            std::vector<extent> extents;
+            std::size_t indirect; // block with extents which don't fit into descriptor, 0 if none
+            bool extent_form = false; // kept as extents on disk although files of the image are direct ones
+            // data appended past the allocated blocks of the file by any of its handles; blocks for it
+            // are allocated as one run when it is flushed, at the latest by the last close
+            std::vector<std::byte> write_behind;
+            std::size_t opens = 0; // handles of the file, changed under _oft_lock
+            std::shared_mutex lock; // shared by readers of the file, exclusive for writers
+        };
+
+        // sequential stream detection of an open file
+        struct readahead_state {
+            std::size_t next = 0;   // file block a sequential stream reads next
+            std::size_t window = 0; // blocks kept ahead of the stream, 0 if access is not sequential
+            std::size_t end = 0;    // file blocks before it are already read ahead
         };
 
+        // position, pinned block and readahead state of one handle; a file may have many handles
         class oft_entry {
         public:
-            oft_entry(std::string filename, std::size_t descriptor_index);
+            oft_entry(std::string filename, std::size_t descriptor_index, file_descriptor *descriptor, open_mode mode);
 
             [[nodiscard]] std::size_t get_descriptor_index() const;
 
+            [[nodiscard]] file_descriptor *get_descriptor() const;
+
             [[nodiscard]] std::string get_filename() const;
 
-            std::vector<std::byte> buffer;
+            block_handle block;
             std::size_t current_pos;
             std::size_t current_block;
             bool modified;
             bool initialized;
+            bool direct;
+            readahead_state readahead;
+            std::mutex lock; // held by the thread using the handle
         private:
             std::size_t _descriptor_index;
+            file_descriptor *_descriptor;
             std::string _filename;
         };
 
         std::string _filename;
-        io _io;
-        std::vector<bool> _bitmap;
-        std::vector<oft_entry *> _oft;
+        std::unique_ptr<block_cache> _io;
+        std::unique_ptr<journal> _journal;
+        block_bitmap _bitmap;
+        handle_table<oft_entry> _oft;
+        oft_entry *_dir_entry = nullptr; // handle 0, it is never detached, so it is reached without the table lock
+        std::unordered_multimap<std::size_t, std::size_t> _open_files; // (index of desc) -> (handles of the file)
         std::map<std::size_t, file_descriptor *> _descriptors_cache; // (index of desc) -> (file desc)
-        std::map<std::string, std::size_t> _descriptor_indexes_cache; // (_filename) -> (index of desc)
 
-        auto get_descriptor(std::size_t index, bool disable_caching = false) -> file_descriptor *;
+        // locks are taken in this order, each after a journal operation is entered:
+        // directory, open file table, handle, file descriptor, descriptor table; _bitmap needs none
+        std::shared_mutex _dir_lock;  // directory index, bucket table and directory handle
+        std::shared_mutex _oft_lock;  // _oft and _open_files; a handle is locked before the table is released
+        std::mutex _table_lock;       // _descriptors_cache and descriptor table blocks
+
+        executor *_executor = nullptr; // runs awaitable calls which may wait for the device
+
+        struct dir_slot {
+            std::size_t slot;
+            std::size_t descriptor_index;
+        };
+        dir_format _dir_format = dir_format::FLAT;
+        file_format _file_format = file_format::DIRECT;
+
+        // v1 images are mounted read-only
+        format_version _version = format_version::V2;
+        std::size_t _bitmap_start = 0;
+        std::size_t _descriptors_start = 1;
+        std::size_t _descriptors_no = 0;
+        std::size_t _free_descriptor_hint = 0; // no descriptor below it is free, changed under _table_lock
+
+        // flat directory is mirrored in memory at mount, so lookups never read it from disk
+        std::unordered_map<std::string, dir_slot> _dir_index; // (filename) -> (slot in directory, index of desc)
+        std::vector<std::string> _dir_slots; // (slot in directory) -> (filename), empty for free slot
+        std::vector<std::size_t> _free_dir_slots;
+
+        // hashed directory keeps only its bucket table in memory
+        std::vector<std::size_t> _dir_table; // (low hash bits) -> (bucket block within directory)
+        std::size_t _dir_depth = 0;
+
+        Layout _layout;
+
+        [[nodiscard]] std::size_t descriptor_size() const;
+        [[nodiscard]] std::size_t descriptors_no() const;
+        [[nodiscard]] std::size_t max_file_blocks() const;
+        [[nodiscard]] bool keeps_extents(const file_descriptor *descriptor) const;
+        [[nodiscard]] std::size_t max_blocks_of(const file_descriptor *descriptor) const;
+        [[nodiscard]] std::size_t max_extents_no() const;
+        [[nodiscard]] std::size_t pointer_size() const;
+        [[nodiscard]] std::size_t max_extent_length() const;
+        [[nodiscard]] std::size_t inline_extents_no() const;
+        [[nodiscard]] std::size_t dir_entry_size() const;
+        [[nodiscard]] auto descriptor_location(std::size_t index) const -> std::pair<std::size_t, std::size_t>;
+        auto get_descriptor(std::size_t index) -> file_descriptor *;
+        auto decode_descriptor(std::span<const std::byte> data) -> file_descriptor *;
         auto save_descriptor(std::size_t index, file_descriptor *descriptor) -> bool;
         auto take_descriptor() -> int;
+        void release_descriptor(std::size_t index);
 
+        void load_directory();
+        void load_dir_buckets();
         auto get_descriptor_index_from_dir_entry(const std::string& filename) -> int;
-        auto take_dir_entry(const std::string& filename) -> std::pair<std::size_t, fs_result>;
+        auto insert_dir_entry(const std::string &filename, std::size_t descriptor_index) -> fs_result;
+        auto remove_dir_entry(const std::string& filename) -> fs_result;
+        auto list_dir_entries() -> std::vector<std::pair<std::string, std::size_t>>;
+
+        auto take_dir_entry() -> std::pair<std::size_t, fs_result>;
+        void index_dir_entry(std::size_t i, const std::string &filename, std::size_t descriptor_index);
         auto save_dir_entry(std::size_t i, std::string filename, std::size_t descriptor_index) -> bool;
-        auto overwrite_dir_entry(const std::string& filename) -> fs_result;
-        auto allocate_block(file_descriptor *descriptor, std::size_t block_index) -> bool;
+
+        [[nodiscard]] std::size_t dir_blocks_no() const;
+        [[nodiscard]] std::size_t dir_block(std::size_t k) const;
+        auto add_dir_block() -> std::pair<std::size_t, fs_result>;
+        auto find_hashed_entry(const std::string &filename) -> std::optional<dir_slot>;
+        auto insert_hashed_entry(const std::string &filename, std::size_t descriptor_index) -> fs_result;
+        auto split_dir_bucket(std::size_t k) -> fs_result;
+        auto remove_hashed_entry(const std::string &filename) -> fs_result;
+
+        auto allocate_run(file_descriptor *descriptor, std::size_t n, bool reserved = false) -> std::pair<std::size_t, fs_result>;
+        void free_blocks(file_descriptor *descriptor);
+        void set_block_state(std::size_t block, bool occupied);
+        [[nodiscard]] std::size_t free_blocks_no() const;
+        void log_metadata(std::size_t block, std::size_t offset, std::size_t length);
+
+        auto lock_entry(std::size_t i) -> std::pair<oft_entry *, std::unique_lock<std::mutex>>;
+        auto seek_entry(oft_entry *entry, std::size_t pos) -> fs_result;
+        auto flush_entry(oft_entry *entry) -> fs_result;
+        auto read_entry(oft_entry *entry, std::span<std::byte> dest) -> std::pair<std::size_t, fs_result>;
+        auto write_entry(oft_entry *entry, std::span<const std::byte> src) -> std::pair<std::size_t, fs_result>;
+        auto read_buffered(oft_entry *entry, std::span<std::byte> dest) -> std::pair<std::size_t, fs_result>;
+        auto write_buffered(oft_entry *entry, std::span<const std::byte> src) -> std::pair<std::size_t, fs_result>;
+        void read_ahead(oft_entry *entry, std::size_t block);
+        auto direct_run(oft_entry *entry, std::size_t first, std::size_t blocks_no) -> std::pair<std::size_t, std::size_t>;
+        auto read_direct(oft_entry *entry, std::span<std::byte> dest) -> std::pair<std::size_t, fs_result>;
+        auto write_direct(oft_entry *entry, std::span<const std::byte> src) -> std::pair<std::size_t, fs_result>;
+        auto read_at(oft_entry *entry, std::size_t offset, std::span<std::byte> dest) -> std::pair<std::size_t, fs_result>;
+        auto write_at(oft_entry *entry, std::size_t offset, std::span<const std::byte> src) -> std::pair<std::size_t, fs_result>;
+        void reserve_blocks(oft_entry *entry, std::size_t end);
+        auto write_behind(oft_entry *entry, std::span<const std::byte> src) -> std::pair<std::size_t, fs_result>;
+        auto flush_write_behind(oft_entry *entry) -> fs_result;
+        void drop_write_behind(file_descriptor *descriptor);
+        [[nodiscard]] std::size_t file_length(std::size_t descriptor_index);
+        auto run_batch(const std::vector<io_request> &requests, bool write) -> std::vector<std::pair<std::size_t, fs_result>>;
+        auto missing_blocks(std::size_t i, std::size_t count) -> std::optional<std::vector<std::size_t>>;
+        auto fetch(std::vector<std::size_t> blocks) -> std::function<void(std::function<void()>)>;
 
         auto initialize_oft_entry(oft_entry* entry, std::size_t block) -> fs_result;
-        auto initialize_file_descriptor(file_descriptor* descriptor, std::size_t block) -> fs_result;
-        void save_block(oft_entry* entry, std::size_t block);
+        void acquire_empty_block(oft_entry* entry, std::size_t block);
+        void save_block(oft_entry* entry);
 
 
     public:
-        file_system(std::string filename, io &&disk_io);
+        basic_file_system(std::string filename, std::unique_ptr<io> disk_io, std::size_t cache_budget, std::size_t oft_capacity);
+        ~basic_file_system() override;
 
-        static std::pair<file_system *, init_result> init(std::size_t cylinders_no,
-                                                          std::size_t surfaces_no,
-                                                          std::size_t sections_no,
-                                                          std::size_t section_length,
-                                                          const std::string &filename);
-
-        void save(const std::string &filename);
-        void save();
-
-        auto lseek(std::size_t i, std::size_t pos) -> fs_result;
-        auto create(const std::string& filename) -> fs_result;
-        auto open(const std::string& filename) -> std::pair<std::size_t, fs_result>;
-        auto destroy(const std::string& filename) -> fs_result;
-        auto write(std::size_t i, std::vector<std::byte>::iterator mem_area, std::size_t count) -> std::pair<size_t, fs_result>;
-        auto read(std::size_t i, std::vector<std::byte>::iterator mem_area, std::size_t count) -> std::pair<std::size_t, fs_result>;
-        auto close(std::size_t i) -> fs_result;
-        auto directory() -> std::vector<std::pair<std::string, std::size_t>>;
-        
+        [[nodiscard]] std::size_t max_files_quantity() const override;
+        [[nodiscard]] dir_format get_dir_format() const override;
+        [[nodiscard]] file_format get_file_format() const override;
+        [[nodiscard]] format_version get_version() const override;
+        [[nodiscard]] bool is_read_only() const override;
+
+        // converts flat directory to hashed format in place
+        auto migrate_directory() -> fs_result override;
+        [[nodiscard]] auto cache_stats() const -> const block_cache::stats & override;
+
+        flush_stats save(const std::string &filename) override;
+        flush_stats save() override;
+
+        auto lseek(std::size_t i, std::size_t pos) -> fs_result override;
+        auto create(const std::string& filename) -> fs_result override;
+        auto open(const std::string& filename, open_mode mode) -> std::pair<std::size_t, fs_result> override;
+        auto destroy(const std::string& filename) -> fs_result override;
+        auto write(std::size_t i, std::vector<std::byte>::iterator mem_area, std::size_t count) -> std::pair<size_t, fs_result> override;
+        auto write(std::size_t i, std::span<const std::byte> src) -> std::pair<size_t, fs_result> override;
+        auto read(std::size_t i, std::vector<std::byte>::iterator mem_area, std::size_t count) -> std::pair<std::size_t, fs_result> override;
+        auto read(std::size_t i, std::span<std::byte> dest) -> std::pair<std::size_t, fs_result> override;
+        // positional calls leave position of the handle as it was
+        auto pread(std::size_t i, std::size_t offset, std::span<std::byte> dest) -> std::pair<std::size_t, fs_result> override;
+        auto pwrite(std::size_t i, std::size_t offset, std::span<const std::byte> src) -> std::pair<std::size_t, fs_result> override;
+        auto readv(std::size_t i, const std::vector<io_vector> &buffers) -> std::pair<std::size_t, fs_result> override;
+        auto writev(std::size_t i, const std::vector<io_vector> &buffers) -> std::pair<std::size_t, fs_result> override;
+        auto read_batch(const std::vector<io_request> &requests) -> std::vector<std::pair<std::size_t, fs_result>> override;
+        auto write_batch(const std::vector<io_request> &requests) -> std::vector<std::pair<std::size_t, fs_result>> override;
+        auto close(std::size_t i) -> fs_result override;
+        auto directory() -> std::vector<std::pair<std::string, std::size_t>> override;
+
+        // awaitable calls complete inline when they find their blocks in memory or no executor is attached;
+        // otherwise the awaiting coroutine is suspended and resumed in a thread of the executor
+        void attach(executor *ex) override;
+        auto async_open(const std::string &filename, open_mode mode) -> async_call<std::pair<std::size_t, fs_result>> override;
+        auto async_read(std::size_t i, std::span<std::byte> dest) -> async_call<std::pair<std::size_t, fs_result>> override;
+        auto async_write(std::size_t i, std::span<const std::byte> src) -> async_call<std::pair<std::size_t, fs_result>> override;
+        auto async_close(std::size_t i) -> async_call<fs_result> override;
     };
 
 } //namespace lab_fs
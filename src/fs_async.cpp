@@ -0,0 +1,97 @@
+#include "fs.hpp"
+
+#include <string>
+
+namespace lab_fs {
+    template <class Layout>
+    void basic_file_system<Layout>::attach(executor *ex) {
+        _executor = ex;
+    }
+
+    // blocks a call moving `count` bytes at the current position of handle i would load; the call won't wait
+    // for the device once they are cached. Nullopt if loading blocks is not enough: direct entries move whole
+    // blocks past the cache, write-behind data is flushed by reads, and half the cache would evict blocks of
+    // the call before it runs. It is a hint only, as blocks may be evicted before the call
+    template <class Layout>
+    auto basic_file_system<Layout>::missing_blocks(std::size_t i, std::size_t count) -> std::optional<std::vector<std::size_t>> {
+        std::vector<std::size_t> missing;
+        if (_io->is_in_memory()) {
+            return missing;
+        }
+        auto [entry, handle] = lock_entry(i);
+        if (!entry || count == 0) {
+            return missing;
+        }
+        if (entry->direct) {
+            return std::nullopt;
+        }
+        auto descriptor = entry->get_descriptor();
+        std::shared_lock inode{descriptor->lock};
+        if (!descriptor->write_behind.empty()) {
+            return std::nullopt;
+        }
+
+        auto end = std::min(_layout.block_of(entry->current_pos + count - 1) + 1, descriptor->blocks_no());
+        for (auto k = _layout.block_of(entry->current_pos); k < end; k++) {
+            if (!_io->contains(descriptor->block(k))) {
+                missing.push_back(descriptor->block(k));
+            }
+        }
+        if (missing.size() > _io->capacity() / 2) {
+            return std::nullopt;
+        }
+        return missing;
+    }
+
+    // lookup reads directory blocks, so only in-memory devices open inline
+    template <class Layout>
+    auto basic_file_system<Layout>::async_open(const std::string &filename, open_mode mode) -> async_call<std::pair<std::size_t, fs_result>> {
+        if (!_executor || _io->is_in_memory()) {
+            return async_call{open(filename, mode)};
+        }
+        return {*_executor, [this, filename, mode] { return open(filename, mode); }};
+    }
+
+    // blocks are fetched by the cache, and the call is run in a thread of the executor once they are loaded
+    template <class Layout>
+    auto basic_file_system<Layout>::async_read(std::size_t i, std::span<std::byte> dest) -> async_call<std::pair<std::size_t, fs_result>> {
+        auto missing = _executor ? missing_blocks(i, dest.size()) : std::vector<std::size_t>{};
+        if (missing && missing->empty()) {
+            return async_call{read(i, dest)};
+        }
+        if (!missing) {
+            return {*_executor, [this, i, dest] { return read(i, dest); }};
+        }
+        return {*_executor, fetch(std::move(*missing)), [this, i, dest] { return read(i, dest); }};
+    }
+
+    // blocks past the end of file are allocated by the write, so only those it overwrites are fetched
+    template <class Layout>
+    auto basic_file_system<Layout>::async_write(std::size_t i, std::span<const std::byte> src) -> async_call<std::pair<std::size_t, fs_result>> {
+        auto missing = _executor ? missing_blocks(i, src.size()) : std::vector<std::size_t>{};
+        if (missing && missing->empty()) {
+            return async_call{write(i, src)};
+        }
+        if (!missing) {
+            return {*_executor, [this, i, src] { return write(i, src); }};
+        }
+        return {*_executor, fetch(std::move(*missing)), [this, i, src] { return write(i, src); }};
+    }
+
+    template <class Layout>
+    auto basic_file_system<Layout>::fetch(std::vector<std::size_t> blocks) -> std::function<void(std::function<void()>)> {
+        return [this, blocks = std::move(blocks)](std::function<void()> done) mutable {
+            _io->fetch(std::move(blocks), std::move(done));
+        };
+    }
+
+    // closing flushes the write-behind buffer and the handle block
+    template <class Layout>
+    auto basic_file_system<Layout>::async_close(std::size_t i) -> async_call<fs_result> {
+        if (!_executor || _io->is_in_memory()) {
+            return async_call{close(i)};
+        }
+        return {*_executor, [this, i] { return close(i); }};
+    }
+
+}  //namespace lab_fs
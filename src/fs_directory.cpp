@@ -0,0 +1,515 @@
+#include "fs.hpp"
+
+#include <algorithm>
+#include <optional>
+
+namespace lab_fs {
+    namespace utils {
+        // v1 entry: {name (15 bytes), descriptor index (1 byte)}; v2 entry: {name (16 bytes), descriptor index (4 bytes)}
+        class dir_entry {
+        public:
+            static constexpr std::size_t name_size(format_version version) {
+                return file_system::constraints::max_filename_length + (version == format_version::V1 ? 0 : 1);
+            }
+
+            static constexpr std::size_t size(format_version version) {
+                return name_size(version) + (version == format_version::V1 ? 1 : 4);
+            }
+
+        public:
+            dir_entry(const dir_entry &d) = default;
+
+            dir_entry(std::string filename, std::size_t descriptor_index) :
+                    filename{std::move(filename)},
+                    descriptor_index{descriptor_index} {}
+
+            dir_entry(std::span<const std::byte> container, format_version version) {
+                filename = "";
+                for (std::size_t i = 0; i < file_system::constraints::max_filename_length; i++) {
+                    if (container[i] == std::byte{0}) {
+                        break;
+                    }
+                    filename.push_back(char(container[i]));
+                }
+                descriptor_index = load_le(container, name_size(version), size(version) - name_size(version));
+            }
+
+            std::vector<std::byte> convert(format_version version) {
+                std::vector<std::byte> container(size(version), std::byte{0});
+                for (unsigned i = 0; i < filename.size(); i++) {
+                    container[i] = std::byte{(std::uint8_t) filename[i]};
+                }
+                store_le(container, name_size(version), size(version) - name_size(version), descriptor_index);
+                return container;
+            }
+
+        public:
+            std::string filename;
+            std::size_t descriptor_index;
+        };
+
+        static_assert(dir_entry::size(format_version::V2) == file_system::constraints::v2_dir_entry_size);
+
+        // hashed directory is a sequence of bucket blocks; the first entry slot of every bucket
+        // is its header {0, 'H', format version, local depth, hash bits (4 bytes)}, so it can't be
+        // mistaken for a flat directory entry, whose name never starts with 0
+        struct bucket_header {
+            static constexpr std::byte marker{'H'};
+
+            static bool is_bucket(std::span<const std::byte> block) {
+                return block[0] == std::byte{0} && block[1] == marker;
+            }
+
+            static void write(std::span<std::byte> block, std::size_t entry_size, std::size_t depth, std::size_t bits) {
+                std::fill(block.begin(), block.begin() + (std::ptrdiff_t) entry_size, std::byte{0});
+                block[1] = marker;
+                block[2] = std::byte{(std::uint8_t) dir_format::HASHED};
+                block[3] = std::byte{(std::uint8_t) depth};
+                store_le(block, 4, 4, bits);
+            }
+
+            static std::size_t depth(std::span<const std::byte> block) {
+                return std::to_integer<std::size_t>(block[3]);
+            }
+
+            static std::size_t bits(std::span<const std::byte> block) {
+                return load_le(block, 4, 4);
+            }
+        };
+
+        // FNV-1a; stored layout depends on it, so it must not change between builds
+        inline std::uint32_t dir_hash(const std::string &filename) {
+            std::uint32_t hash = 2166136261u;
+            for (char c : filename) {
+                hash = (hash ^ (std::uint8_t) c) * 16777619u;
+            }
+            return hash;
+        }
+
+        // buckets needed to store entries with these hashes; buckets only split on overflow and never merge,
+        // so the result doesn't depend on insertion order. Returns nullopt if depth limit is reached
+        inline std::optional<std::size_t> buckets_needed(const std::vector<std::uint32_t> &hashes, std::size_t depth,
+                                                         std::size_t bucket_capacity) {
+            if (hashes.size() <= bucket_capacity) {
+                return 1;
+            }
+            if (depth == file_system::constraints::max_dir_depth) {
+                return std::nullopt;
+            }
+
+            std::vector<std::uint32_t> halves[2];
+            for (auto hash : hashes) {
+                halves[(hash >> depth) & 1].push_back(hash);
+            }
+            auto low = buckets_needed(halves[0], depth + 1, bucket_capacity);
+            auto high = buckets_needed(halves[1], depth + 1, bucket_capacity);
+            if (!low || !high) {
+                return std::nullopt;
+            }
+            return *low + *high;
+        }
+    }  // namespace utils
+
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::dir_entry_size() const {
+        return _layout.dir_entry_size();
+    }
+
+    // detects directory format and builds its in-memory part: full name index for flat directory,
+    // bucket table only for hashed one
+    template <class Layout>
+    void basic_file_system<Layout>::load_directory() {
+        auto dir_descriptor = _dir_entry->get_descriptor();
+        if (dir_descriptor->length > 0 && utils::bucket_header::is_bucket(_io->acquire(dir_descriptor->block(0)).data())) {
+            _dir_format = dir_format::HASHED;
+            load_dir_buckets();
+            return;
+        }
+
+        auto length = dir_descriptor->length;
+        std::vector<std::byte> data(length);
+        if (length > 0 && read_at(_dir_entry, 0, data).first != length) {
+            return;
+        }
+
+        const auto entry_size = dir_entry_size();
+        _dir_slots.resize(length / entry_size);
+        for (std::size_t i = 0; i < _dir_slots.size(); i++) {
+            utils::dir_entry entry{std::span{data}.subspan(i * entry_size, entry_size), _version};
+            if (!entry.filename.empty()) {
+                _dir_slots[i] = entry.filename;
+                _dir_index[entry.filename] = {i, entry.descriptor_index};
+            }
+        }
+
+        // lowest free slot is reused first
+        for (std::size_t i = _dir_slots.size(); i-- > 0;) {
+            if (_dir_slots[i].empty()) {
+                _free_dir_slots.push_back(i);
+            }
+        }
+    }
+
+    // only bucket headers are read, entries stay on disk
+    template <class Layout>
+    void basic_file_system<Layout>::load_dir_buckets() {
+        std::vector<std::pair<std::size_t, std::size_t>> buckets; // (local depth, hash bits) by bucket
+        _dir_depth = 0;
+        for (std::size_t k = 0; k < dir_blocks_no(); k++) {
+            auto bucket = _io->acquire(dir_block(k));
+            buckets.emplace_back(utils::bucket_header::depth(bucket.data()), utils::bucket_header::bits(bucket.data()));
+            _dir_depth = std::max(_dir_depth, buckets.back().first);
+        }
+
+        _dir_table.assign(std::size_t{1} << _dir_depth, 0);
+        for (std::size_t k = 0; k < buckets.size(); k++) {
+            auto [depth, bits] = buckets[k];
+            for (std::size_t i = bits; i < _dir_table.size(); i += std::size_t{1} << depth) {
+                _dir_table[i] = k;
+            }
+        }
+    }
+
+    template <class Layout>
+    int basic_file_system<Layout>::get_descriptor_index_from_dir_entry(const std::string &filename) {
+        if (_dir_format == dir_format::HASHED) {
+            auto slot = find_hashed_entry(filename);
+            return slot ? int(slot->descriptor_index) : -1;
+        }
+        if (auto it = _dir_index.find(filename); it != _dir_index.end()) {
+            return int(it->second.descriptor_index);
+        }
+        return -1;
+    }
+
+    template <class Layout>
+    auto basic_file_system<Layout>::insert_dir_entry(const std::string &filename, std::size_t descriptor_index) -> fs_result {
+        if (_dir_format == dir_format::HASHED) {
+            return insert_hashed_entry(filename, descriptor_index);
+        }
+
+        auto [slot, res] = take_dir_entry();
+        if (res != SUCCESS) {
+            return res;
+        }
+        return save_dir_entry(slot, filename, descriptor_index) ? SUCCESS : FAIL;
+    }
+
+    template <class Layout>
+    auto basic_file_system<Layout>::remove_dir_entry(const std::string &filename) -> fs_result {
+        if (_dir_format == dir_format::HASHED) {
+            return remove_hashed_entry(filename);
+        }
+
+        // slot of destroyed file is left empty and reused by the next create
+        auto it = _dir_index.find(filename);
+        if (it == _dir_index.end())
+            return NOT_FOUND;
+
+        if (!save_dir_entry(it->second.slot, "", 0)) {
+            return FAIL;
+        }
+
+        return SUCCESS;
+    }
+
+    // (filename, index of desc) pairs in on-disk order
+    template <class Layout>
+    auto basic_file_system<Layout>::list_dir_entries() -> std::vector<std::pair<std::string, std::size_t>> {
+        std::vector<std::pair<std::string, std::size_t>> res;
+        if (_dir_format == dir_format::FLAT) {
+            for (const auto &filename : _dir_slots) {
+                if (!filename.empty()) {
+                    res.emplace_back(filename, _dir_index.at(filename).descriptor_index);
+                }
+            }
+            return res;
+        }
+
+        const auto entry_size = dir_entry_size();
+        for (std::size_t k = 0; k < dir_blocks_no(); k++) {
+            auto bucket = _io->acquire(dir_block(k));
+            for (std::size_t pos = entry_size; pos + entry_size <= _layout.block_size(); pos += entry_size) {
+                utils::dir_entry entry{bucket.data().subspan(pos, entry_size), _version};
+                if (!entry.filename.empty()) {
+                    res.emplace_back(entry.filename, entry.descriptor_index);
+                }
+            }
+        }
+        return res;
+    }
+
+    // picks free slot left by a destroyed file, otherwise appends to the directory
+    template <class Layout>
+    std::pair<std::size_t, fs_result> basic_file_system<Layout>::take_dir_entry() {
+        if (!_free_dir_slots.empty()) {
+            return {_free_dir_slots.back(), SUCCESS};
+        }
+        if (_dir_slots.size() >= max_files_quantity()) {
+            return {0, NO_SPACE};
+        }
+
+        // entry may cross into a new block, so blocks are checked before it is partly written
+        const auto block_size = _layout.block_size();
+        auto blocks_needed = ((_dir_slots.size() + 1) * dir_entry_size() + block_size - 1) / block_size;
+        if (auto blocks_no = _dir_entry->get_descriptor()->blocks_no(); blocks_needed > blocks_no && blocks_needed - blocks_no > free_blocks_no()) {
+            return {0, NO_BLOCK};
+        }
+        return {_dir_slots.size(), SUCCESS};
+    }
+
+    template <class Layout>
+    bool basic_file_system<Layout>::save_dir_entry(std::size_t i, std::string filename, std::size_t descriptor_index) {
+        auto data = utils::dir_entry{filename, descriptor_index}.convert(_version);
+        if (write_at(_dir_entry, i * dir_entry_size(), data).second != SUCCESS) {
+            return false;
+        }
+        index_dir_entry(i, filename, descriptor_index);
+        return true;
+    }
+
+    // keeps in-memory directory in step with the entry just written to slot i
+    template <class Layout>
+    void basic_file_system<Layout>::index_dir_entry(std::size_t i, const std::string &filename, std::size_t descriptor_index) {
+        if (i >= _dir_slots.size()) {
+            _dir_slots.resize(i + 1);
+        }
+        if (!_dir_slots[i].empty()) {
+            _dir_index.erase(_dir_slots[i]);
+        }
+
+        _dir_slots[i] = filename;
+        if (filename.empty()) {
+            _free_dir_slots.push_back(i);
+        } else {
+            if (!_free_dir_slots.empty() && _free_dir_slots.back() == i) {
+                _free_dir_slots.pop_back();
+            }
+            _dir_index[filename] = {i, descriptor_index};
+        }
+    }
+
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::dir_blocks_no() const {
+        return _layout.block_of(_dir_entry->get_descriptor()->length);
+    }
+
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::dir_block(std::size_t k) const {
+        return _dir_entry->get_descriptor()->block(k);
+    }
+
+    // appends zeroed block to the hashed directory and returns its number within directory. Blocks are
+    // allocated in runs doubling the directory, so it keeps few extents however files grow between its splits
+    template <class Layout>
+    auto basic_file_system<Layout>::add_dir_block() -> std::pair<std::size_t, fs_result> {
+        auto dir_descriptor = _dir_entry->get_descriptor();
+        std::size_t k = dir_blocks_no();
+        if (k >= dir_descriptor->blocks_no()) {
+            if (auto res = allocate_run(dir_descriptor, std::max<std::size_t>(k, 1)).second; res != SUCCESS) {
+                return {0, res == TOO_BIG ? NO_SPACE : res};
+            }
+        }
+        dir_descriptor->length += _layout.block_size();
+        save_descriptor(0, dir_descriptor);
+
+        // whole block is logged, so replay never leaves stale data of a destroyed file in it
+        auto block = _io->acquire(dir_block(k));
+        std::fill(block.data().begin(), block.data().end(), std::byte{0});
+        block.mark_dirty();
+        log_metadata(dir_block(k), 0, _layout.block_size());
+        return {k, SUCCESS};
+    }
+
+    template <class Layout>
+    auto basic_file_system<Layout>::find_hashed_entry(const std::string &filename) -> std::optional<dir_slot> {
+        if (filename.empty()) {
+            return std::nullopt;
+        }
+
+        const auto entry_size = dir_entry_size();
+        auto k = _dir_table[utils::dir_hash(filename) & (_dir_table.size() - 1)];
+        auto bucket = _io->acquire(dir_block(k));
+        for (std::size_t pos = entry_size; pos + entry_size <= _layout.block_size(); pos += entry_size) {
+            utils::dir_entry entry{bucket.data().subspan(pos, entry_size), _version};
+            if (entry.filename == filename) {
+                return dir_slot{k * (_layout.block_size() / entry_size) + pos / entry_size, entry.descriptor_index};
+            }
+        }
+        return std::nullopt;
+    }
+
+    template <class Layout>
+    auto basic_file_system<Layout>::insert_hashed_entry(const std::string &filename, std::size_t descriptor_index) -> fs_result {
+        const auto entry_size = dir_entry_size();
+        auto hash = utils::dir_hash(filename);
+        while (true) {
+            auto k = _dir_table[hash & (_dir_table.size() - 1)];
+            auto bucket = _io->acquire(dir_block(k));
+            for (std::size_t pos = entry_size; pos + entry_size <= _layout.block_size(); pos += entry_size) {
+                if (bucket[pos] == std::byte{0}) {
+                    auto data = utils::dir_entry{filename, descriptor_index}.convert(_version);
+                    std::copy(data.begin(), data.end(), bucket.data().begin() + (std::ptrdiff_t) pos);
+                    bucket.mark_dirty();
+                    log_metadata(dir_block(k), pos, entry_size);
+                    return SUCCESS;
+                }
+            }
+            bucket.release();
+
+            if (auto res = split_dir_bucket(k); res != SUCCESS) {
+                return res;
+            }
+        }
+    }
+
+    // extendible hashing: full bucket is split on the next hash bit, table is doubled when
+    // the bucket was already distinguished by every bit the table uses
+    template <class Layout>
+    auto basic_file_system<Layout>::split_dir_bucket(std::size_t k) -> fs_result {
+        const auto entry_size = dir_entry_size();
+        std::size_t depth, bits;
+        {
+            auto bucket = _io->acquire(dir_block(k));
+            depth = utils::bucket_header::depth(bucket.data());
+            bits = utils::bucket_header::bits(bucket.data());
+        }
+        if (depth == constraints::max_dir_depth) {
+            return NO_SPACE;
+        }
+
+        auto [new_k, res] = add_dir_block();
+        if (res != SUCCESS) {
+            return res;
+        }
+
+        if (depth == _dir_depth) {
+            _dir_table.resize(_dir_table.size() * 2);
+            std::copy(_dir_table.begin(), _dir_table.begin() + (std::ptrdiff_t) (_dir_table.size() / 2),
+                      _dir_table.begin() + (std::ptrdiff_t) (_dir_table.size() / 2));
+            _dir_depth++;
+        }
+
+        auto bucket = _io->acquire(dir_block(k));
+        auto new_bucket = _io->acquire(dir_block(new_k));
+        const auto new_bits = bits | (std::size_t{1} << depth);
+        utils::bucket_header::write(bucket.data(), entry_size, depth + 1, bits);
+        utils::bucket_header::write(new_bucket.data(), entry_size, depth + 1, new_bits);
+        log_metadata(dir_block(k), 0, entry_size);
+
+        std::size_t new_pos = entry_size;
+        for (std::size_t pos = entry_size; pos + entry_size <= _layout.block_size(); pos += entry_size) {
+            utils::dir_entry entry{bucket.data().subspan(pos, entry_size), _version};
+            if (entry.filename.empty() || !((utils::dir_hash(entry.filename) >> depth) & 1)) {
+                continue;
+            }
+            std::copy(bucket.data().begin() + (std::ptrdiff_t) pos, bucket.data().begin() + (std::ptrdiff_t) (pos + entry_size),
+                      new_bucket.data().begin() + (std::ptrdiff_t) new_pos);
+            std::fill(bucket.data().begin() + (std::ptrdiff_t) pos, bucket.data().begin() + (std::ptrdiff_t) (pos + entry_size), std::byte{0});
+            log_metadata(dir_block(k), pos, entry_size);
+            new_pos += entry_size;
+        }
+        bucket.mark_dirty();
+        new_bucket.mark_dirty();
+
+        for (std::size_t i = new_bits; i < _dir_table.size(); i += std::size_t{1} << (depth + 1)) {
+            _dir_table[i] = new_k;
+        }
+        return SUCCESS;
+    }
+
+    // buckets are not merged back, freed slots are reused by later inserts
+    template <class Layout>
+    auto basic_file_system<Layout>::remove_hashed_entry(const std::string &filename) -> fs_result {
+        auto slot = find_hashed_entry(filename);
+        if (!slot) {
+            return NOT_FOUND;
+        }
+
+        // slots are numbered within buckets, which needn't be a whole number of entries long
+        const auto entry_size = dir_entry_size();
+        const auto per_block = _layout.block_size() / entry_size;
+        auto pos = slot->slot % per_block * entry_size;
+        auto block_i = dir_block(slot->slot / per_block);
+        auto bucket = _io->acquire(block_i);
+        std::fill(bucket.data().begin() + (std::ptrdiff_t) pos, bucket.data().begin() + (std::ptrdiff_t) (pos + entry_size), std::byte{0});
+        bucket.mark_dirty();
+        log_metadata(block_i, pos, entry_size);
+        return SUCCESS;
+    }
+
+    // rewrites flat directory as a hashed one. Space is checked up front, so a failed migration
+    // leaves directory untouched; the rewrite itself may not fit into the journal and is then not atomic
+    template <class Layout>
+    fs_result basic_file_system<Layout>::migrate_directory() {
+        journal::operation op{_journal.get()};
+        std::unique_lock dir{_dir_lock};
+
+        if (_dir_format == dir_format::HASHED) {
+            return SUCCESS;
+        }
+        if (is_read_only()) {
+            return READ_ONLY;
+        }
+
+        const auto entry_size = dir_entry_size();
+        if (_layout.block_size() < 2 * entry_size) {
+            return NO_SPACE;
+        }
+
+        auto entries = list_dir_entries();
+        std::vector<std::uint32_t> hashes;
+        for (auto &entry : entries) {
+            hashes.push_back(utils::dir_hash(entry.first));
+        }
+        auto needed = utils::buckets_needed(hashes, 0, _layout.block_size() / entry_size - 1);
+        if (!needed || *needed > _io->get_blocks_no()) {
+            return NO_SPACE;
+        }
+
+        auto dir_descriptor = _dir_entry->get_descriptor();
+        auto old_blocks_no = dir_descriptor->blocks_no() + (dir_descriptor->indirect != 0);
+        if (free_blocks_no() + old_blocks_no < *needed) {
+            return NO_BLOCK;
+        }
+
+        // directory file is rewritten directly, without its oft entry
+        auto dir_oft = _dir_entry;
+        if (dir_oft->modified) {
+            save_block(dir_oft);
+        }
+        dir_oft->block.release();
+        dir_oft->initialized = false;
+        dir_oft->current_pos = 0;
+
+        free_blocks(dir_descriptor);
+        dir_descriptor->length = 0;
+        dir_descriptor->extent_form = _file_format == file_format::DIRECT;
+        save_descriptor(0, dir_descriptor);
+
+        _dir_index.clear();
+        _dir_slots.clear();
+        _free_dir_slots.clear();
+        _dir_format = dir_format::HASHED;
+
+        auto [k, res] = add_dir_block();
+        if (res != SUCCESS) {
+            return res;
+        }
+        {
+            auto bucket = _io->acquire(dir_block(k));
+            utils::bucket_header::write(bucket.data(), dir_entry_size(), 0, 0);
+            bucket.mark_dirty();
+        }
+        _dir_table.assign(1, k);
+        _dir_depth = 0;
+
+        for (auto &[filename, descriptor_index] : entries) {
+            if (auto code = insert_hashed_entry(filename, descriptor_index); code != SUCCESS) {
+                return code;
+            }
+        }
+        return SUCCESS;
+    }
+
+} //namespace lab_fs
@@ -5,16 +5,21 @@
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <memory>
 #include <vector>
 #include <cstring>
 #include <algorithm>
+#include <optional>
+#include <span>
+#include <tuple>
 
 class shell {
 private:
     class command {
     public:
         enum class actions {
-            CREATE, DESTROY, OPEN, CLOSE, READ, WRITE, SEEK, DIR, INIT, SAVE, HELP, EXIT
+            CREATE, DESTROY, OPEN, CLOSE, READ, WRITE, PREAD, PWRITE, READV, WRITEV, READ_BATCH, WRITE_BATCH,
+            ASYNC_OPEN, ASYNC_CLOSE, ASYNC_READ, ASYNC_WRITE, SEEK, DIR, MIGRATE, INIT, SAVE, HELP, EXIT
         };
 
         command(actions action, unsigned args_min_no, unsigned args_max_no) :
@@ -31,6 +36,10 @@ private:
 
     static const std::map<std::string, const command> commands_map;
     static const std::map<lab_fs::fs_result, std::string> fs_results_map;
+    static const std::map<std::string, lab_fs::io_engine> io_engines_map;
+    static const std::map<std::string, lab_fs::dir_format> dir_formats_map;
+    static const std::map<std::string, lab_fs::file_format> file_formats_map;
+    static const std::map<std::string, lab_fs::open_mode> open_modes_map;
 
     static std::vector<std::string> parse_args(const std::string &args_string) {
         std::vector<std::string> args;
@@ -44,11 +53,49 @@ private:
         return args;
     };
 
+    // numeric arguments starting from args[from]; nullopt if some of them is not a number
+    static std::optional<std::vector<std::size_t>> parse_numbers(const std::vector<std::string> &args, std::size_t from) {
+        std::vector<std::size_t> numbers;
+        try {
+            for (auto i = from; i < args.size(); i++) {
+                numbers.push_back(std::stoull(args[i]));
+            }
+        } catch (...) {
+            return std::nullopt;
+        }
+        return numbers;
+    }
+
+    static void print_bytes(std::span<const std::byte> bytes) {
+        for (auto byte : bytes) {
+            std::cout << std::to_integer<int>(byte) << " ";
+        }
+    }
+
+    // awaits the call in a task spawned on the executor and returns its result once the task is done;
+    // `how` tells if the call was done inline, run after its blocks were fetched or run on the executor at once
+    template <class T>
+    static T await(lab_fs::file_system *fs, lab_fs::executor &executor, lab_fs::async_call<T> call, std::string &how) {
+        auto fetched = fs->cache_stats().fetched;
+        bool ready = call.await_ready();
+        std::optional<T> result;
+        lab_fs::spawn(executor, [](lab_fs::async_call<T> &call, std::optional<T> &result) -> lab_fs::task<> {
+            result = co_await call;
+        }(call, result));
+        executor.wait();
+
+        fetched = fs->cache_stats().fetched - fetched;
+        how = ready ? "inline" : fetched > 0 ? "after fetching " + std::to_string(fetched) + " blocks" : "on executor";
+        return std::move(*result);
+    }
+
 public:
     shell() = delete;
 
     static void run(std::istream &is = std::cin, bool repeat_commands = false) {
         lab_fs::file_system *fs = nullptr;
+        std::unique_ptr<lab_fs::executor> executor; // runs awaited calls, started by the first of them
+        std::vector<std::byte> buffer; // reused by rd and wr
         while (true) {
             std::string line;
             std::getline(is, line);
@@ -93,12 +140,17 @@ public:
                     break;
                 }
                 case command::actions::OPEN: {
-                    if (args.size() != cmd.args_min_no + 1) {
-                        std::cout << "error: wrong number of arguments\n";
+                    auto mode = lab_fs::open_mode::BUFFERED;
+                    if (args.size() == 3) {
+                        if (!open_modes_map.contains(args[2])) {
+                            std::cout << "error: unknown open mode " << args[2] << "\n";
+                            break;
+                        }
+                        mode = open_modes_map.at(args[2]);
                     }
                     std::size_t index;
                     lab_fs::fs_result res;
-                    std::tie(index, res) = fs->open(args[1]);
+                    std::tie(index, res) = fs->open(args[1], mode);
                     if (res != lab_fs::fs_result::SUCCESS) {
                         std::cout << fs_results_map.at(res) << std::endl;
                     } else {
@@ -132,9 +184,12 @@ public:
                         break;
                     }
 
-                    std::vector<std::byte> content{count, std::byte{}};
+                    if (buffer.size() < count) {
+                        buffer.resize(count);
+                    }
+                    auto content = std::span{buffer}.first(count);
 
-                    const auto [bytes_read, code] = fs->read(index, content.begin(), count);
+                    const auto [bytes_read, code] = fs->read(index, content);
 
                     std::cout << fs_results_map.at(code) << ", read " << bytes_read << " bytes: ";
                     for (std::size_t i = 0; i < bytes_read; ++i) {
@@ -153,16 +208,200 @@ public:
                     }
                     std::size_t index = std::stoull(args[1]);
                     std::size_t length = std::stoull(args[2]);
-                    std::vector<std::byte> src(length);
+                    if (buffer.size() < length) {
+                        buffer.resize(length);
+                    }
+                    auto src = std::span{buffer}.first(length);
                     for (std::size_t i = 0; i < length; i++) {
                         src[i] = std::byte(i % 256);
                     }
                     std::size_t count;
                     lab_fs::fs_result res;
-                    std::tie(count, res) = fs->write(index, src.begin(), src.size());
+                    std::tie(count, res) = fs->write(index, src);
                     std::cout << fs_results_map.at(res) << ", written " << count << " bytes" << std::endl;
                     break;
                 }
+                case command::actions::PREAD:
+                case command::actions::PWRITE: {
+                    auto numbers = parse_numbers(args, 1);
+                    if (!numbers) {
+                        std::cout << "invalid arguments for positional command\n";
+                        break;
+                    }
+                    auto [index, offset, count] = std::tuple{(*numbers)[0], (*numbers)[1], (*numbers)[2]};
+                    if (buffer.size() < count) {
+                        buffer.resize(count);
+                    }
+                    auto content = std::span{buffer}.first(count);
+                    if (cmd.action == command::actions::PWRITE) {
+                        for (std::size_t i = 0; i < count; i++) {
+                            content[i] = std::byte(i % 256);
+                        }
+                        const auto [written, res] = fs->pwrite(index, offset, content);
+                        std::cout << fs_results_map.at(res) << ", written " << written << " bytes at " << offset << std::endl;
+                        break;
+                    }
+                    const auto [bytes_read, res] = fs->pread(index, offset, content);
+                    std::cout << fs_results_map.at(res) << ", read " << bytes_read << " bytes at " << offset << ": ";
+                    print_bytes(content.first(bytes_read));
+                    std::cout << std::endl;
+                    break;
+                }
+                case command::actions::READV: {
+                    auto numbers = parse_numbers(args, 1);
+                    if (!numbers) {
+                        std::cout << "invalid arguments for readv command\n";
+                        break;
+                    }
+                    std::vector<lab_fs::io_vector> buffers;
+                    std::size_t total = 0;
+                    for (std::size_t k = 1; k < numbers->size(); k++) {
+                        total += (*numbers)[k];
+                    }
+                    if (buffer.size() < total) {
+                        buffer.resize(total);
+                    }
+                    std::size_t offset = 0;
+                    for (std::size_t k = 1; k < numbers->size(); k++) {
+                        buffers.push_back({buffer.begin() + (std::ptrdiff_t) offset, (*numbers)[k]});
+                        offset += (*numbers)[k];
+                    }
+
+                    const auto [bytes_read, code] = fs->readv((*numbers)[0], buffers);
+                    std::cout << fs_results_map.at(code) << ", read " << bytes_read << " bytes into "
+                              << buffers.size() << " buffers: ";
+                    print_bytes(std::span{buffer}.first(bytes_read));
+                    std::cout << std::endl;
+                    break;
+                }
+                case command::actions::WRITEV: {
+                    auto numbers = parse_numbers(args, 1);
+                    if (!numbers) {
+                        std::cout << "invalid arguments for writev command\n";
+                        break;
+                    }
+                    std::vector<lab_fs::io_vector> buffers;
+                    std::size_t total = 0;
+                    for (std::size_t k = 1; k < numbers->size(); k++) {
+                        total += (*numbers)[k];
+                    }
+                    if (buffer.size() < total) {
+                        buffer.resize(total);
+                    }
+                    std::size_t offset = 0;
+                    for (std::size_t k = 1; k < numbers->size(); k++) {
+                        buffers.push_back({buffer.begin() + (std::ptrdiff_t) offset, (*numbers)[k]});
+                        offset += (*numbers)[k];
+                    }
+                    // buffers carry one sequence, as if it were written by a single wr
+                    for (std::size_t i = 0; i < total; i++) {
+                        buffer[i] = std::byte(i % 256);
+                    }
+
+                    const auto [count, res] = fs->writev((*numbers)[0], buffers);
+                    std::cout << fs_results_map.at(res) << ", written " << count << " bytes from "
+                              << buffers.size() << " buffers" << std::endl;
+                    break;
+                }
+                case command::actions::READ_BATCH:
+                case command::actions::WRITE_BATCH: {
+                    auto numbers = parse_numbers(args, 1);
+                    if (!numbers || numbers->size() % 3 != 0) {
+                        std::cout << "error: batch takes triples <file_index> <offset> <number_of_bytes>\n";
+                        break;
+                    }
+                    const bool write = cmd.action == command::actions::WRITE_BATCH;
+                    std::size_t total = 0;
+                    for (std::size_t k = 0; k < numbers->size(); k += 3) {
+                        total += (*numbers)[k + 2];
+                    }
+                    if (buffer.size() < total) {
+                        buffer.resize(total);
+                    }
+                    // every request writes its own sequence 0,1,... like wr
+                    std::vector<lab_fs::io_request> requests;
+                    std::size_t offset = 0;
+                    for (std::size_t k = 0; k < numbers->size(); k += 3) {
+                        auto count = (*numbers)[k + 2];
+                        requests.push_back({(*numbers)[k], (*numbers)[k + 1], buffer.begin() + (std::ptrdiff_t) offset, count});
+                        for (std::size_t i = 0; write && i < count; i++) {
+                            buffer[offset + i] = std::byte(i % 256);
+                        }
+                        offset += count;
+                    }
+
+                    auto results = write ? fs->write_batch(requests) : fs->read_batch(requests);
+                    for (std::size_t k = 0; k < results.size(); k++) {
+                        auto [count, res] = results[k];
+                        std::cout << "request " << k << ": " << fs_results_map.at(res);
+                        if (write) {
+                            std::cout << ", written " << count << " bytes";
+                        } else {
+                            std::cout << ", read " << count << " bytes: ";
+                            print_bytes({std::to_address(requests[k].data), count});
+                        }
+                        std::cout << std::endl;
+                    }
+                    break;
+                }
+                case command::actions::ASYNC_OPEN:
+                case command::actions::ASYNC_CLOSE:
+                case command::actions::ASYNC_READ:
+                case command::actions::ASYNC_WRITE: {
+                    std::optional<std::vector<std::size_t>> numbers;
+                    if (cmd.action != command::actions::ASYNC_OPEN && !(numbers = parse_numbers(args, 1))) {
+                        std::cout << "invalid arguments for awaited command\n";
+                        break;
+                    }
+                    auto mode = lab_fs::open_mode::BUFFERED;
+                    if (cmd.action == command::actions::ASYNC_OPEN && args.size() == 3) {
+                        if (!open_modes_map.contains(args[2])) {
+                            std::cout << "error: unknown open mode " << args[2] << "\n";
+                            break;
+                        }
+                        mode = open_modes_map.at(args[2]);
+                    }
+                    if (!executor) {
+                        executor = std::make_unique<lab_fs::executor>(2);
+                        fs->attach(executor.get());
+                    }
+
+                    std::string how;
+                    if (cmd.action == command::actions::ASYNC_OPEN) {
+                        auto [index, res] = await(fs, *executor, fs->async_open(args[1], mode), how);
+                        std::cout << fs_results_map.at(res) << " " << how;
+                        if (res == lab_fs::fs_result::SUCCESS) {
+                            std::cout << ", file index = " << index;
+                        }
+                        std::cout << std::endl;
+                        break;
+                    }
+                    auto index = (*numbers)[0];
+                    if (cmd.action == command::actions::ASYNC_CLOSE) {
+                        auto res = await(fs, *executor, fs->async_close(index), how);
+                        std::cout << fs_results_map.at(res) << " " << how << ", close file " << index << std::endl;
+                        break;
+                    }
+
+                    auto count = (*numbers)[1];
+                    if (buffer.size() < count) {
+                        buffer.resize(count);
+                    }
+                    auto content = std::span{buffer}.first(count);
+                    if (cmd.action == command::actions::ASYNC_WRITE) {
+                        for (std::size_t i = 0; i < count; i++) {
+                            content[i] = std::byte(i % 256);
+                        }
+                        auto [written, res] = await(fs, *executor, fs->async_write(index, content), how);
+                        std::cout << fs_results_map.at(res) << " " << how << ", written " << written << " bytes" << std::endl;
+                        break;
+                    }
+                    auto [bytes_read, res] = await(fs, *executor, fs->async_read(index, content), how);
+                    std::cout << fs_results_map.at(res) << " " << how << ", read " << bytes_read << " bytes: ";
+                    print_bytes(content.first(bytes_read));
+                    std::cout << std::endl;
+                    break;
+                }
                 case command::actions::SEEK: {
                     if (args.size() != cmd.args_min_no + 1) {
                         std::cout << "error: wrong number of arguments\n";
@@ -183,23 +422,70 @@ public:
                     }
                     break;
                 }
+                case command::actions::MIGRATE: {
+                    auto res = fs->migrate_directory();
+                    std::cout << fs_results_map.at(res) << ", migrate directory" << std::endl;
+                    break;
+                }
                 case command::actions::INIT: {
                     if (fs != nullptr) {
                         std::cout << "error: file system is already loaded; save current file system to create/restore another one";
                         break;
                     }
+                    auto engine = lab_fs::io_engine::MMAP;
+                    if (args.size() >= 7) {
+                        if (!io_engines_map.contains(args[6])) {
+                            std::cout << "error: unknown io engine " << args[6] << "\n";
+                            break;
+                        }
+                        engine = io_engines_map.at(args[6]);
+                    }
+                    lab_fs::layout format;
+                    lab_fs::volume_geometry volume;
+                    bool known_format = true;
+                    for (std::size_t i = 7; i < args.size(); i++) {
+                        if (args[i] == "stripe" && i + 2 < args.size()) {
+                            volume.members_no = std::stoull(args[i + 1]);
+                            volume.stripe_blocks = std::stoull(args[i + 2]);
+                            i += 2;
+                            if (volume.members_no == 0 || volume.stripe_blocks == 0) {
+                                std::cout << "error: stripe needs positive number of images and unit\n";
+                                known_format = false;
+                            }
+                        } else if (dir_formats_map.contains(args[i])) {
+                            format.directory = dir_formats_map.at(args[i]);
+                        } else if (file_formats_map.contains(args[i])) {
+                            format.files = file_formats_map.at(args[i]);
+                        } else {
+                            std::cout << "error: unknown format " << args[i] << "\n";
+                            known_format = false;
+                        }
+                    }
+                    if (!known_format) {
+                        break;
+                    }
                     auto res = lab_fs::file_system::init(std::stoull(args[1]),
                                                          std::stoull(args[2]),
                                                          std::stoull(args[3]),
                                                          std::stoull(args[4]),
-                                                         args[5]);
+                                                         args[5],
+                                                         engine,
+                                                         lab_fs::file_system::constraints::cache_budget,
+                                                         format,
+                                                         volume);
                     fs = res.first;
                     switch (res.second) {
                         case lab_fs::CREATED:
                             std::cout << "disk initialized\n";
                             break;
                         case lab_fs::RESTORED:
-                            std::cout << "disk restored\n";
+                            std::cout << (fs->is_read_only() ? "disk restored read-only, v1 image\n" : "disk restored\n");
+                            break;
+                        case lab_fs::FAILED:
+                            std::cout << "error: failed to open disk image\n";
+                            break;
+                        case lab_fs::INVALID_GEOMETRY:
+                            std::cout << "error: disk geometry is not supported or doesn't match the image\n";
                             break;
                         default:
                             break;
@@ -207,27 +493,41 @@ public:
                     break;
                 }
                 case command::actions::SAVE: {
-                    if (args.size() == 1) {
-                        fs->save();
-                    } else {
-                        fs->save(args[1]);
+                    auto stats = args.size() == 1 ? fs->save() : fs->save(args[1]);
+                    if (stats.failed) {
+                        std::cout << "error: some blocks could not be written to disk image\n";
                     }
-                    std::cout << "disk saved\n";
+                    std::cout << "disk saved, flushed " << stats.blocks << " blocks (" << stats.bytes << " bytes)\n";
                     delete fs;
                     fs = nullptr;
+                    executor.reset();
                     break;
                 }
                 case command::actions::HELP: {
-                    std::cout << "in <cyl_no> <surf_no> <sect_no> <sect_len> <disk_filename> - initialize file system\n";
+                    std::cout << "in <cyl_no> <surf_no> <sect_no> <sect_len> <disk_filename> [memory|file|mmap|async] [flat|hashed] [direct|extent] [stripe <images_no> <unit_blocks>] - initialize file system\n";
+                    std::cout << "   mmap (default), file and async write changes into the image as they are made, so part of them is there even without sv;\n";
+                    std::cout << "   memory keeps them until sv, except that each journal commit, due soon after metadata changes, writes every block changed so far to the image\n";
                     std::cout << "sv <disk_filename> - save current file system\n";
                     std::cout << "cr <file_name> - create file\n";
                     std::cout << "de <file_name> - destroy file\n";
-                    std::cout << "op <file_name> - open file\n";
+                    std::cout << "op <file_name> [buffered|direct] - open file\n";
                     std::cout << "cl <file_index> - close file\n";
                     std::cout << "rd <file_index> <number_of_bytes> - read from file\n";
                     std::cout << "wr <file_index> <number_of_bytes> - write to file (writes sequences 0,1,...,255,0,...)\n";
+                    std::cout << "pr <file_index> <offset> <number_of_bytes> - read from file at offset, position stays\n";
+                    std::cout << "pw <file_index> <offset> <number_of_bytes> - write to file at offset, position stays (writes sequences 0,1,...)\n";
+                    std::cout << "rv <file_index> <number_of_bytes>... - read from file into several buffers at once\n";
+                    std::cout << "wv <file_index> <number_of_bytes>... - write to file from several buffers at once (one sequence 0,1,... over all of them)\n";
+                    std::cout << "rb <file_index> <offset> <number_of_bytes>... - read batch of requests at given offsets, positions stay\n";
+                    std::cout << "wb <file_index> <offset> <number_of_bytes>... - write batch of requests at given offsets, positions stay\n";
+                    std::cout << "ao <file_name> [buffered|direct] - open file with an awaited call\n";
+                    std::cout << "ac <file_index> - close file with an awaited call\n";
+                    std::cout << "ar <file_index> <number_of_bytes> - read from file with an awaited call, tells if it waited for blocks\n";
+                    std::cout << "aw <file_index> <number_of_bytes> - write to file with an awaited call (writes sequences 0,1,...)\n";
                     std::cout << "sk <file_index> <position> - seek to position in file\n";
                     std::cout << "dr - show directory content\n";
+                    std::cout << "mg - migrate directory to hashed format\n";
+                    std::cout << "exit - leave without saving; changes already written into the image stay there\n";
                     break;
                 }
                 case command::actions::EXIT: {
@@ -244,13 +544,24 @@ public:
 const std::map<std::string, const shell::command> shell::commands_map = {
         {"cr",   shell::command{shell::command::actions::CREATE,  1}},
         {"de",   shell::command{shell::command::actions::DESTROY, 1}},
-        {"op",   shell::command{shell::command::actions::OPEN,    1}},
+        {"op",   shell::command{shell::command::actions::OPEN,    1, 2}},
         {"cl",   shell::command{shell::command::actions::CLOSE,   1}},
         {"rd",   shell::command{shell::command::actions::READ,    2}},
         {"wr",   shell::command{shell::command::actions::WRITE,   2}},
+        {"pr",   shell::command{shell::command::actions::PREAD,   3}},
+        {"pw",   shell::command{shell::command::actions::PWRITE,  3}},
+        {"rv",   shell::command{shell::command::actions::READV,       2, 9}},
+        {"wv",   shell::command{shell::command::actions::WRITEV,      2, 9}},
+        {"rb",   shell::command{shell::command::actions::READ_BATCH,  3, 12}},
+        {"wb",   shell::command{shell::command::actions::WRITE_BATCH, 3, 12}},
+        {"ao",   shell::command{shell::command::actions::ASYNC_OPEN,  1, 2}},
+        {"ac",   shell::command{shell::command::actions::ASYNC_CLOSE, 1}},
+        {"ar",   shell::command{shell::command::actions::ASYNC_READ,  2}},
+        {"aw",   shell::command{shell::command::actions::ASYNC_WRITE, 2}},
         {"sk",   shell::command{shell::command::actions::SEEK,    2}},
         {"dr",   shell::command{shell::command::actions::DIR,     0}},
-        {"in",   shell::command{shell::command::actions::INIT,    5}},
+        {"mg",   shell::command{shell::command::actions::MIGRATE, 0}},
+        {"in",   shell::command{shell::command::actions::INIT,    5, 11}},
         {"sv",   shell::command{shell::command::actions::SAVE,    0, 1}},
         {"help", shell::command{shell::command::actions::HELP,    0}},
         {"exit", shell::command{shell::command::actions::EXIT,    0}},
@@ -268,6 +579,29 @@ const std::map<lab_fs::fs_result, std::string> shell::fs_results_map = {
     {lab_fs::fs_result::FAIL, "error: something went wrong"},
     {lab_fs::fs_result::NO_BLOCK, "error: no free blocks"},
     {lab_fs::fs_result::OFT_FULL, "error: OFT is full"},
+    {lab_fs::fs_result::READ_ONLY, "error: read-only file system"},
+};
+
+const std::map<std::string, lab_fs::io_engine> shell::io_engines_map = {
+    {"memory", lab_fs::io_engine::MEMORY},
+    {"file", lab_fs::io_engine::FILE},
+    {"mmap", lab_fs::io_engine::MMAP},
+    {"async", lab_fs::io_engine::ASYNC},
+};
+
+const std::map<std::string, lab_fs::dir_format> shell::dir_formats_map = {
+    {"flat", lab_fs::dir_format::FLAT},
+    {"hashed", lab_fs::dir_format::HASHED},
+};
+
+const std::map<std::string, lab_fs::file_format> shell::file_formats_map = {
+    {"direct", lab_fs::file_format::DIRECT},
+    {"extent", lab_fs::file_format::EXTENT},
+};
+
+const std::map<std::string, lab_fs::open_mode> shell::open_modes_map = {
+    {"buffered", lab_fs::open_mode::BUFFERED},
+    {"direct", lab_fs::open_mode::DIRECT},
 };
 
 #ifdef FS_SHELL_MAIN
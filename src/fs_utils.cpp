@@ -1,272 +1,535 @@
 #include "fs.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <optional>
+
 namespace lab_fs {
-    file_system::file_descriptor *file_system::get_descriptor(std::size_t index, bool disable_caching) {
-        if (_descriptors_cache.contains(index)) {
-            return _descriptors_cache[index];
-        }
+    namespace utils {
+        // v1 images with non-default file format are tagged by a record just before the journal anchor
+        // in the tail of the bitmap block; untagged images store direct block numbers
+        struct format_record {
+            static constexpr std::uint32_t magic = 0x464D464C;  // "LFMF"
+            static constexpr std::size_t tail_offset = 32;
+
+            static file_format read(std::span<const std::byte> block) {
+                if (block.size() < file_system::constraints::extent_min_block_size) {
+                    return file_format::DIRECT;
+                }
+                auto record = block.last(tail_offset);
+                if (load_le(record, 0, 4) != magic) {
+                    return file_format::DIRECT;
+                }
+                return (file_format) load_le(record, 4, 1);
+            }
+        };
 
-        std::size_t offset = index * constraints::bytes_for_descriptor;
-        std::uint8_t block_i = 1 + offset / _io.get_block_size();
-        if (block_i >= constraints::descriptive_blocks_no) {
-            return nullptr;
-        }
+        // v2 block 0: {magic, version, file format, pointer size, journal blocks number, block size, blocks number,
+        // bitmap start, descriptor table start, descriptors number, journal start (0 if none)};
+        // bitmap takes blocks up to the descriptor table, data blocks follow the table.
+        // v1 block 0 starts with the bitmap, whose first byte is at least 0xC0 as blocks 0 and 1 are always taken
+        struct superblock {
+            static constexpr std::uint32_t magic = 0x3253464C;  // "LFS2"
+            static constexpr std::size_t size = 32;
+            static constexpr std::size_t pointer_size = file_system::constraints::v2_pointer_size;
+
+            file_format files = file_format::DIRECT;
+            std::size_t block_size = 0;
+            std::size_t blocks_no = 0;
+            std::size_t bitmap_start = 1;
+            std::size_t descriptors_start = 0;
+            std::size_t descriptors_no = 0;
+            std::size_t journal_start = 0;
+            std::size_t journal_blocks_no = 0;
+
+            // one descriptor per two blocks besides the directory one, table is rounded up to whole blocks;
+            // returns nullopt if metadata leaves no block for data
+            static std::optional<superblock> plan(std::size_t blocks_no, std::size_t block_size, file_format files) {
+                using constrs = file_system::constraints;
+                if (!std::has_single_bit(block_size) || block_size < constrs::v2_min_block_size ||
+                    block_size > constrs::max_block_size || blocks_no > (std::size_t{1} << (8 * pointer_size)) - 1) {
+                    return std::nullopt;
+                }
 
-        utils::disk_view dv{_io, block_i, false};
-        if (dv.block_i() == constraints::descriptive_blocks_no - 1 && offset % _io.get_block_size() > _io.get_block_size() - constraints::bytes_for_descriptor) {
-            return nullptr;
-        }
+                superblock sb;
+                sb.files = files;
+                sb.block_size = block_size;
+                sb.blocks_no = blocks_no;
+                sb.descriptors_start = sb.bitmap_start + (blocks_no + 8 * block_size - 1) / (8 * block_size);
+                const auto per_block = block_size / constrs::v2_descriptor_size;
+                const auto table_blocks_no = (blocks_no / 2 + 1 + per_block - 1) / per_block;
+                sb.descriptors_no = table_blocks_no * per_block;
+
+                // journal takes last blocks of the disk, when it is big enough to spare them. It is sized to
+                // twice the bitmap and a few blocks more, so an operation changing every bit of the bitmap still
+                // fits into a half-full journal and its transaction is not split
+                if (blocks_no >= constrs::journal_min_blocks_no && block_size >= constrs::journal_min_block_size) {
+                    auto wanted = 2 * (sb.descriptors_start - sb.bitmap_start + constrs::journal_spare_blocks_no);
+                    auto limit = std::clamp(blocks_no / constrs::journal_max_disk_share,
+                                            constrs::journal_min_area_blocks_no, constrs::journal_max_area_blocks_no);
+                    sb.journal_blocks_no = std::clamp(wanted, constrs::journal_min_area_blocks_no, limit);
+                    sb.journal_start = blocks_no - sb.journal_blocks_no;
+                }
+                if (sb.data_start() + sb.journal_blocks_no >= blocks_no) {
+                    return std::nullopt;
+                }
+                return sb;
+            }
 
-        auto length = std::to_integer<std::size_t>(dv[offset++]);
-        std::array<std::size_t, constraints::max_blocks_per_file> occupied_blocks{};
-        for (unsigned i = 1; i < constraints::bytes_for_file_length; i++, offset++) {
-            length += (std::to_integer<std::size_t>(dv[offset]) << 8);
-        }
-        for (unsigned i = 0; i < constraints::max_blocks_per_file; i++, offset++) {
-            occupied_blocks[i] = std::to_integer<std::size_t>(dv[offset]);
-        }
+            static std::optional<superblock> read(std::span<const std::byte> block) {
+                if (block.size() < size || load_le(block, 0, 4) != magic ||
+                    load_le(block, 4, 1) != (std::uint64_t) format_version::V2 || load_le(block, 6, 1) != pointer_size) {
+                    return std::nullopt;
+                }
 
-        if (!(length == 0 && std::all_of(occupied_blocks.begin(), occupied_blocks.end(), [](const auto &value) { return value == 0; }))) {
-            auto fd = new file_descriptor(length, occupied_blocks);
-            if (!disable_caching) {
-                _descriptors_cache[index] = fd;
+                superblock sb;
+                sb.files = (file_format) load_le(block, 5, 1);
+                sb.journal_blocks_no = load_le(block, 7, 1);
+                sb.block_size = load_le(block, 8, 4);
+                sb.blocks_no = load_le(block, 12, 4);
+                sb.bitmap_start = load_le(block, 16, 4);
+                sb.descriptors_start = load_le(block, 20, 4);
+                sb.descriptors_no = load_le(block, 24, 4);
+                sb.journal_start = load_le(block, 28, 4);
+                return sb;
             }
-            return fd;
-        } else {
-            return nullptr;
+
+            void write(std::span<std::byte> block) const {
+                std::fill(block.begin(), block.begin() + size, std::byte{0});
+                store_le(block, 0, 4, magic);
+                store_le(block, 4, 1, (std::uint64_t) format_version::V2);
+                store_le(block, 5, 1, (std::uint64_t) files);
+                store_le(block, 6, 1, pointer_size);
+                store_le(block, 7, 1, journal_blocks_no);
+                store_le(block, 8, 4, block_size);
+                store_le(block, 12, 4, blocks_no);
+                store_le(block, 16, 4, bitmap_start);
+                store_le(block, 20, 4, descriptors_start);
+                store_le(block, 24, 4, descriptors_no);
+                store_le(block, 28, 4, journal_start);
+            }
+
+            // first block after the descriptor table
+            [[nodiscard]] std::size_t data_start() const {
+                return descriptors_start + descriptors_no * file_system::constraints::v2_descriptor_size / block_size;
+            }
+        };
+
+        // positions of descriptor fields, except v1 direct descriptor which has no in-use flag:
+        // v1 extent: {flags, indirect block, length (4 bytes), extents}; v2: {flags, 3 reserved bytes,
+        // indirect block (4 bytes), length (8 bytes), 3 block numbers or 2 extents}. Extent is {start, length},
+        // both fields of block pointer width
+        struct descriptor_fields {
+            std::size_t indirect;
+            std::size_t length;
+            std::size_t length_width;
+            std::size_t blocks;
+
+            static descriptor_fields of(format_version version) {
+                return version == format_version::V1 ? descriptor_fields{1, 2, 4, 6} : descriptor_fields{4, 8, 8, 16};
+            }
+        };
+
+        inline std::size_t descriptor_size(format_version version, file_format files) {
+            if (version == format_version::V2) {
+                return file_system::constraints::v2_descriptor_size;
+            }
+            return files == file_format::EXTENT ? file_system::constraints::bytes_for_extent_descriptor
+                                                : file_system::constraints::bytes_for_descriptor;
         }
-    }
 
-    bool file_system::save_descriptor(std::size_t index, file_descriptor *descriptor) {
-        std::size_t offset = index * constraints::bytes_for_descriptor;
-        std::uint8_t block_i = 1 + offset / _io.get_block_size();
-        if (block_i >= constraints::descriptive_blocks_no) {
-            return false;
+        inline std::size_t pointer_size(format_version version) {
+            return version == format_version::V1 ? 1 : superblock::pointer_size;
         }
+    } // namespace utils
 
-        utils::disk_view dv{_io, block_i, true};
-        if (dv.block_i() == constraints::descriptive_blocks_no - 1 && offset % _io.get_block_size() > _io.get_block_size() - constraints::bytes_for_descriptor) {
-            return false;
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::descriptor_size() const {
+        return _layout.descriptor_size();
+    }
+
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::descriptors_no() const {
+        return _descriptors_no;
+    }
+
+    // descriptor table is split into whole descriptors per block; returns (block, offset in block)
+    template <class Layout>
+    auto basic_file_system<Layout>::descriptor_location(std::size_t index) const -> std::pair<std::size_t, std::size_t> {
+        const auto per_block = _layout.block_size() / descriptor_size();
+        return {_descriptors_start + index / per_block, index % per_block * descriptor_size()};
+    }
+
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::max_file_blocks() const {
+        return _file_format == file_format::EXTENT ? _io->get_blocks_no() : constraints::max_blocks_per_file;
+    }
+
+    // hashed directory of a v2 direct image is kept as extents, or it couldn't grow past three buckets
+    template <class Layout>
+    bool basic_file_system<Layout>::keeps_extents(const file_descriptor *descriptor) const {
+        return _file_format == file_format::EXTENT || descriptor->extent_form;
+    }
+
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::max_blocks_of(const file_descriptor *descriptor) const {
+        return keeps_extents(descriptor) ? _io->get_blocks_no() : constraints::max_blocks_per_file;
+    }
+
+    // inline extents and those of the indirect block: {records number (one record wide), records}
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::max_extents_no() const {
+        return inline_extents_no() + _layout.block_size() / (2 * pointer_size()) - 1;
+    }
+
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::pointer_size() const {
+        return _layout.pointer_size();
+    }
+
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::max_extent_length() const {
+        return (std::size_t{1} << (8 * pointer_size())) - 1;
+    }
+
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::inline_extents_no() const {
+        if (_version == format_version::V1) {
+            return constraints::inline_extents_no;
         }
+        return (constraints::v2_descriptor_size - utils::descriptor_fields::of(_version).blocks) / (2 * pointer_size());
+    }
 
-        std::size_t length = descriptor->length;
-        for (unsigned i = 0; i < constraints::bytes_for_file_length; i++, offset++) {
-            dv[offset] = std::byte{(std::uint8_t) (length % 256)};
-            length >>= 8;
+    template <class Layout>
+    typename basic_file_system<Layout>::file_descriptor *basic_file_system<Layout>::get_descriptor(std::size_t index) {
+        std::lock_guard descriptors{_table_lock};
+        if (auto it = _descriptors_cache.find(index); it != _descriptors_cache.end()) {
+            return it->second;
         }
-        for (unsigned i = 0; i < constraints::max_blocks_per_file; i++, offset++) {
-            dv[offset] = std::byte{(std::uint8_t) descriptor->occupied_blocks[i]};
+        if (index >= descriptors_no()) {
+            return nullptr;
         }
-        dv.push_buffer();
 
-        return true;
+        auto [block_i, offset] = descriptor_location(index);
+        auto table = _io->acquire(block_i);
+        auto descriptor = decode_descriptor(table.data().subspan(offset, descriptor_size()));
+        if (descriptor) {
+            _descriptors_cache[index] = descriptor;
+        }
+        return descriptor;
     }
 
-    int file_system::take_descriptor() {
-        int index = 0;
-        std::size_t offset = 0;
-        utils::disk_view dv{_io, 1, false};
-
-        while (true) {
-            if (dv.block_i() == constraints::descriptive_blocks_no - 1 && offset % _io.get_block_size() > _io.get_block_size() - constraints::bytes_for_descriptor) {
-                return -1;
+    // v1 direct: {length (2 bytes), 3 block numbers}, 255 in every block marks taken descriptor without blocks;
+    // other formats are laid out by utils::descriptor_fields, second bit of v2 flags marks extents kept
+    // by a direct image. Returns nullptr for free descriptor
+    template <class Layout>
+    typename basic_file_system<Layout>::file_descriptor *basic_file_system<Layout>::decode_descriptor(std::span<const std::byte> data) {
+        if (_version == format_version::V1 && _file_format == file_format::DIRECT) {
+            if (std::all_of(data.begin(), data.end(), [](auto value) { return value == std::byte{0}; })) {
+                return nullptr;
             }
 
-            bool found = true;
-            for (unsigned i = 0; i < constraints::bytes_for_descriptor; i++) {
-                if (dv[offset + i] != std::byte{0}) {
-                    found = false;
+            auto descriptor = new file_descriptor{utils::load_le(data, 0, constraints::bytes_for_file_length)};
+            for (std::size_t i = 0; i < constraints::max_blocks_per_file; i++) {
+                auto block = std::to_integer<std::size_t>(data[constraints::bytes_for_file_length + i]);
+                if (block == 0 || block == 255) {
                     break;
                 }
+                descriptor->append(block, max_extent_length());
             }
+            return descriptor;
+        }
 
-            if (found) {
-                dv.enable_write();
-                for (unsigned i = constraints::bytes_for_file_length; i < constraints::bytes_for_descriptor; i++) {
-                    dv[offset + i] = std::byte{255};
-                }
-                dv.push_buffer();
-                return index;
-            } else {
-                index++;
-                offset += constraints::bytes_for_descriptor;
-            }
+        if ((data[0] & std::byte{1}) == std::byte{0}) {
+            return nullptr;
         }
-    }
 
-    namespace utils {
-        class dir_entry {
-        public:
-            static constexpr std::size_t dir_entry_size = file_system::constraints::max_filename_length + 1;
-
-        public:
-            dir_entry(const dir_entry &d) = default;
-
-            dir_entry(std::string filename, std::byte descriptor_index) :
-                    filename{std::move(filename)},
-                    descriptor_index{descriptor_index} {}
-
-            explicit dir_entry(std::vector<std::byte> &container) {
-                filename = "";
-                for (int i = 0; i < file_system::constraints::max_filename_length; i++) {
-                    if (container[i] == std::byte{0}) {
-                        break;
-                    }
-                    filename.push_back(char(container[i]));
+        const auto fields = utils::descriptor_fields::of(_version);
+        const auto pointer = pointer_size();
+        auto descriptor = new file_descriptor{utils::load_le(data, fields.length, fields.length_width), {},
+                                              utils::load_le(data, fields.indirect, pointer)};
+        descriptor->extent_form = _file_format == file_format::DIRECT && (data[0] & std::byte{2}) != std::byte{0};
+        if (!keeps_extents(descriptor)) {
+            for (std::size_t i = 0; i < constraints::max_blocks_per_file; i++) {
+                auto block = utils::load_le(data, fields.blocks + i * pointer, pointer);
+                if (block == 0) {
+                    break;
                 }
-                descriptor_index = container[dir_entry_size - 1];
+                descriptor->append(block, max_extent_length());
             }
+            return descriptor;
+        }
 
-            bool is_empty() const {
-                return filename.empty() && (descriptor_index == std::byte{0});
+        const auto record = 2 * pointer;
+        for (std::size_t i = 0; i < inline_extents_no(); i++) {
+            auto length = utils::load_le(data, fields.blocks + i * record + pointer, pointer);
+            if (length == 0) {
+                break;
             }
-
-            std::vector<std::byte> convert() {
-                std::vector<std::byte> container(dir_entry_size);
-                for (unsigned i = 0; i < filename.size(); i++) {
-                    container[i] = std::byte{(std::uint8_t) filename[i]};
-                }
-                for (unsigned i = filename.size(); i < file_system::constraints::max_filename_length; i++) {
-                    container[i] = std::byte{0};
-                }
-                container[dir_entry_size - 1] = descriptor_index;
-                return container;
+            descriptor->extents.push_back({utils::load_le(data, fields.blocks + i * record, pointer), length});
+        }
+        if (descriptor->indirect != 0) {
+            auto block = _io->acquire(descriptor->indirect);
+            auto records_no = utils::load_le(block.data(), 0, record);
+            for (std::size_t i = 1; i <= records_no; i++) {
+                descriptor->extents.push_back({utils::load_le(block.data(), i * record, pointer),
+                                               utils::load_le(block.data(), i * record + pointer, pointer)});
             }
+        }
+        return descriptor;
+    }
 
-            static std::optional<dir_entry> read_dir_entry(file_system *fs, std::size_t i) {
-                std::size_t pos = i * (dir_entry_size);
-                if (fs->lseek(0, pos) == SUCCESS) {
-                    std::vector<std::byte> container(dir_entry_size);
+    template <class Layout>
+    bool basic_file_system<Layout>::save_descriptor(std::size_t index, file_descriptor *descriptor) {
+        if (index >= descriptors_no()) {
+            return false;
+        }
 
-                    if (fs->read(0, container.begin(), utils::dir_entry::dir_entry_size).first == utils::dir_entry::dir_entry_size) {
-                        return std::optional<dir_entry>{dir_entry(container)};
-                    } else {
-                        return std::nullopt;
-                    }
-                } else {
-                    return std::nullopt;
+        const auto size = descriptor_size();
+        auto [block_i, offset] = descriptor_location(index);
+        std::lock_guard descriptors{_table_lock};
+        auto table = _io->acquire(block_i);
+        auto data = table.data().subspan(offset, size);
+        std::fill(data.begin(), data.end(), std::byte{0});
+
+        const auto fields = utils::descriptor_fields::of(_version);
+        const auto pointer = pointer_size();
+        if (_version == format_version::V1 && _file_format == file_format::DIRECT) {
+            assert(descriptor->blocks_no() <= constraints::max_blocks_per_file);
+            utils::store_le(data, 0, constraints::bytes_for_file_length, descriptor->length);
+            for (std::size_t i = 0; i < constraints::max_blocks_per_file; i++) {
+                auto block = descriptor->extents.empty() ? 255 : descriptor->block(i);
+                data[constraints::bytes_for_file_length + i] = std::byte{(std::uint8_t) block};
+            }
+        } else if (!keeps_extents(descriptor)) {
+            assert(descriptor->blocks_no() <= constraints::max_blocks_per_file);
+            data[0] = std::byte{1};
+            utils::store_le(data, fields.length, fields.length_width, descriptor->length);
+            for (std::size_t i = 0; i < descriptor->blocks_no(); i++) {
+                utils::store_le(data, fields.blocks + i * pointer, pointer, descriptor->block(i));
+            }
+        } else {
+            assert((descriptor->extents.size() <= inline_extents_no() || descriptor->indirect != 0) &&
+                   descriptor->extents.size() <= max_extents_no());
+            const auto record = 2 * pointer;
+            data[0] = descriptor->extent_form ? std::byte{3} : std::byte{1};
+            utils::store_le(data, fields.indirect, pointer, descriptor->indirect);
+            utils::store_le(data, fields.length, fields.length_width, descriptor->length);
+
+            auto inline_no = std::min(descriptor->extents.size(), inline_extents_no());
+            for (std::size_t i = 0; i < inline_no; i++) {
+                utils::store_le(data, fields.blocks + i * record, pointer, descriptor->extents[i].start);
+                utils::store_le(data, fields.blocks + i * record + pointer, pointer, descriptor->extents[i].length);
+            }
+            if (descriptor->indirect != 0) {
+                auto block = _io->acquire(descriptor->indirect);
+                auto records_no = descriptor->extents.size() - inline_no;
+                utils::store_le(block.data(), 0, record, records_no);
+                for (std::size_t i = 1; i <= records_no; i++) {
+                    utils::store_le(block.data(), i * record, pointer, descriptor->extents[inline_no + i - 1].start);
+                    utils::store_le(block.data(), i * record + pointer, pointer, descriptor->extents[inline_no + i - 1].length);
                 }
+                block.mark_dirty();
+                log_metadata(descriptor->indirect, 0, (records_no + 1) * record);
             }
+        }
 
-        public:
-            std::string filename;
-            std::byte descriptor_index;
-        };
-
-    }  // namespace utils
+        table.mark_dirty();
+        log_metadata(block_i, offset, size);
+        return true;
+    }
 
-    int file_system::get_descriptor_index_from_dir_entry(const std::string &filename) {
-        std::size_t i = 0;
-        while (true) {
-            auto dire_opt = utils::dir_entry::read_dir_entry(this, i);
-            if (!dire_opt.has_value()) {
-                return -1;
+    // lowest free descriptor is taken; the search starts from the hint, so creates don't rescan the table
+    template <class Layout>
+    int basic_file_system<Layout>::take_descriptor() {
+        const auto size = descriptor_size();
+        std::lock_guard descriptors{_table_lock};
+        block_handle table;
+        for (std::size_t index = _free_descriptor_hint; index < descriptors_no(); index++) {
+            auto [block_i, offset] = descriptor_location(index);
+            if (!table || table.index() != block_i) {
+                table = _io->acquire(block_i);
+            }
+            auto data = table.data().subspan(offset, size);
+            bool v1_direct = _version == format_version::V1 && _file_format == file_format::DIRECT;
+            bool free = v1_direct
+                        ? std::all_of(data.begin(), data.end(), [](auto value) { return value == std::byte{0}; })
+                        : (data[0] & std::byte{1}) == std::byte{0};
+            if (!free) {
+                continue;
             }
-            auto dire = dire_opt.value();
-            if (dire.filename == filename) {
-                return int(dire.descriptor_index);
+
+            if (v1_direct) {
+                std::fill(data.begin() + constraints::bytes_for_file_length, data.end(), std::byte{255});
+            } else {
+                data[0] = std::byte{1};
             }
-            ++i;
+            table.mark_dirty();
+            log_metadata(block_i, offset, size);
+            _free_descriptor_hint = index + 1;
+            return (int) index;
         }
+        _free_descriptor_hint = descriptors_no();
+        return -1;
     }
 
-    // picks last free space and reads through all to verify there is no same file
-    std::pair<std::size_t, fs_result> file_system::take_dir_entry(const std::string &filename) {
-        if (!_oft[0]->initialized) {
-            if(auto res = initialize_oft_entry(_oft[0], 0); res != SUCCESS) {
-                return {0,res};
-            }
+    template <class Layout>
+    void basic_file_system<Layout>::release_descriptor(std::size_t index) {
+        const auto size = descriptor_size();
+        auto [block_i, offset] = descriptor_location(index);
+        std::lock_guard descriptors{_table_lock};
+        auto table = _io->acquire(block_i);
+        auto data = table.data().subspan(offset, size);
+        std::fill(data.begin(), data.end(), std::byte{0});
+        table.mark_dirty();
+        log_metadata(block_i, offset, size);
+        _free_descriptor_hint = std::min(_free_descriptor_hint, index);
+    }
+
+    // appends up to n blocks to the file from one run of free blocks, so a multi-block write lands
+    // sequentially on disk; the run right after the last block of the file is preferred. Blocks are
+    // reserved here unless the caller has reserved them; those the caller reserved and didn't get
+    // stay reserved. Returns number of blocks appended
+    template <class Layout>
+    auto basic_file_system<Layout>::allocate_run(file_descriptor *descriptor, std::size_t n, bool reserved) -> std::pair<std::size_t, fs_result> {
+        assert(n > 0);
+        const auto max_blocks = max_blocks_of(descriptor);
+        if (descriptor->blocks_no() >= max_blocks) {
+            return {0, TOO_BIG};
+        }
+        n = std::min({n, max_blocks - descriptor->blocks_no(), max_extent_length()});
+        if (!reserved && (n = _bitmap.reserve(n)) == 0) {
+            return {0, NO_BLOCK};
         }
+        auto unreserve = [this, n, reserved](std::size_t claimed) {
+            if (!reserved) {
+                _bitmap.unreserve(n - claimed);
+            }
+        };
 
-        std::size_t i = 0;
-        int free = -1;
-        while (true) {
-            auto dire_opt = utils::dir_entry::read_dir_entry(this, i);
-
-            // looked through all dir entries and none of them is free
-            if (!dire_opt.has_value()) {
-                if (free == -1) {
-                    // the file is just too big
-                    if( _descriptors_cache[_oft[0]->get_descriptor_index()]->length == _io.get_block_size()* constraints::max_blocks_per_file) {
-                        return {0, NO_SPACE};                       
-                    // all entries were present
-                    } else {
-                        return {i, SUCCESS};
-                    }
-                }
-                return {free, SUCCESS};
+        std::pair<std::size_t, std::size_t> run{0, 0};
+        bool extends_last = false;
+        if (!descriptor->extents.empty()) {
+            auto &last = descriptor->extents.back();
+            if (auto next = last.start + last.length; next < _bitmap.size() && last.length < max_extent_length()) {
+                run = {next, _bitmap.claim_from(next, std::min(n, max_extent_length() - last.length))};
+                extends_last = run.second > 0;
             }
+        }
 
-            auto dire = dire_opt.value();
+        bool needs_extent = keeps_extents(descriptor) && !extends_last;
+        if (needs_extent && descriptor->extents.size() == max_extents_no()) {
+            unreserve(0);
+            return {0, TOO_BIG};
+        }
+        if (!extends_last && (run = _bitmap.claim_run(n)).second == 0) {
+            unreserve(0);
+            return {0, NO_BLOCK};
+        }
 
-            // check if file has same name
-            if (dire.filename == filename) {
-                return {0, EXISTS};
+        auto [start, length] = run;
+        if (needs_extent && descriptor->extents.size() == inline_extents_no() && descriptor->indirect == 0) {
+            auto indirect = block_bitmap::npos;
+            if (_bitmap.reserve(1) != 0 && (indirect = _bitmap.claim_free()) == block_bitmap::npos) {
+                _bitmap.unreserve(1);
             }
-
-            // remember empty slot
-            if (dire.is_empty()) {
-                free = i;
+            if (indirect == block_bitmap::npos) {
+                for (std::size_t i = start; i < start + length; i++) {
+                    _bitmap.unclaim(i);
+                }
+                unreserve(0);
+                return {0, NO_BLOCK};
             }
-            i++;
+            descriptor->indirect = indirect;
+            set_block_state(descriptor->indirect, true);
+        }
+        for (std::size_t i = start; i < start + length; i++) {
+            set_block_state(i, true);
+            descriptor->append(i, max_extent_length());
         }
+        unreserve(length);
+        return {length, SUCCESS};
     }
 
-    bool file_system::save_dir_entry(std::size_t i, std::string filename, std::size_t descriptor_index) {
-        std::size_t pos = i * (utils::dir_entry::dir_entry_size);
-        if (lseek(0, pos) == SUCCESS) {
-            auto data = utils::dir_entry{std::move(filename), std::byte{(std::uint8_t) descriptor_index}}.convert();
-            if (write(0, data.begin(), data.size()).second == SUCCESS) {
-                return true;
-            } else {
-                return false;
+    // on-disk bits are cleared before blocks are released, so a thread claiming one sets its bit after that
+    template <class Layout>
+    void basic_file_system<Layout>::free_blocks(file_descriptor *descriptor) {
+        for (auto &run : descriptor->extents) {
+            for (std::size_t i = 0; i < run.length; i++) {
+                set_block_state(run.start + i, false);
+                _bitmap.release(run.start + i);
             }
-        } else {
-            return false;
         }
+        if (descriptor->indirect != 0) {
+            set_block_state(descriptor->indirect, false);
+            _bitmap.release(descriptor->indirect);
+        }
+        descriptor->extents.clear();
+        descriptor->indirect = 0;
     }
 
-    bool file_system::allocate_block(file_descriptor *descriptor, std::size_t block_index) {
-        for (int i = constraints::descriptive_blocks_no; i < _io.get_blocks_no(); i++) {
-            if (!_bitmap[i]) {
-                _bitmap[i] = true;
-                descriptor->occupied_blocks[block_index] = i;
-                return true;
-            }
+    // blocks promised to write-behind buffers are reserved, so they are not counted
+    template <class Layout>
+    std::size_t basic_file_system<Layout>::free_blocks_no() const {
+        return _bitmap.count_free();
+    }
+
+    // in-memory bitmap is changed by the caller; its on-disk copy is journaled like other metadata.
+    // Bits of one byte may belong to blocks of different threads, so the byte is changed atomically
+    template <class Layout>
+    void basic_file_system<Layout>::set_block_state(std::size_t block, bool occupied) {
+        const auto block_i = _bitmap_start + _layout.block_of(block / 8);
+        const auto byte = _layout.offset_in_block(block / 8);
+        auto bitmap_block = _io->acquire(block_i);
+        std::atomic_ref<unsigned char> bits{*reinterpret_cast<unsigned char *>(&bitmap_block[byte])};
+        auto mask = (unsigned char) (1u << (7 - (block % 8)));
+        occupied ? bits.fetch_or(mask) : bits.fetch_and((unsigned char) ~mask);
+        bitmap_block.mark_dirty();
+        log_metadata(block_i, byte, 1);
+    }
+
+    template <class Layout>
+    void basic_file_system<Layout>::log_metadata(std::size_t block, std::size_t offset, std::size_t length) {
+        if (_journal) {
+            _journal->log(block, offset, length);
         }
-        return false;
     }
 
     // the only function that explicitly changes current block 
-    auto file_system::initialize_oft_entry(oft_entry* oft, std::size_t block) -> fs_result {
-        auto descriptor = _descriptors_cache[oft->get_descriptor_index()];
+    template <class Layout>
+    auto basic_file_system<Layout>::initialize_oft_entry(oft_entry* oft, std::size_t block) -> fs_result {
+        auto descriptor = oft->get_descriptor();
 
         if (!oft->initialized || oft->current_block != block) {
-            if (descriptor->is_initialized()) {
-                if (descriptor->occupied_blocks[block] != 0) {
-                    if (oft->modified) {
-                        save_block(oft, oft->current_block);
-                    }
-                    _io.read_block(descriptor->occupied_blocks[block], oft->buffer.begin());
-                    oft->modified = false;                   
+            if (auto disk_block = descriptor->block(block); disk_block != 0) {
+                if (oft->modified) {
+                    save_block(oft);
+                }
+                // block allocated ahead by write holds no file data yet
+                if (block >= _layout.block_of(descriptor->length + _layout.block_size() - 1)) {
+                    acquire_empty_block(oft, disk_block);
                 } else {
-                    if(!allocate_block(descriptor, block)) {
-                        return NO_BLOCK;
+                    oft->block = _io->acquire(disk_block);
+                    if (oft->block.failed()) {
+                        oft->block.release();
+                        oft->initialized = false;
+                        return FAIL;
                     }
-
-                    // doesn't save if there was an error
-                    if (oft->modified) {
-                        save_block(oft, oft->current_block);
-                    }
-                    save_descriptor(oft->get_descriptor_index(), descriptor);
-                    oft->buffer = std::vector<std::byte>(_io.get_block_size(), std::byte{0});
                 }
+                oft->modified = false;
             } else {
-                if (auto res = initialize_file_descriptor(descriptor, block); res != SUCCESS) {
-                    save_descriptor(oft->get_descriptor_index(), descriptor);
+                // files grow block by block, so only the block after the last one may be missing
+                assert(block == descriptor->blocks_no());
+                if (auto res = allocate_run(descriptor, 1).second; res != SUCCESS) {
                     return res;
                 }
-                oft->buffer = std::vector<std::byte>(_io.get_block_size(), std::byte{0});
+
+                // doesn't save if there was an error
+                if (oft->modified) {
+                    save_block(oft);
+                }
+                save_descriptor(oft->get_descriptor_index(), descriptor);
+                acquire_empty_block(oft, descriptor->block(block));
             }
             oft->initialized = true;
             oft->current_block = block;
@@ -275,51 +538,19 @@ namespace lab_fs {
         return SUCCESS;
     }
 
-    fs_result file_system::initialize_file_descriptor(file_descriptor* descriptor, std::size_t block) {
-        if (allocate_block(descriptor, 0)) {
-            for (int i = 1; i < constraints::max_blocks_per_file; i++) {
-                descriptor->occupied_blocks[i] = 0;
-            }
-        } else {
-            return NO_BLOCK;
-        }
-        return SUCCESS;
+    // freshly allocated block may hold data of a destroyed file
+    template <class Layout>
+    void basic_file_system<Layout>::acquire_empty_block(oft_entry *entry, std::size_t block) {
+        entry->block = _io->acquire(block);
+        std::fill(entry->block.data().begin(), entry->block.data().end(), std::byte{0});
     }
 
-    void file_system::save_block(oft_entry *entry, std::size_t block) {
-        auto descriptor = _descriptors_cache[entry->get_descriptor_index()];
-        _io.write_block(descriptor->occupied_blocks[block], entry->buffer.begin());
+    template <class Layout>
+    void basic_file_system<Layout>::save_block(oft_entry *entry) {
+        entry->block.mark_dirty();
+        entry->block.release();
         entry->modified = false;
         entry->initialized = false;
     }
 
-    fs_result file_system::overwrite_dir_entry(const std::string &filename) {
-        int dir_entry_index = -1;
-        std::size_t last_index = 0;
-        for (; ; last_index++) {
-            auto entry = utils::dir_entry::read_dir_entry(this, last_index);
-            if (!entry.has_value()) {
-                break;
-            } else if (entry.value().filename == filename) {
-                dir_entry_index = last_index;
-            }
-        }
-
-        if (last_index == 0 || dir_entry_index == -1)
-            return NOT_FOUND;
-        --last_index;
-
-        auto last_entry = utils::dir_entry::read_dir_entry(this, last_index);
-
-        if (!save_dir_entry(dir_entry_index, last_entry->filename, static_cast<size_t>(last_entry->descriptor_index))) {
-            return FAIL;
-        }
-
-        if (!save_dir_entry(last_index, "", 0)) {
-            return FAIL;
-        }
-
-        return SUCCESS;
-    }
-
 } //namespace lab_fs
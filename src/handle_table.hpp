@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace lab_fs {
+    // objects addressed by handles: a handle is the index of its slot plus the generation of the slot
+    // times capacity; generation changes when the object is detached, so a stale handle never reaches
+    // the object taking the slot next. Freed slots are reused first; objects don't move, so they may be
+    // used after the table is unlocked. The caller synchronizes calls
+    template<class T>
+    class handle_table {
+    public:
+        static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+        explicit handle_table(std::size_t capacity) :
+                _capacity{capacity} {
+            assert(capacity > 0);
+        }
+
+        // returns handle of a new object, npos if every slot is taken
+        template<class... Args>
+        std::size_t emplace(Args &&... args) {
+            std::size_t index;
+            if (!_free.empty()) {
+                index = _free.back();
+                _free.pop_back();
+            } else if (_slots.size() < _capacity) {
+                index = _slots.size();
+                _slots.emplace_back();
+            } else {
+                return npos;
+            }
+            auto &slot = _slots[index];
+            slot.object.emplace(std::forward<Args>(args)...);
+            slot.attached = true;
+            return slot.generation * _capacity + index;
+        }
+
+        // object of a handle, nullptr if the handle is stale or was never given out
+        T *find(std::size_t handle) {
+            auto index = handle % _capacity;
+            if (index >= _slots.size()) {
+                return nullptr;
+            }
+            auto &slot = _slots[index];
+            return slot.attached && slot.generation == handle / _capacity ? &*slot.object : nullptr;
+        }
+
+        // handle stops reaching its object, which stays until it is released
+        T *detach(std::size_t handle) {
+            auto object = find(handle);
+            if (object) {
+                auto &slot = _slots[handle % _capacity];
+                slot.attached = false;
+                slot.generation++;
+            }
+            return object;
+        }
+
+        // destroys object of a detached handle and frees its slot
+        void release(std::size_t handle) {
+            auto index = handle % _capacity;
+            assert(index < _slots.size() && !_slots[index].attached && "Handle is not detached");
+            _slots[index].object.reset();
+            _free.push_back(index);
+        }
+
+        [[nodiscard]] bool full() const {
+            return _free.empty() && _slots.size() == _capacity;
+        }
+
+        [[nodiscard]] std::size_t capacity() const {
+            return _capacity;
+        }
+
+    private:
+        struct slot {
+            std::optional<T> object;
+            std::size_t generation = 0;
+            bool attached = false;
+        };
+
+        std::size_t _capacity;
+        std::deque<slot> _slots;
+        std::vector<std::size_t> _free;
+    };
+
+} //namespace lab_fs
@@ -1,25 +1,145 @@
 #pragma once
 
+#include <atomic>
+#include <bit>
 #include <cstdint>
+#include <cstring>
+#include <memory>
 #include <vector>
+#include <string>
+#include <span>
+#include <utility>
+#include <algorithm>
 #include <cassert>
 
 namespace lab_fs {
+    enum class io_engine {
+        MEMORY, FILE, MMAP, ASYNC
+    };
+
+    // images a volume is striped over and blocks in one stripe unit; one member means a plain image
+    struct volume_geometry {
+        std::size_t members_no = 1;
+        std::size_t stripe_blocks = 8;
+    };
+
+    class block_handle;
+
+    // read or write of a run of blocks starting at `block`; size of data is a multiple of block size
+    struct block_transfer {
+        std::size_t block;
+        std::span<std::byte> data;
+        bool write;
+    };
+
+    struct flush_stats {
+        std::size_t blocks = 0;
+        std::size_t bytes = 0;
+        bool failed = false; // some blocks could not be written
+    };
+
+    // block device interface; engines differ only in where blocks live. Transfers return false
+    // if the device failed to move some of their bytes
     class io {
     public:
-        io(std::size_t blocks_no, std::size_t block_size, std::vector<std::vector<std::byte>> &&disk) :
+        io(std::size_t blocks_no, std::size_t block_size) :
                 _blocks_no{blocks_no},
                 _block_size{block_size},
-                _ldisk{disk} {}
+                _block_shift{(std::size_t) std::countr_zero(block_size)},
+                _block_mask{std::has_single_bit(block_size) ? block_size - 1 : 0} {
+            assert(block_size % 2 == 0 && "block size should be even");
+        }
 
-        void read_block(std::size_t i, std::vector<std::byte>::iterator dest) {
-            assert(i < _blocks_no);
-            std::copy(_ldisk[i].cbegin(), _ldisk[i].cend(), dest);
+        io(const io &) = delete;
+
+        io &operator=(const io &) = delete;
+
+        virtual ~io() = default;
+
+        // dest and src hold at least one block
+        virtual bool read_block(std::size_t i, std::span<std::byte> dest) {
+            auto block = pin(i);
+            std::memcpy(dest.data(), block.data(), _block_size);
+            bool res = !load_failed(i);
+            unpin(i, false);
+            return res;
         }
 
-        void write_block(std::size_t i, std::vector<std::byte>::iterator src) {
-            assert(i < _blocks_no);
-            std::copy(src, src + (int) _block_size, _ldisk[i].begin());
+        virtual bool write_block(std::size_t i, std::span<const std::byte> src) {
+            auto block = pin(i);
+            std::memcpy(block.data(), src.data(), _block_size);
+            unpin(i, true);
+            return true;
+        }
+
+        // run of consecutive blocks starting at i; size of dest and src is a multiple of block size
+        virtual bool read_blocks(std::size_t i, std::span<std::byte> dest) {
+            bool res = true;
+            for (std::size_t k = 0; k < block_of(dest.size()); k++) {
+                res &= read_block(i + k, dest.subspan(k * _block_size, _block_size));
+            }
+            return res;
+        }
+
+        virtual bool write_blocks(std::size_t i, std::span<const std::byte> src) {
+            bool res = true;
+            for (std::size_t k = 0; k < block_of(src.size()); k++) {
+                res &= write_block(i + k, src.subspan(k * _block_size, _block_size));
+            }
+            return res;
+        }
+
+        // batch of transfers of distinct runs; devices which can keep them in flight at once do so.
+        // Returns once every transfer is done
+        virtual bool transfer(std::span<const block_transfer> batch) {
+            bool res = true;
+            for (auto &run : batch) {
+                res &= run.write ? write_blocks(run.block, run.data) : read_blocks(run.block, run.data);
+            }
+            return res;
+        }
+
+        bool read_block(std::size_t i, std::vector<std::byte>::iterator dest) {
+            return read_block(i, std::span<std::byte>{std::to_address(dest), _block_size});
+        }
+
+        bool write_block(std::size_t i, std::vector<std::byte>::iterator src) {
+            return write_block(i, std::span<const std::byte>{std::to_address(src), _block_size});
+        }
+
+        // hints that a run of blocks will be read soon; returns true if device starts reading it
+        // in the background, so the hint alone is enough to have it ready
+        virtual bool will_need(std::size_t /*i*/, std::size_t /*n*/) {
+            return false;
+        }
+
+        // pins block i and gives access to it in place; pair with unpin
+        virtual std::span<std::byte> pin(std::size_t i) = 0;
+
+        // releases pin taken by pin(i); dirty block is written back once its last pin is released
+        virtual void unpin(std::size_t i, bool dirty) = 0;
+
+        // true if pinned block i could not be read from the device, its data is zeros then
+        [[nodiscard]] virtual bool load_failed(std::size_t /*i*/) {
+            return false;
+        }
+
+        block_handle acquire(std::size_t i);
+
+        // makes blocks written since the last sync durable in the backing file, writing only those;
+        // returns false if device is not backed by a file
+        virtual bool sync(flush_stats &/*stats*/) {
+            return false;
+        }
+
+        // true if blocks are kept in process memory, so access never waits for the device
+        [[nodiscard]] virtual bool is_in_memory() const {
+            return false;
+        }
+
+        // true if sync persists image to `path`
+        [[nodiscard]] virtual bool is_backed_by(const std::string &/*path*/) const {
+            return false;
         }
 
         [[nodiscard]] std::size_t get_blocks_no() const {
@@ -30,88 +150,185 @@ namespace lab_fs {
             return _block_size;
         }
 
-    private:
+        // block holding byte `pos` of consecutive blocks and offset of the byte within it;
+        // these are a shift and a mask for blocks of a power of 2, which v2 images always have;
+        // v1 images may have any even block size
+        [[nodiscard]] std::size_t block_of(std::size_t pos) const {
+            return _block_mask ? pos >> _block_shift : pos / _block_size;
+        }
+
+        [[nodiscard]] std::size_t offset_in_block(std::size_t pos) const {
+            return _block_mask ? pos & _block_mask : pos % _block_size;
+        }
+
+    protected:
         std::size_t _blocks_no;
         std::size_t _block_size;
-
-        std::vector<std::vector<std::byte>> _ldisk;
+        std::size_t _block_shift;
+        std::size_t _block_mask; // 0 if block size is not a power of 2
     };
 
-    namespace utils {
-        class disk_view {
-        public:
-            explicit disk_view(io &disk_io, std::uint8_t start_block = 0, bool write_enabled = true) :
-                    _io{disk_io},
-                    _block_i{start_block},
-                    _start_block{start_block},
-                    _write_enabled{write_enabled} {
-                _buffer.resize(_io.get_block_size());
-                _io.read_block(_block_i, _buffer.begin());
-            }
+    // RAII pin of one device block; changes made through it must be marked with mark_dirty
+    class block_handle {
+    public:
+        block_handle() = default;
 
-            std::byte &operator [](std::size_t index) {
-                std::size_t queried_block_i = _start_block + index / _io.get_block_size();
-                assert(queried_block_i < _io.get_blocks_no() && "Out of range");
-                std::size_t local_index = index % _io.get_block_size();
+        block_handle(io &device, std::size_t i) :
+                _io{&device},
+                _index{i},
+                _data{device.pin(i)},
+                _failed{device.load_failed(i)} {}
 
-                if (queried_block_i == _block_i) {
-                    return _buffer[local_index];
-                }
+        block_handle(const block_handle &) = delete;
 
-                if (queried_block_i == _block_i - 1 && _block_i != 0 && !_prev_buffer.empty()) {
-                    return _prev_buffer[local_index];
-                }
+        block_handle(block_handle &&other) noexcept :
+                _io{std::exchange(other._io, nullptr)},
+                _index{other._index},
+                _data{other._data},
+                _failed{other._failed},
+                _dirty{std::exchange(other._dirty, false)} {}
 
-                if (!_prev_buffer.empty() && _write_enabled) {
-                    _io.write_block(_block_i - 1, _prev_buffer.begin());
-                }
+        block_handle &operator=(const block_handle &) = delete;
 
-                if (queried_block_i == _block_i + 1) {
-                    _prev_buffer = std::move(_buffer);
-                    _buffer.resize(_io.get_block_size());
-                } else {
-                    if (_write_enabled) {
-                        _io.write_block(_block_i, _buffer.begin());
-                    }
-                    _prev_buffer.clear();
-                }
+        block_handle &operator=(block_handle &&other) noexcept {
+            if (this != &other) {
+                release();
+                _io = std::exchange(other._io, nullptr);
+                _index = other._index;
+                _data = other._data;
+                _failed = other._failed;
+                _dirty = std::exchange(other._dirty, false);
+            }
+            return *this;
+        }
 
-                _block_i = queried_block_i;
-                _io.read_block(_block_i, _buffer.begin());
+        ~block_handle() {
+            release();
+        }
 
-                return _buffer[local_index];
+        void release() {
+            if (_io) {
+                _io->unpin(_index, _dirty);
+                _io = nullptr;
+                _dirty = false;
             }
+        }
 
-            void push_buffer() {
-                if (!_buffer.empty()) {
-                    _io.write_block(_block_i, _buffer.begin());
-                }
+        void mark_dirty() {
+            _dirty = true;
+        }
+
+        [[nodiscard]] std::span<std::byte> data() const {
+            return _data;
+        }
+
+        std::byte &operator [](std::size_t i) const {
+            return _data[i];
+        }
+
+        [[nodiscard]] std::size_t index() const {
+            return _index;
+        }
+
+        // block couldn't be read from the device, so its data is not what the device holds
+        [[nodiscard]] bool failed() const {
+            return _failed;
+        }
+
+        explicit operator bool() const {
+            return _io != nullptr;
+        }
+
+    private:
+        io *_io = nullptr;
+        std::size_t _index = 0;
+        std::span<std::byte> _data;
+        bool _failed = false;
+        bool _dirty = false;
+    };
+
+    inline block_handle io::acquire(std::size_t i) {
+        return block_handle{*this, i};
+    }
+
+    namespace utils {
+        // blocks written since the last sync; transfers of several threads mark blocks at once, so bits are atomic
+        class dirty_blocks {
+        public:
+            explicit dirty_blocks(std::size_t blocks_no) :
+                    _words((blocks_no + 63) / 64) {}
 
-                if (!_prev_buffer.empty()) {
-                    _io.write_block(_block_i - 1, _prev_buffer.begin());
+            void mark(std::size_t i, std::size_t n = 1) {
+                for (auto k = i; k < i + n; k++) {
+                    _words[k / 64].fetch_or(bit(k), std::memory_order_relaxed);
                 }
             }
 
-            [[maybe_unused]] void enable_write() {
-                _write_enabled = true;
+            // clears the mark of block i, returns true if it was set
+            bool take(std::size_t i) {
+                return _words[i / 64].fetch_and(~bit(i), std::memory_order_relaxed) & bit(i);
             }
 
-            [[maybe_unused]] void disable_write() {
-                _write_enabled = false;
+        private:
+            static std::uint64_t bit(std::size_t i) {
+                return std::uint64_t{1} << (i % 64);
             }
 
-            [[nodiscard]] std::uint8_t block_i() const {
-                return _block_i;
+            std::vector<std::atomic<std::uint64_t>> _words;
+        };
+    } //namespace utils
+
+    // whole image is kept in process memory; sync writes changed blocks back to the image file
+    class memory_io : public io {
+    public:
+        memory_io(std::size_t blocks_no, std::size_t block_size, std::string path = "") :
+                io{blocks_no, block_size},
+                _ldisk(blocks_no * block_size, std::byte{0}),
+                _dirty{blocks_no},
+                _path{std::move(path)} {}
+
+        std::span<std::byte> pin(std::size_t i) override {
+            assert(i < _blocks_no);
+            return {_ldisk.data() + i * _block_size, _block_size};
+        }
+
+        void unpin(std::size_t i, bool dirty) override {
+            if (dirty) {
+                _dirty.mark(i);
             }
+        }
 
-        private:
-            io &_io;
-            std::uint8_t _block_i;
-            std::uint8_t _start_block;
-            std::vector<std::byte> _buffer;
-            std::vector<std::byte> _prev_buffer;
-            bool _write_enabled;
-        };
+        bool sync(flush_stats &stats) override;
+
+        [[nodiscard]] bool is_in_memory() const override {
+            return true;
+        }
+
+        [[nodiscard]] bool is_backed_by(const std::string &path) const override {
+            return !_path.empty() && _path == path;
+        }
+
+    private:
+        std::vector<std::byte> _ldisk;
+        utils::dirty_blocks _dirty;
+        std::string _path;
+    };
+
+    namespace utils {
+        // multi-byte values are stored little-endian on disk
+        inline std::uint64_t load_le(std::span<const std::byte> bytes, std::size_t pos, std::size_t width) {
+            std::uint64_t value = 0;
+            for (std::size_t i = 0; i < width; i++) {
+                value |= std::to_integer<std::uint64_t>(bytes[pos + i]) << (8 * i);
+            }
+            return value;
+        }
+
+        inline void store_le(std::span<std::byte> bytes, std::size_t pos, std::size_t width, std::uint64_t value) {
+            for (std::size_t i = 0; i < width; i++, value >>= 8) {
+                bytes[pos + i] = std::byte{(std::uint8_t) (value & 0xFF)};
+            }
+        }
     } //namespace utils
 
-} //namespace lab_fs
\ No newline at end of file
+} //namespace lab_fs
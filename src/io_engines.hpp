@@ -0,0 +1,438 @@
+#pragma once
+
+#include <io.hpp>
+#include <io_queue.hpp>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace lab_fs {
+    namespace utils {
+        // opens (or creates) image file and extends it with zeros up to `length` bytes;
+        // `created` is set if the file had no content before
+        inline int open_image(const std::string &path, std::size_t length, bool &created) {
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd == -1) {
+                return -1;
+            }
+
+            struct stat st{};
+            if (fstat(fd, &st) == -1 || ((std::size_t) st.st_size < length && ftruncate(fd, (off_t) length) == -1)) {
+                ::close(fd);
+                return -1;
+            }
+            created = st.st_size == 0;
+            return fd;
+        }
+    } //namespace utils
+
+    // blocks are read and written in place with positional syscalls;
+    // only pinned blocks are kept in memory, in staging buffers written back on last unpin.
+    // A staged block whose write-back failed stays staged until sync manages to write it.
+    // Transfers may come from several threads at once, staging buffers are kept under a lock
+    class file_io : public io {
+    public:
+        file_io(std::size_t blocks_no, std::size_t block_size, int fd, std::string path) :
+                io{blocks_no, block_size},
+                _fd{fd},
+                _dirty{blocks_no},
+                _path{std::move(path)} {}
+
+        ~file_io() override {
+            ::close(_fd);
+        }
+
+        using io::read_block;
+        using io::write_block;
+
+        bool read_block(std::size_t i, std::span<std::byte> dest) override {
+            assert(i < _blocks_no);
+            {
+                std::lock_guard lock{_staged_lock};
+                if (auto it = _staged.find(i); it != _staged.end()) {
+                    std::memcpy(dest.data(), it->second.data.data(), _block_size);
+                    return !it->second.failed;
+                }
+            }
+            return move_run(false, i, dest.first(_block_size));
+        }
+
+        bool write_block(std::size_t i, std::span<const std::byte> src) override {
+            assert(i < _blocks_no);
+            std::unique_lock lock{_staged_lock};
+            auto it = _staged.find(i);
+            if (it == _staged.end()) {
+                lock.unlock();
+            } else {
+                std::memcpy(it->second.data.data(), src.data(), _block_size);
+                it->second.failed = false;
+            }
+            if (!move_run(true, i, writable(src.first(_block_size)))) {
+                // staged copy is newer now, it is written back on its last unpin or by sync
+                if (it != _staged.end()) {
+                    it->second.dirty = true;
+                }
+                return false;
+            }
+            _dirty.mark(i);
+            return true;
+        }
+
+        // kernel readahead fills page cache asynchronously
+        bool will_need(std::size_t i, std::size_t n) override {
+            return posix_fadvise(_fd, (off_t) (i * _block_size), (off_t) (n * _block_size), POSIX_FADV_WILLNEED) == 0;
+        }
+
+        // run is moved with one syscall unless some of its blocks are staged
+        bool read_blocks(std::size_t i, std::span<std::byte> dest) override {
+            auto n = block_of(dest.size());
+            assert(i + n <= _blocks_no);
+            if (is_staged(i, n)) {
+                return io::read_blocks(i, dest);
+            }
+            return move_run(false, i, dest);
+        }
+
+        bool write_blocks(std::size_t i, std::span<const std::byte> src) override {
+            auto n = block_of(src.size());
+            assert(i + n <= _blocks_no);
+            if (is_staged(i, n)) {
+                return io::write_blocks(i, src);
+            }
+            if (!move_run(true, i, writable(src))) {
+                return false;
+            }
+            _dirty.mark(i, n);
+            return true;
+        }
+
+        // block which can't be read is pinned as zeros and reported by load_failed
+        std::span<std::byte> pin(std::size_t i) override {
+            assert(i < _blocks_no);
+            std::lock_guard lock{_staged_lock};
+            auto [it, inserted] = _staged.try_emplace(i);
+            auto &block = it->second;
+            if (inserted) {
+                block.data.resize(_block_size);
+                if (!move_run(false, i, block.data)) {
+                    std::fill(block.data.begin(), block.data.end(), std::byte{0});
+                    block.failed = true;
+                }
+            }
+            block.pins++;
+            return block.data;
+        }
+
+        void unpin(std::size_t i, bool dirty) override {
+            std::lock_guard lock{_staged_lock};
+            auto it = _staged.find(i);
+            assert(it != _staged.end() && "Block is not pinned");
+            auto &block = it->second;
+            if (dirty) {
+                block.dirty = true;
+                block.failed = false;
+            }
+            if (--block.pins == 0 && (!block.dirty || write_back(i, block))) {
+                _staged.erase(it);
+            }
+        }
+
+        [[nodiscard]] bool load_failed(std::size_t i) override {
+            std::lock_guard lock{_staged_lock};
+            auto it = _staged.find(i);
+            return it != _staged.end() && it->second.failed;
+        }
+
+        // blocks are already written in place, except those whose write-back failed
+        bool sync(flush_stats &stats) override {
+            std::unique_lock lock{_staged_lock};
+            bool res = true;
+            for (auto it = _staged.begin(); it != _staged.end();) {
+                if (it->second.pins == 0 && it->second.dirty) {
+                    if (!write_back(it->first, it->second)) {
+                        res = false;
+                        ++it;
+                        continue;
+                    }
+                    it = _staged.erase(it);
+                    continue;
+                }
+                ++it;
+            }
+            lock.unlock();
+
+            for (std::size_t i = 0; i < _blocks_no; i++) {
+                if (_dirty.take(i)) {
+                    stats.blocks++;
+                    stats.bytes += _block_size;
+                }
+            }
+            stats.failed |= !res;
+            return fsync(_fd) == 0 && res;
+        }
+
+        [[nodiscard]] bool is_backed_by(const std::string &path) const override {
+            return _path == path;
+        }
+
+    protected:
+        struct staged_block {
+            std::vector<std::byte> data;
+            std::size_t pins = 0;
+            bool dirty = false;
+            bool failed = false; // data couldn't be read and is zeros
+        };
+
+        [[nodiscard]] bool is_staged(std::size_t i, std::size_t n) const {
+            std::lock_guard lock{_staged_lock};
+            auto it = _staged.lower_bound(i);
+            return it != _staged.end() && it->first < i + n;
+        }
+
+        // moves run starting at block i, retrying short and interrupted transfers
+        bool move_run(bool write, std::size_t i, std::span<std::byte> data) {
+            return utils::transfer_all(_fd, {write, i * _block_size, data, nullptr});
+        }
+
+        bool write_back(std::size_t i, staged_block &block) {
+            if (!move_run(true, i, block.data)) {
+                return false;
+            }
+            block.dirty = false;
+            _dirty.mark(i);
+            return true;
+        }
+
+        // transfers only read from data of a write
+        static std::span<std::byte> writable(std::span<const std::byte> src) {
+            return {const_cast<std::byte *>(src.data()), src.size()};
+        }
+
+        int _fd;
+        utils::dirty_blocks _dirty;
+        std::string _path;
+        std::map<std::size_t, staged_block> _staged;
+        mutable std::mutex _staged_lock;
+    };
+
+    // file_io whose batches of transfers are kept in flight at once on an io_uring or thread pool queue,
+    // so write-back of many dirty blocks and readahead don't wait for each block in turn.
+    // The queue serves one batch at a time, batches of other threads wait for it
+    class async_io : public file_io {
+    public:
+        async_io(std::size_t blocks_no, std::size_t block_size, int fd, std::string path) :
+                file_io{blocks_no, block_size, fd, std::move(path)},
+                _queue{make_io_queue(fd)} {}
+
+        // staged blocks are newer than the file, such batches are moved one run at a time;
+        // written runs are counted for sync only if their write completed
+        bool transfer(std::span<const block_transfer> batch) override {
+            for (auto &run : batch) {
+                if (is_staged(run.block, block_of(run.data.size()))) {
+                    return io::transfer(batch);
+                }
+            }
+
+            std::lock_guard lock{_queue_lock};
+            for (auto &run : batch) {
+                assert(run.block + block_of(run.data.size()) <= _blocks_no);
+                std::function<void(bool)> done;
+                if (run.write) {
+                    done = [this, &run](bool ok) {
+                        if (ok) {
+                            _dirty.mark(run.block, block_of(run.data.size()));
+                        }
+                    };
+                }
+                _queue->push({run.write, run.block * _block_size, run.data, std::move(done)});
+            }
+            _queue->submit();
+            return _queue->wait();
+        }
+
+    private:
+        std::unique_ptr<io_queue> _queue;
+        std::mutex _queue_lock;
+    };
+
+    // image file is mapped into memory, so blocks are accessed straight through the page cache
+    class mmap_io : public io {
+    public:
+        mmap_io(std::size_t blocks_no, std::size_t block_size, int fd, std::byte *data, std::string path) :
+                io{blocks_no, block_size},
+                _fd{fd},
+                _data{data},
+                _dirty{blocks_no},
+                _path{std::move(path)} {}
+
+        ~mmap_io() override {
+            munmap(_data, _blocks_no * _block_size);
+            ::close(_fd);
+        }
+
+        std::span<std::byte> pin(std::size_t i) override {
+            assert(i < _blocks_no);
+            return {_data + i * _block_size, _block_size};
+        }
+
+        void unpin(std::size_t i, bool dirty) override {
+            if (dirty) {
+                _dirty.mark(i);
+            }
+        }
+
+        bool will_need(std::size_t i, std::size_t n) override {
+            // madvise requires page-aligned address
+            const auto page_size = (std::size_t) sysconf(_SC_PAGESIZE);
+            std::size_t begin = i * _block_size / page_size * page_size;
+            return madvise(_data + begin, (i + n) * _block_size - begin, MADV_WILLNEED) == 0;
+        }
+
+        // flushes only page ranges of blocks written since the last sync
+        bool sync(flush_stats &stats) override {
+            const auto page_size = (std::size_t) sysconf(_SC_PAGESIZE);
+            for (std::size_t i = 0; i < _blocks_no; i++) {
+                if (!_dirty.take(i)) {
+                    continue;
+                }
+
+                std::size_t j = i + 1;
+                while (j < _blocks_no && _dirty.take(j)) {
+                    j++;
+                }
+                stats.blocks += j - i;
+                stats.bytes += (j - i) * _block_size;
+
+                // msync requires page-aligned address
+                std::size_t begin = i * _block_size / page_size * page_size;
+                std::size_t end = j * _block_size;
+                if (msync(_data + begin, end - begin, MS_SYNC) == -1) {
+                    stats.failed = true;
+                    return false;
+                }
+                i = j;
+            }
+            return true;
+        }
+
+        [[nodiscard]] bool is_backed_by(const std::string &path) const override {
+            return _path == path;
+        }
+
+    private:
+        int _fd;
+        std::byte *_data;
+        utils::dirty_blocks _dirty;
+        std::string _path;
+    };
+
+    inline bool memory_io::sync(flush_stats &stats) {
+        if (_path.empty()) {
+            return false;
+        }
+
+        bool created = false;
+        int fd = utils::open_image(_path, _ldisk.size(), created);
+        if (fd == -1) {
+            return false;
+        }
+
+        // runs of changed blocks are written at once; a run is marked dirty again unless its write completes
+        auto queue = make_io_queue(fd);
+        for (std::size_t i = 0; i < _blocks_no; i++) {
+            if (!_dirty.take(i)) {
+                continue;
+            }
+            std::size_t j = i + 1;
+            while (j < _blocks_no && _dirty.take(j)) {
+                j++;
+            }
+            std::span<std::byte> run{_ldisk.data() + i * _block_size, (j - i) * _block_size};
+            queue->push({true, i * _block_size, run, [this, &stats, i, j](bool ok) {
+                if (!ok) {
+                    _dirty.mark(i, j - i);
+                    return;
+                }
+                stats.blocks += j - i;
+                stats.bytes += (j - i) * _block_size;
+            }});
+            i = j;
+        }
+        queue->submit();
+        bool res = queue->wait();
+        queue.reset();
+
+        stats.failed |= !res;
+        res = fsync(fd) == 0 && res;
+        ::close(fd);
+        return res;
+    }
+
+    // creates device of requested engine for image at `path`;
+    // returns nullptr if image could not be opened
+    inline std::unique_ptr<io> open_io(io_engine engine, const std::string &path,
+                                       std::size_t blocks_no, std::size_t block_size, bool &created) {
+        const std::size_t length = blocks_no * block_size;
+
+        if (engine == io_engine::MEMORY) {
+            auto disk_io = std::make_unique<memory_io>(blocks_no, block_size, path);
+            int fd = ::open(path.c_str(), O_RDONLY);
+            struct stat st{};
+            created = fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0;
+            if (!created) {
+                std::vector<std::byte> block(block_size);
+                for (std::size_t i = 0; i < blocks_no; i++) {
+                    // missing tail of a short image reads as zeros
+                    std::fill(block.begin(), block.end(), std::byte{0});
+                    ssize_t res;
+                    do {
+                        res = pread(fd, block.data(), block_size, (off_t) (i * block_size));
+                    } while (res == -1 && errno == EINTR);
+                    if (res == -1) {
+                        ::close(fd);
+                        return nullptr;
+                    }
+                    if (res == 0) {
+                        break;
+                    }
+                    auto stored = disk_io->pin(i);
+                    std::copy(block.begin(), block.end(), stored.begin());
+                    disk_io->unpin(i, false);
+                }
+            }
+            if (fd != -1) {
+                ::close(fd);
+            }
+            return disk_io;
+        }
+
+        int fd = utils::open_image(path, length, created);
+        if (fd == -1) {
+            return nullptr;
+        }
+
+        if (engine == io_engine::FILE) {
+            return std::make_unique<file_io>(blocks_no, block_size, fd, path);
+        }
+        if (engine == io_engine::ASYNC) {
+            return std::make_unique<async_io>(blocks_no, block_size, fd, path);
+        }
+
+        void *data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            return nullptr;
+        }
+        return std::make_unique<mmap_io>(blocks_no, block_size, fd, static_cast<std::byte *>(data), path);
+    }
+
+} //namespace lab_fs
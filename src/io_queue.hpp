@@ -0,0 +1,418 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace lab_fs {
+    // read or write of consecutive bytes of a file; data must stay valid until the request completes
+    struct io_op {
+        bool write = false;
+        std::size_t offset = 0;
+        std::span<std::byte> data;
+        std::function<void(bool)> done; // called on completion, argument tells if every byte was moved
+    };
+
+    namespace utils {
+        // moves the whole request with positional syscalls, retrying short transfers
+        inline bool transfer_all(int fd, const io_op &request) {
+            std::size_t moved = 0;
+            while (moved < request.data.size()) {
+                auto ptr = request.data.data() + moved;
+                auto size = request.data.size() - moved;
+                auto offset = (off_t) (request.offset + moved);
+                auto res = request.write ? pwrite(fd, ptr, size, offset) : pread(fd, ptr, size, offset);
+                if (res == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (res <= 0) {
+                    return false;
+                }
+                moved += (std::size_t) res;
+            }
+            return true;
+        }
+    } //namespace utils
+
+    // asynchronous I/O on one file: requests are queued with push, issued together by submit and run
+    // in the background; callbacks of completed requests are called by wait in the waiting thread.
+    // A queue is used by one thread at a time
+    class io_queue {
+    public:
+        // requests kept in flight at once
+        static constexpr unsigned default_depth = 64;
+
+        explicit io_queue(int fd) :
+                _fd{fd} {}
+
+        io_queue(const io_queue &) = delete;
+
+        io_queue &operator=(const io_queue &) = delete;
+
+        virtual ~io_queue() = default;
+
+        void push(io_op request) {
+            _submissions.push_back(std::move(request));
+        }
+
+        // issues every queued request
+        virtual void submit() = 0;
+
+        // waits for every issued request and calls their callbacks; returns false if any of them failed
+        bool wait() {
+            wait_all();
+            bool res = true;
+            for (auto &[request, ok] : _completions) {
+                res &= ok;
+                if (request.done) {
+                    request.done(ok);
+                }
+            }
+            _completions.clear();
+            return res;
+        }
+
+        [[nodiscard]] virtual const char *name() const = 0;
+
+    protected:
+        // moves every issued request to _completions once it is done
+        virtual void wait_all() = 0;
+
+        int _fd;
+        std::vector<io_op> _submissions;
+        std::vector<std::pair<io_op, bool>> _completions;
+    };
+
+    // io_uring rings set up with raw syscalls: requests are put to the submission ring and handed
+    // to the kernel with one io_uring_enter per batch, results are taken from the completion ring
+    class uring_queue : public io_queue {
+    public:
+        // returns nullptr if the kernel has no io_uring or it is not permitted
+        static std::unique_ptr<uring_queue> create(int fd, unsigned depth = default_depth) {
+            io_uring_params params{};
+            int ring_fd = (int) syscall(__NR_io_uring_setup, depth, &params);
+            if (ring_fd < 0) {
+                return nullptr;
+            }
+            std::unique_ptr<uring_queue> queue{new uring_queue{fd, ring_fd, params}};
+            if (!queue->_sqes) {
+                return nullptr;
+            }
+            return queue;
+        }
+
+        ~uring_queue() override {
+            if (_sqes) {
+                munmap(_sqes, _sqes_size);
+            }
+            if (_cq_ring && _cq_ring != _sq_ring) {
+                munmap(_cq_ring, _cq_size);
+            }
+            if (_sq_ring) {
+                munmap(_sq_ring, _sq_size);
+            }
+            ::close(_ring_fd);
+        }
+
+        // requests past the free slots wait until earlier ones complete; once the ring fails,
+        // requests are not issued but fail at once
+        void submit() override {
+            std::size_t next = 0;
+            while (next < _submissions.size() && !_failed) {
+                unsigned batch = 0;
+                while (next < _submissions.size() && !_free.empty()) {
+                    prepare(std::move(_submissions[next++]));
+                    batch++;
+                }
+                if (enter(batch, 0) && next < _submissions.size()) {
+                    reap(true);
+                }
+            }
+            for (; next < _submissions.size(); next++) {
+                _completions.emplace_back(std::move(_submissions[next]), false);
+            }
+            _submissions.clear();
+        }
+
+        [[nodiscard]] const char *name() const override {
+            return "io_uring";
+        }
+
+    protected:
+        // short transfers are issued again for the rest of their bytes
+        void wait_all() override {
+            while (_in_flight > 0 || !_submissions.empty()) {
+                submit();
+                reap(true);
+            }
+        }
+
+    private:
+        struct slot {
+            io_op request;
+            iovec iov{};
+            bool in_flight = false;
+        };
+
+        uring_queue(int fd, int ring_fd, const io_uring_params &params) :
+                io_queue{fd},
+                _ring_fd{ring_fd},
+                _slots(params.sq_entries) {
+            _sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            _cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) {
+                _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+            }
+
+            _sq_ring = map(_sq_size, IORING_OFF_SQ_RING);
+            _cq_ring = single_mmap ? _sq_ring : map(_cq_size, IORING_OFF_CQ_RING);
+            if (!_sq_ring || !_cq_ring) {
+                return;
+            }
+            auto sqes = map(_sqes_size, IORING_OFF_SQES);
+            if (!sqes) {
+                return;
+            }
+            _sqes = static_cast<io_uring_sqe *>(sqes);
+
+            auto sq = static_cast<std::byte *>(_sq_ring);
+            _sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            _sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            _sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+            auto cq = static_cast<std::byte *>(_cq_ring);
+            _cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            _cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            _cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            _cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+            for (std::size_t i = 0; i < _slots.size(); i++) {
+                _free.push_back(_slots.size() - 1 - i);
+            }
+        }
+
+        void *map(std::size_t size, off_t offset) const {
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, offset);
+            return ptr == MAP_FAILED ? nullptr : ptr;
+        }
+
+        // fills next submission entry; there are as many slots as entries, so a free slot means a free entry
+        void prepare(io_op request) {
+            auto slot_i = _free.back();
+            _free.pop_back();
+            auto &slot = _slots[slot_i];
+            slot.request = std::move(request);
+            slot.iov = {slot.request.data.data(), slot.request.data.size()};
+            slot.in_flight = true;
+
+            auto tail = *_sq_tail;
+            auto index = tail & _sq_mask;
+            auto &sqe = _sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = slot.request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe.fd = _fd;
+            sqe.addr = reinterpret_cast<std::uint64_t>(&slot.iov);
+            sqe.len = 1;
+            sqe.off = slot.request.offset;
+            sqe.user_data = slot_i;
+            _sq_array[index] = index;
+            std::atomic_ref{*_sq_tail}.store(tail + 1, std::memory_order_release);
+            _in_flight++;
+        }
+
+        // hands `to_submit` new entries to the kernel, waiting for `min_complete` completions;
+        // returns false if the ring failed, every request in flight has failed then
+        bool enter(unsigned to_submit, unsigned min_complete) {
+            while (to_submit > 0 || min_complete > 0) {
+                auto flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0u;
+                auto res = syscall(__NR_io_uring_enter, _ring_fd, to_submit, min_complete, flags, nullptr, 0);
+                if (res < 0) {
+                    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                        fail_in_flight();
+                        return false;
+                    }
+                    // interrupted or out of kernel resources, completions make room
+                    if (errno != EINTR && _in_flight > to_submit) {
+                        reap(false);
+                    }
+                    continue;
+                }
+                to_submit -= (unsigned) res;
+                min_complete = 0;
+            }
+            return true;
+        }
+
+        // ring which can't be entered will not complete anything, so it isn't entered again
+        // and its requests fail instead of being waited for
+        void fail_in_flight() {
+            _failed = true;
+            for (std::size_t i = 0; i < _slots.size(); i++) {
+                if (_slots[i].in_flight) {
+                    complete(i, -EIO);
+                }
+            }
+        }
+
+        // takes completed entries from the completion ring, waiting for one if `block` is set
+        void reap(bool block) {
+            while (_in_flight > 0) {
+                auto head = *_cq_head;
+                auto tail = std::atomic_ref{*_cq_tail}.load(std::memory_order_acquire);
+                if (head == tail) {
+                    if (!block || !enter(0, 1)) {
+                        return;
+                    }
+                    continue;
+                }
+                for (; head != tail; head++) {
+                    auto &cqe = _cqes[head & _cq_mask];
+                    complete(cqe.user_data, cqe.res);
+                }
+                std::atomic_ref{*_cq_head}.store(head, std::memory_order_release);
+                return;
+            }
+        }
+
+        void complete(std::size_t slot_i, int res) {
+            auto request = std::move(_slots[slot_i].request);
+            _slots[slot_i].in_flight = false;
+            _free.push_back(slot_i);
+            _in_flight--;
+            if (res > 0 && (std::size_t) res < request.data.size()) {
+                request.offset += (std::size_t) res;
+                request.data = request.data.subspan((std::size_t) res);
+                _submissions.push_back(std::move(request));
+                return;
+            }
+            bool ok = res > 0 || (res == 0 && request.data.empty());
+            _completions.emplace_back(std::move(request), ok);
+        }
+
+        int _ring_fd;
+        std::vector<slot> _slots;
+        std::vector<std::size_t> _free; // indices of slots not in flight
+        std::size_t _in_flight = 0;
+        bool _failed = false;
+
+        void *_sq_ring = nullptr;
+        void *_cq_ring = nullptr;
+        io_uring_sqe *_sqes = nullptr;
+        std::size_t _sq_size = 0;
+        std::size_t _cq_size = 0;
+        std::size_t _sqes_size = 0;
+        unsigned *_sq_tail = nullptr;
+        unsigned _sq_mask = 0;
+        unsigned *_sq_array = nullptr;
+        unsigned *_cq_head = nullptr;
+        unsigned *_cq_tail = nullptr;
+        unsigned _cq_mask = 0;
+        io_uring_cqe *_cqes = nullptr;
+    };
+
+    // fallback for kernels without io_uring: worker threads run requests with positional syscalls
+    class pool_queue : public io_queue {
+    public:
+        static constexpr std::size_t default_workers = 4;
+
+        explicit pool_queue(int fd, std::size_t workers = default_workers) :
+                io_queue{fd} {
+            for (std::size_t i = 0; i < workers; i++) {
+                _workers.emplace_back([this] { work(); });
+            }
+        }
+
+        ~pool_queue() override {
+            {
+                std::lock_guard lock{_mutex};
+                _stop = true;
+            }
+            _work_cv.notify_all();
+            for (auto &worker : _workers) {
+                worker.join();
+            }
+        }
+
+        void submit() override {
+            {
+                std::lock_guard lock{_mutex};
+                for (auto &request : _submissions) {
+                    _pending.push_back(std::move(request));
+                }
+                _in_flight += _submissions.size();
+            }
+            _submissions.clear();
+            _work_cv.notify_all();
+        }
+
+        [[nodiscard]] const char *name() const override {
+            return "thread pool";
+        }
+
+    protected:
+        void wait_all() override {
+            std::unique_lock lock{_mutex};
+            _done_cv.wait(lock, [this] { return _in_flight == 0; });
+            for (auto &completion : _done) {
+                _completions.push_back(std::move(completion));
+            }
+            _done.clear();
+        }
+
+    private:
+        void work() {
+            std::unique_lock lock{_mutex};
+            while (true) {
+                _work_cv.wait(lock, [this] { return _stop || !_pending.empty(); });
+                if (_pending.empty()) {
+                    return;
+                }
+                auto request = std::move(_pending.front());
+                _pending.pop_front();
+                lock.unlock();
+                bool ok = utils::transfer_all(_fd, request);
+                lock.lock();
+                _done.emplace_back(std::move(request), ok);
+                if (--_in_flight == 0) {
+                    _done_cv.notify_all();
+                }
+            }
+        }
+
+        std::vector<std::thread> _workers;
+        std::deque<io_op> _pending;
+        std::vector<std::pair<io_op, bool>> _done;
+        std::size_t _in_flight = 0;
+        bool _stop = false;
+        std::mutex _mutex;
+        std::condition_variable _work_cv;
+        std::condition_variable _done_cv;
+    };
+
+    // io_uring queue where the kernel allows it, thread pool otherwise
+    inline std::unique_ptr<io_queue> make_io_queue(int fd, unsigned depth = io_queue::default_depth) {
+        if (auto ring = uring_queue::create(fd, depth)) {
+            return ring;
+        }
+        return std::make_unique<pool_queue>(fd);
+    }
+
+} //namespace lab_fs
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <block_cache.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace lab_fs {
+    // write-ahead redo journal for metadata. Changed byte ranges of metadata blocks are collected
+    // into one transaction and committed as a group; until then the blocks are held in the cache,
+    // so their home locations never see uncommitted changes.
+    //
+    // operations of many threads share the transaction, which is committed only when none of them is
+    // in progress; once it is due, new operations wait for the running ones to end and for the commit.
+    // An operation must be entered before any lock of the file system is taken, or the wait would deadlock
+    //
+    // journal area layout: header {magic, sequence, records number, checksum} followed by records
+    // {block (4 bytes), offset (2 bytes), length (2 bytes), data}, all fields little-endian
+    class journal {
+    public:
+        struct stats {
+            std::size_t commits = 0;
+            std::size_t records = 0;
+            std::size_t bytes = 0;
+        };
+
+        // groups nested calls into one operation; transaction is committed only between operations
+        class operation {
+        public:
+            explicit operation(journal *owner) : _journal{owner} {
+                if (_journal) {
+                    _journal->enter();
+                }
+            }
+
+            operation(const operation &) = delete;
+
+            ~operation() {
+                if (_journal) {
+                    _journal->leave();
+                }
+            }
+
+        private:
+            journal *_journal;
+        };
+
+        static constexpr std::uint32_t anchor_magic = 0x4A53464C;  // "LFSJ"
+        static constexpr std::uint32_t header_magic = 0x314E524A;  // "JRN1"
+        static constexpr std::size_t anchor_size = 16;
+        static constexpr std::size_t header_size = 16;
+        static constexpr std::size_t record_header_size = 8;
+
+        journal(block_cache &cache, std::size_t start, std::size_t blocks_no, std::chrono::milliseconds commit_interval) :
+                _cache{cache},
+                _start{start},
+                _blocks_no{blocks_no},
+                _commit_interval{commit_interval} {}
+
+        // v1 images locate the journal by an anchor in the tail of the bitmap block, which bitmap never reaches;
+        // v2 ones record it in the superblock
+        static std::optional<std::pair<std::size_t, std::size_t>> read_anchor(std::span<const std::byte> block) {
+            auto anchor = block.last(anchor_size);
+            if (utils::load_le(anchor, 0, 4) != anchor_magic) {
+                return std::nullopt;
+            }
+            return std::pair{(std::size_t) utils::load_le(anchor, 4, 4), (std::size_t) utils::load_le(anchor, 8, 4)};
+        }
+
+        // applies last committed transaction left in journal area; returns false if there was none
+        static bool replay(io &device, std::size_t start, std::size_t blocks_no) {
+            auto stream = read_area(device, start, blocks_no);
+            if (utils::load_le(stream, 0, 4) != header_magic) {
+                return false;
+            }
+
+            auto sequence = utils::load_le(stream, 4, 4);
+            auto records_no = utils::load_le(stream, 8, 4);
+            std::size_t end = header_size;
+            for (std::size_t i = 0; i < records_no; i++) {
+                if (end + record_header_size > stream.size()) {
+                    return false;
+                }
+                end += record_header_size + utils::load_le(stream, end + 6, 2);
+            }
+            if (end > stream.size() || utils::load_le(stream, 12, 4) != checksum(stream, end, sequence)) {
+                // transaction was torn before its commit became durable
+                return false;
+            }
+
+            for (std::size_t pos = header_size; pos < end;) {
+                auto block_i = utils::load_le(stream, pos, 4);
+                auto offset = utils::load_le(stream, pos + 4, 2);
+                auto length = utils::load_le(stream, pos + 6, 2);
+                pos += record_header_size;
+                if (block_i >= device.get_blocks_no() || offset + length > device.get_block_size()) {
+                    return false;
+                }
+
+                auto block = device.acquire(block_i);
+                if (block.failed()) {
+                    return false;
+                }
+                std::copy(stream.begin() + (std::ptrdiff_t) pos, stream.begin() + (std::ptrdiff_t) (pos + length),
+                          block.data().begin() + (std::ptrdiff_t) offset);
+                block.mark_dirty();
+                pos += length;
+            }
+
+            auto header = device.acquire(start);
+            utils::store_le(header.data(), 0, 4, 0);
+            header.mark_dirty();
+            return true;
+        }
+
+        // marks bytes [offset, offset + length) of a cached metadata block as changed by current transaction
+        void log(std::size_t block, std::size_t offset, std::size_t length) {
+            std::lock_guard lock{_mutex};
+            if (_ranges.empty()) {
+                _first_change = std::chrono::steady_clock::now();
+            }
+            if (!_held.contains(block)) {
+                _held.emplace(block, _cache.acquire(block));
+                _cache.hold(block, true);
+            }
+
+            // merge with overlapping or adjacent ranges of the block
+            auto &ranges = _ranges[block];
+            _records_size -= records_size(ranges);
+            std::size_t end = offset + length;
+            auto it = ranges.upper_bound(offset);
+            if (it != ranges.begin() && std::prev(it)->second >= offset) {
+                --it;
+                offset = it->first;
+                end = std::max(end, it->second);
+                it = ranges.erase(it);
+            }
+            while (it != ranges.end() && it->first <= end) {
+                end = std::max(end, it->second);
+                it = ranges.erase(it);
+            }
+            ranges[offset] = end;
+            _records_size += records_size(ranges);
+        }
+
+        // writes transaction to the journal, makes it durable and then checkpoints held blocks home;
+        // called outside of operations, waits for those of other threads to end
+        bool commit(flush_stats &flushed) {
+            std::unique_lock lock{_mutex};
+            if (!_thread_depths.contains(std::this_thread::get_id())) {
+                _commit_waiters++;
+                _idle.wait(lock, [this] { return _depth == 0; });
+                _commit_waiters--;
+            }
+            auto res = commit_locked(flushed);
+            _idle.notify_all();
+            return res;
+        }
+
+        [[nodiscard]] const stats &get_stats() const {
+            return _stats;
+        }
+
+    private:
+        // blocks are packed into the journal in order; a transaction larger than the journal is split
+        // into journal-sized parts, each atomic by itself, and only such a transaction loses atomicity
+        bool commit_locked(flush_stats &flushed) {
+            if (_ranges.empty()) {
+                return true;
+            }
+
+            std::vector<std::size_t> part;
+            std::size_t size = header_size;
+            std::vector<std::size_t> blocks;
+            for (auto &[block_i, ranges]: _ranges) {
+                blocks.push_back(block_i);
+            }
+            for (auto block_i : blocks) {
+                auto cost = records_size(_ranges[block_i]);
+                if (!part.empty() && size + cost > capacity()) {
+                    if (!commit_part(part, flushed)) {
+                        return false;
+                    }
+                    part.clear();
+                    size = header_size;
+                }
+                part.push_back(block_i);
+                size += cost;
+            }
+            if (!commit_part(part, flushed)) {
+                return false;
+            }
+            _stats.commits++;
+
+            // checkpointed transaction must not be replayed over later changes
+            auto header = _cache.acquire(_start);
+            utils::store_le(header.data(), 0, 4, 0);
+            header.mark_dirty();
+            return true;
+        }
+
+        // writes records of held blocks to the journal and makes only the journal durable, then checkpoints
+        // the blocks home; the journal is overwritten only once blocks of the previous part are durable
+        bool commit_part(const std::vector<std::size_t> &blocks, flush_stats &flushed) {
+            if (!_checkpoint.empty()) {
+                if (!_cache.sync_blocks(_checkpoint, flushed)) {
+                    return false;
+                }
+                _checkpoint.clear();
+            }
+
+            const std::size_t block_size = _cache.get_block_size();
+            std::vector<std::byte> stream(_blocks_no * block_size, std::byte{0});
+            std::size_t pos = header_size;
+            std::size_t records_no = 0;
+            for (auto block_i : blocks) {
+                auto data = _held.at(block_i).data();
+                for (auto [offset, end]: records_of(_ranges[block_i])) {
+                    utils::store_le(stream, pos, 4, block_i);
+                    utils::store_le(stream, pos + 4, 2, offset);
+                    utils::store_le(stream, pos + 6, 2, end - offset);
+                    pos += record_header_size;
+                    std::copy(data.begin() + (std::ptrdiff_t) offset, data.begin() + (std::ptrdiff_t) end,
+                              stream.begin() + (std::ptrdiff_t) pos);
+                    pos += end - offset;
+                    records_no++;
+                }
+            }
+            assert(pos <= stream.size() && "Block doesn't fit into the journal");
+
+            _sequence++;
+            utils::store_le(stream, 0, 4, header_magic);
+            utils::store_le(stream, 4, 4, _sequence);
+            utils::store_le(stream, 8, 4, records_no);
+            utils::store_le(stream, 12, 4, checksum(stream, pos, _sequence));
+            std::vector<std::size_t> journal_blocks;
+            for (std::size_t i = 0; i * block_size < pos; i++) {
+                auto block = _cache.acquire(_start + i);
+                std::copy(stream.begin() + (std::ptrdiff_t) (i * block_size),
+                          stream.begin() + (std::ptrdiff_t) ((i + 1) * block_size), block.data().begin());
+                block.mark_dirty();
+                journal_blocks.push_back(_start + i);
+            }
+
+            // commit point: the journal is durable, held blocks are not touched
+            if (!_cache.sync_blocks(journal_blocks, flushed)) {
+                return false;
+            }
+            _stats.records += records_no;
+            _stats.bytes += pos;
+
+            for (auto block_i : blocks) {
+                auto it = _held.find(block_i);
+                _cache.hold(block_i, false);
+                it->second.mark_dirty();
+                _held.erase(it);
+                _records_size -= records_size(_ranges[block_i]);
+                _ranges.erase(block_i);
+            }
+            // a failed checkpoint is retried before the journal is written again
+            if (!_cache.sync_blocks(blocks, flushed)) {
+                _checkpoint = blocks;
+                return false;
+            }
+            return true;
+        }
+
+        // block changed in many places is logged whole, so each block fits into a journal of two blocks
+        [[nodiscard]] std::map<std::size_t, std::size_t> records_of(const std::map<std::size_t, std::size_t> &ranges) const {
+            if (records_size(ranges) == record_header_size + _cache.get_block_size()) {
+                return {{0, _cache.get_block_size()}};
+            }
+            return ranges;
+        }
+
+        [[nodiscard]] std::size_t records_size(const std::map<std::size_t, std::size_t> &ranges) const {
+            std::size_t size = 0;
+            for (auto [offset, end]: ranges) {
+                size += record_header_size + end - offset;
+            }
+            return std::min(size, record_header_size + _cache.get_block_size());
+        }
+
+        [[nodiscard]] std::size_t capacity() const {
+            return _blocks_no * _cache.get_block_size();
+        }
+
+        // journal which can't be read is seen as empty
+        static std::vector<std::byte> read_area(io &device, std::size_t start, std::size_t blocks_no) {
+            std::vector<std::byte> stream(blocks_no * device.get_block_size());
+            for (std::size_t i = 0; i < blocks_no; i++) {
+                if (!device.read_block(start + i, std::span{stream}.subspan(i * device.get_block_size()))) {
+                    std::fill(stream.begin(), stream.end(), std::byte{0});
+                    break;
+                }
+            }
+            return stream;
+        }
+
+        // FNV-1a over records, seeded with transaction sequence
+        static std::uint32_t checksum(const std::vector<std::byte> &stream, std::size_t end, std::uint64_t sequence) {
+            std::uint32_t hash = 2166136261u ^ (std::uint32_t) sequence;
+            for (std::size_t i = header_size; i < end; i++) {
+                hash = (hash ^ std::to_integer<std::uint32_t>(stream[i])) * 16777619u;
+            }
+            return hash;
+        }
+
+        [[nodiscard]] std::size_t pending_size() const {
+            return header_size + _records_size;
+        }
+
+        // group commit: transaction is committed once it fills half of the journal or gets old enough
+        [[nodiscard]] bool commit_due() const {
+            return !_ranges.empty() && (pending_size() * 2 >= capacity() ||
+                                        std::chrono::steady_clock::now() - _first_change >= _commit_interval);
+        }
+
+        // only the outermost operation of a thread is counted
+        void enter() {
+            std::unique_lock lock{_mutex};
+            if (_thread_depths[std::this_thread::get_id()]++ > 0) {
+                return;
+            }
+            _idle.wait(lock, [this] { return _commit_waiters == 0 && (_depth == 0 || !commit_due()); });
+            if (commit_due()) {
+                flush_stats flushed;
+                commit_locked(flushed);
+                _idle.notify_all();
+            }
+            _depth++;
+        }
+
+        void leave() {
+            std::lock_guard lock{_mutex};
+            auto it = _thread_depths.find(std::this_thread::get_id());
+            if (--it->second > 0) {
+                return;
+            }
+            _thread_depths.erase(it);
+            if (--_depth == 0) {
+                if (commit_due()) {
+                    flush_stats flushed;
+                    commit_locked(flushed);
+                }
+                _idle.notify_all();
+            }
+        }
+
+        block_cache &_cache;
+        std::size_t _start;
+        std::size_t _blocks_no;
+        std::chrono::milliseconds _commit_interval;
+
+        std::map<std::size_t, std::map<std::size_t, std::size_t>> _ranges; // (block) -> (range begin -> range end)
+        std::map<std::size_t, block_handle> _held;
+        std::size_t _records_size = 0; // bytes records of the transaction take in the journal
+        std::vector<std::size_t> _checkpoint; // blocks checkpointed by a part whose write-back failed
+        std::chrono::steady_clock::time_point _first_change;
+        std::size_t _depth = 0; // threads inside an operation
+        std::unordered_map<std::thread::id, std::size_t> _thread_depths; // nesting of operations of each thread
+        std::size_t _commit_waiters = 0;
+        std::uint32_t _sequence = 0;
+        stats _stats;
+
+        std::mutex _mutex;
+        std::condition_variable _idle; // notified when the last operation ends
+    };
+
+} //namespace lab_fs
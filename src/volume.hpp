@@ -0,0 +1,301 @@
+#pragma once
+
+#include <io.hpp>
+#include <io_engines.hpp>
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lab_fs {
+    namespace utils {
+        // block 0 of every member image: {magic (8 bytes), version, index of member, number of members,
+        // stripe unit in blocks, block size, blocks of the member} as 4-byte values
+        struct volume_header {
+            static constexpr std::uint64_t magic = 0x454D554C4F565346; // "FSVOLUME"
+            static constexpr std::uint64_t version = 1;
+            static constexpr std::size_t size = 32;
+
+            std::size_t member;
+            std::size_t members_no;
+            std::size_t stripe_blocks;
+            std::size_t block_size;
+            std::size_t blocks_no;
+
+            void write(std::span<std::byte> block) const {
+                store_le(block, 0, 8, magic);
+                store_le(block, 8, 4, version);
+                store_le(block, 12, 4, member);
+                store_le(block, 16, 4, members_no);
+                store_le(block, 20, 4, stripe_blocks);
+                store_le(block, 24, 4, block_size);
+                store_le(block, 28, 4, blocks_no);
+            }
+
+            static std::optional<volume_header> read(std::span<const std::byte> block) {
+                if (load_le(block, 0, 8) != magic || load_le(block, 8, 4) != version) {
+                    return std::nullopt;
+                }
+                return volume_header{load_le(block, 12, 4), load_le(block, 16, 4), load_le(block, 20, 4),
+                                     load_le(block, 24, 4), load_le(block, 28, 4)};
+            }
+
+            // reads header of an existing image without opening it as a device, which would resize it
+            static std::optional<volume_header> load(const std::string &path) {
+                int fd = ::open(path.c_str(), O_RDONLY);
+                if (fd == -1) {
+                    return std::nullopt;
+                }
+                std::vector<std::byte> block(size);
+                bool loaded = transfer_all(fd, {false, 0, block, nullptr});
+                ::close(fd);
+                return loaded ? read(block) : std::nullopt;
+            }
+
+            bool operator==(const volume_header &) const = default;
+        };
+
+        // image of k-th member: index goes before extension of the volume file, "v.fs" -> "v.0.fs"
+        inline std::string member_path(const std::string &path, std::size_t k) {
+            auto dot = path.rfind('.');
+            auto slash = path.rfind('/');
+            if (dot == std::string::npos || dot == 0 || (slash != std::string::npos && dot < slash)) {
+                return path + "." + std::to_string(k);
+            }
+            return path.substr(0, dot) + "." + std::to_string(k) + path.substr(dot);
+        }
+
+        // image with any content; an empty file is treated as missing, the same way opening it creates it
+        inline bool image_exists(const std::string &path) {
+            struct stat st{};
+            return ::stat(path.c_str(), &st) == 0 && st.st_size > 0;
+        }
+
+        inline void remove_images(const std::string &path, const volume_geometry &geometry) {
+            if (geometry.members_no == 1) {
+                ::unlink(path.c_str());
+                return;
+            }
+            for (std::size_t k = 0; k < geometry.members_no; k++) {
+                ::unlink(member_path(path, k).c_str());
+            }
+        }
+    } //namespace utils
+
+    // RAID-0 volume: stripe units of consecutive blocks go to member devices in turn,
+    // so long runs are moved by all members at once, each in its own thread.
+    // Block 0 of every member keeps the volume header, volume blocks follow it
+    class striped_io : public io {
+    public:
+        // runs of at least this many stripe units are fanned out to threads
+        static constexpr std::size_t parallel_units = 2;
+
+        striped_io(std::vector<std::unique_ptr<io>> members, std::size_t blocks_no, std::size_t stripe_blocks, std::string path) :
+                io{blocks_no, members.front()->get_block_size()},
+                _members{std::move(members)},
+                _stripe_blocks{stripe_blocks},
+                _path{std::move(path)} {}
+
+        std::span<std::byte> pin(std::size_t i) override {
+            auto [member, block] = locate(i);
+            return _members[member]->pin(block);
+        }
+
+        void unpin(std::size_t i, bool dirty) override {
+            auto [member, block] = locate(i);
+            _members[member]->unpin(block, dirty);
+        }
+
+        [[nodiscard]] bool load_failed(std::size_t i) override {
+            auto [member, block] = locate(i);
+            return _members[member]->load_failed(block);
+        }
+
+        using io::read_block;
+        using io::write_block;
+
+        bool read_block(std::size_t i, std::span<std::byte> dest) override {
+            auto [member, block] = locate(i);
+            return _members[member]->read_block(block, dest);
+        }
+
+        bool write_block(std::size_t i, std::span<const std::byte> src) override {
+            auto [member, block] = locate(i);
+            return _members[member]->write_block(block, src);
+        }
+
+        bool read_blocks(std::size_t i, std::span<std::byte> dest) override {
+            return transfer(std::array{block_transfer{i, dest, false}});
+        }
+
+        bool write_blocks(std::size_t i, std::span<const std::byte> src) override {
+            // members only read from data of a write
+            std::span<std::byte> data{const_cast<std::byte *>(src.data()), src.size()};
+            return transfer(std::array{block_transfer{i, data, true}});
+        }
+
+        // runs are cut at stripe unit borders and pieces are grouped by member; members of a batch
+        // long enough work in parallel, each on its own part
+        bool transfer(std::span<const block_transfer> batch) override {
+            std::vector<std::vector<block_transfer>> parts(_members.size());
+            std::size_t blocks = 0;
+            for (auto &run : batch) {
+                auto n = block_of(run.data.size());
+                assert(run.block + n <= _blocks_no);
+                for (std::size_t k = 0; k < n;) {
+                    auto [member, block] = locate(run.block + k);
+                    auto length = std::min(n - k, _stripe_blocks - (run.block + k) % _stripe_blocks);
+                    parts[member].push_back({block, run.data.subspan(k * _block_size, length * _block_size), run.write});
+                    k += length;
+                }
+                blocks += n;
+            }
+
+            std::size_t busy = 0;
+            for (auto &part : parts) {
+                busy += !part.empty();
+            }
+            if (busy < 2 || blocks < parallel_units * _stripe_blocks) {
+                bool res = true;
+                for (std::size_t m = 0; m < _members.size(); m++) {
+                    if (!parts[m].empty()) {
+                        res &= _members[m]->transfer(parts[m]);
+                    }
+                }
+                return res;
+            }
+
+            std::vector<char> results(_members.size(), true);
+            {
+                std::vector<std::jthread> threads;
+                for (std::size_t m = 0; m < _members.size(); m++) {
+                    if (!parts[m].empty()) {
+                        threads.emplace_back([this, m, &parts, &results] { results[m] = _members[m]->transfer(parts[m]); });
+                    }
+                }
+            }
+            return std::all_of(results.begin(), results.end(), [](char ok) { return ok; });
+        }
+
+        bool will_need(std::size_t i, std::size_t n) override {
+            bool res = true;
+            for (std::size_t k = 0; k < n;) {
+                auto [member, block] = locate(i + k);
+                auto length = std::min(n - k, _stripe_blocks - (i + k) % _stripe_blocks);
+                res &= _members[member]->will_need(block, length);
+                k += length;
+            }
+            return res;
+        }
+
+        bool sync(flush_stats &stats) override {
+            bool res = true;
+            for (auto &member : _members) {
+                res &= member->sync(stats);
+            }
+            return res;
+        }
+
+        [[nodiscard]] bool is_in_memory() const override {
+            return std::all_of(_members.begin(), _members.end(), [](auto &member) { return member->is_in_memory(); });
+        }
+
+        [[nodiscard]] bool is_backed_by(const std::string &path) const override {
+            return _path == path;
+        }
+
+        // blocks of one member, its header included, for a volume of `blocks_no` blocks
+        static std::size_t member_blocks_no(std::size_t blocks_no, const volume_geometry &geometry) {
+            auto row = geometry.members_no * geometry.stripe_blocks;
+            return (blocks_no + row - 1) / row * geometry.stripe_blocks + 1;
+        }
+
+    private:
+        // member keeping volume block i and block of it on the member
+        [[nodiscard]] std::pair<std::size_t, std::size_t> locate(std::size_t i) const {
+            assert(i < _blocks_no);
+            auto unit = i / _stripe_blocks;
+            return {unit % _members.size(), 1 + unit / _members.size() * _stripe_blocks + i % _stripe_blocks};
+        }
+
+        std::vector<std::unique_ptr<io>> _members;
+        std::size_t _stripe_blocks;
+        std::string _path;
+    };
+
+    // opens member images of a volume at `path`, or creates all of them if none exists;
+    // returns nullptr if an image could not be opened or doesn't belong to the volume, setting
+    // `mismatch` if images found belong to a volume of other geometry.
+    // Headers of existing images are checked before any image is opened, since opening resizes images
+    // and creates missing ones; images created by a failed open are removed
+    inline std::unique_ptr<io> open_volume(io_engine engine, const std::string &path, std::size_t blocks_no,
+                                           std::size_t block_size, const volume_geometry &geometry, bool &created,
+                                           bool &mismatch) {
+        assert(geometry.members_no > 0 && geometry.stripe_blocks > 0);
+        mismatch = false;
+        if (geometry.members_no == 1) {
+            return open_io(engine, path, blocks_no, block_size, created);
+        }
+        if (block_size < utils::volume_header::size) {
+            return nullptr;
+        }
+
+        const auto member_blocks_no = striped_io::member_blocks_no(blocks_no, geometry);
+        auto header_of = [&](std::size_t k) {
+            return utils::volume_header{k, geometry.members_no, geometry.stripe_blocks, block_size, member_blocks_no};
+        };
+        std::size_t found_no = 0;
+        for (std::size_t k = 0; k < geometry.members_no; k++) {
+            auto member_path = utils::member_path(path, k);
+            if (!utils::image_exists(member_path)) {
+                continue;
+            }
+            found_no++;
+            auto header = utils::volume_header::load(member_path);
+            if (!header) {
+                return nullptr;
+            }
+            if (*header != header_of(k)) {
+                mismatch = true;
+                return nullptr;
+            }
+        }
+        // a volume missing some of its images is not recreated over the rest
+        if (found_no != 0 && found_no != geometry.members_no) {
+            return nullptr;
+        }
+        created = found_no == 0;
+
+        std::vector<std::unique_ptr<io>> members;
+        std::vector<std::byte> block(block_size, std::byte{0});
+        for (std::size_t k = 0; k < geometry.members_no; k++) {
+            bool member_created = false;
+            auto member = open_io(engine, utils::member_path(path, k), member_blocks_no, block_size, member_created);
+            bool opened = member != nullptr;
+            if (opened && created) {
+                header_of(k).write(block);
+                opened = member->write_block(0, block.begin());
+            }
+            if (!opened) {
+                member.reset();
+                members.clear();
+                if (created) {
+                    utils::remove_images(path, geometry);
+                }
+                return nullptr;
+            }
+            members.push_back(std::move(member));
+        }
+        return std::make_unique<striped_io>(std::move(members), blocks_no, geometry.stripe_blocks, path);
+    }
+
+} //namespace lab_fs